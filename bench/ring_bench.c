@@ -0,0 +1,299 @@
+/* ring_bench.c -- sector throughput, pseudo terminal against shared memory rings
+ *
+ * Runs a server in single port mode twice, once on a pseudo terminal and
+ * once on a "shm:" port, and plays the client side: sync, then 's' reads
+ * of every sector of the image, over and over, each checked against the
+ * image file and ACKed, then 'E'. It reports sectors per second and the
+ * round trip of a sector for both.
+ *
+ * On the pty the client reads what the line holds, as an emulator bridged
+ * to a pty does. On the rings it behaves as an emulated ACIA: one byte per
+ * data register access, polling the ring for the receive flag. It rings
+ * the server once it waits for a reply (flexring_kick()), and only
+ * sleeps on its doorbell when the server takes long.
+ *
+ * Usage: ring_bench [-n sectors] <server binary> <disk image>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include "../flexring.h"
+
+#define ACK 0x06
+#define SECSIZE 256
+#define SPIN 1000                      // Polls of the ring before sleeping
+
+/* Client side of one transport */
+typedef struct {
+    int fd;                             // pty master
+    struct flexring_link ring;          // or rings, when fd < 0
+} link_t;
+
+static double now( void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put( link_t *l, const uint8_t *buf, int len)
+{
+    if (l->fd >= 0) {
+        write( l->fd, buf, len);
+        return;
+    }
+    for (int i = 0; i < len; i++)       // ACIA transmit register, a byte at a time
+        while (flexring_put( &l->ring.shm->to_server, buf + i, 1, -1) == 0)
+            flexring_kick( &l->ring.shm->to_server, l->ring.bell_server);
+}
+
+/**
+ * Read exactly len bytes from the server
+ *
+ * @return 0 on success, -1 on time-out or error
+ */
+static int get( link_t *l, uint8_t *buf, int len)
+{
+    struct pollfd pfd = { l->fd, POLLIN, 0 };
+    int n;
+
+    if (l->fd >= 0) {
+        while (len > 0) {
+            if (poll( &pfd, 1, 3000) <= 0)
+                return -1;
+            if ((n = read( l->fd, buf, len)) <= 0)
+                return -1;
+            buf += n;
+            len -= n;
+        }
+        return 0;
+    }
+
+    pfd.fd = l->ring.bell_client;
+    for (int i = 0; i < len; i++) {
+        int spin = 0;
+
+        // ACIA status register: receive register full?
+        while (flexring_avail( &l->ring.shm->to_client) == 0) {
+            uint64_t rung;
+
+            if (spin == 0)
+                flexring_kick( &l->ring.shm->to_server, l->ring.bell_server);
+            if (++spin < SPIN || flexring_wait( &l->ring.shm->to_client))
+                continue;
+            if (poll( &pfd, 1, 3000) <= 0)
+                return -1;
+            read( l->ring.bell_client, &rung, sizeof(rung));
+        }
+        flexring_get( &l->ring.shm->to_client, buf + i, 1, l->ring.bell_server);
+    }
+    return 0;
+}
+
+/**
+ * Client side of the benchmark
+ *
+ * @return 0 on success, 1 on a protocol error, 2 on a data mismatch
+ */
+static int client( link_t *l, const uint8_t *image, int ntrk, int nsec, int trk0,
+                   long count, double *secs)
+{
+    uint8_t cmd[4], frame[SECSIZE + 2], c;
+    double start;
+    long done = 0;
+    int tries;
+
+    for (tries = 0; tries < 50; tries++) {
+        c = 0x55;
+        put( l, &c, 1);
+        if (l->fd < 0 ? get( l, &c, 1) == 0 && c == 0x55 :
+            poll( &(struct pollfd){ l->fd, POLLIN, 0 }, 1, 100) > 0 &&
+            read( l->fd, &c, 1) == 1 && c == 0x55)
+            break;
+    }
+    if (tries == 50)
+        return 1;
+
+    start = now();
+    while (done < count) {
+        for (int t = 0; t <= ntrk && done < count; t++) {
+            for (int s = 1; s <= (t ? nsec : trk0) && done < count; s++, done++) {
+                long blk = t ? trk0 + (t - 1) * nsec + s - 1 : s - 1;
+                int chks = 0;
+
+                cmd[0] = 's';
+                cmd[1] = 0;
+                cmd[2] = t;
+                cmd[3] = s;
+                put( l, cmd, 4);
+                if (get( l, frame, SECSIZE + 2) < 0)
+                    return 1;
+                for (int i = 0; i < SECSIZE; i++)
+                    chks += frame[i];
+                if (memcmp( frame, image + blk * SECSIZE, SECSIZE) ||
+                    (chks & 0xFFFF) != frame[SECSIZE] * 256 + frame[SECSIZE + 1])
+                    return 2;
+                c = ACK;
+                put( l, &c, 1);
+            }
+        }
+    }
+    *secs = now() - start;
+
+    c = 'E';
+    put( l, &c, 1);
+    if (get( l, &c, 1) < 0 || c != ACK)
+        return 1;
+    return 0;
+}
+
+/**
+ * Serve an image on one transport and read count sectors through it
+ *
+ * @return Seconds taken, -1 on failure
+ */
+static double run( char *server, char *name, const uint8_t *image, long nblk, int ring, long count)
+{
+    int ntrk = image[2 * SECSIZE + 0x26], nsec = image[2 * SECSIZE + 0x27];
+    int trk0 = (ntrk + 1) * nsec == nblk ? nsec : nblk - ntrk * nsec;
+    char device[128], sock[64];
+    link_t l = { .fd = -1 };
+    struct termios tio;
+    double secs = -1;
+    int status, err;
+    pid_t srv;
+
+    if (nsec == 0 || trk0 <= 0 || trk0 > nsec) {
+        fprintf( stderr, "%s: unsupported geometry\n", name);
+        return -1;
+    }
+    if (ring) {
+        snprintf( sock, sizeof(sock), "/tmp/ring_bench.%d", (int)getpid());
+        snprintf( device, sizeof(device), "shm:%s", sock);
+    } else {
+        if ((l.fd = posix_openpt( O_RDWR | O_NOCTTY)) < 0 ||
+            grantpt( l.fd) < 0 || unlockpt( l.fd) < 0) {
+            perror( "pty");
+            return -1;
+        }
+        snprintf( device, sizeof(device), "%s", ptsname( l.fd));
+        tcgetattr( l.fd, &tio);
+        cfmakeraw( &tio);
+        tcsetattr( l.fd, TCSANOW, &tio);
+    }
+
+    if ((srv = fork()) == 0) {
+        int null = open( "/dev/null", O_WRONLY);
+
+        dup2( null, STDOUT_FILENO);
+        execl( server, server, "-d", device, "-s", "19200", name, (char *)NULL);
+        perror( server);
+        _exit( 127);
+    }
+
+    // Wait for the server to listen
+    for (int tries = 0; ring && tries < 100; tries++) {
+        if (flexring_attach( sock, &l.ring) == 0)
+            break;
+        usleep( 20000);
+        if (tries == 99) {
+            fprintf( stderr, "%s: cannot attach\n", sock);
+            kill( srv, SIGTERM);
+            waitpid( srv, &status, 0);
+            return -1;
+        }
+    }
+
+    if ((err = client( &l, image, ntrk, nsec, trk0, count, &secs)) != 0) {
+        fprintf( stderr, "%s: %s\n", name, err == 2 ? "sector data mismatch" : "protocol error");
+        kill( srv, SIGTERM);
+        secs = -1;
+    }
+    waitpid( srv, &status, 0);
+    if (ring) {
+        flexring_detach( &l.ring);
+        unlink( sock);
+    } else {
+        close( l.fd);
+    }
+    return secs;
+}
+
+/**
+ * Load a disk image in memory
+ *
+ * @return Image, NULL on error (*nblk is its size in sectors)
+ */
+static uint8_t *load( char *name, long *nblk)
+{
+    struct stat st;
+    uint8_t *image;
+    int fd;
+
+    if ((fd = open( name, O_RDONLY)) < 0 || fstat( fd, &st) < 0) {
+        perror( name);
+        return NULL;
+    }
+    *nblk = st.st_size / SECSIZE;
+    if (*nblk < 3 || (image = malloc( st.st_size)) == NULL ||
+        read( fd, image, st.st_size) != st.st_size) {
+        fprintf( stderr, "%s: cannot read image\n", name);
+        close( fd);
+        return NULL;
+    }
+    close( fd);
+    return image;
+}
+
+int main( int argc, char **argv)
+{
+    static const char *names[2] = { "pty", "shm rings" };
+    long count = 20000, nblk;
+    uint8_t *image;
+    int opt;
+
+    while ((opt = getopt( argc, argv, "n:")) != -1) {
+        if (opt != 'n' || (count = atol( optarg)) <= 0) {
+            fprintf( stderr, "Usage: %s [-n sectors] <server binary> <disk image>\n", argv[0]);
+            exit( 1);
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf( stderr, "Usage: %s [-n sectors] <server binary> <disk image>\n", argv[0]);
+        exit( 1);
+    }
+    signal( SIGPIPE, SIG_IGN);
+    if ((image = load( argv[optind + 1], &nblk)) == NULL)
+        return 1;
+
+    printf( "%-10s %8s %12s %10s %12s\n", "link", "sectors", "sectors/s", "KiB/s", "us/sector");
+    for (int ring = 0; ring < 2; ring++) {
+        double secs = run( argv[optind], argv[optind + 1], image, nblk, ring, count);
+
+        if (secs < 0)
+            return 1;
+        printf( "%-10s %8ld %12.0f %10.0f %12.1f\n", names[ring], count, count / secs,
+                count / secs / 4, secs * 1e6 / count);
+    }
+    free( image);
+    return 0;
+}
@@ -0,0 +1,211 @@
+/* sector_bench.c -- count the system calls a NetPC server makes per sector
+ *
+ * Runs a server in single port mode on a pseudo terminal, under ptrace,
+ * and plays the client side: sync, then N 's' sector reads (each ACKed),
+ * then 'E'. The run is done twice, with 0 and N sectors, so that start-up
+ * and exit are subtracted and only the sector path is reported.
+ *
+ * Usage: sector_bench [-n sectors] <server binary> <disk image>
+ *
+ * Example, per-byte stdio server against the event loop server:
+ *   bench/sector_bench ./flexnet disk.dsk
+ *   bench/sector_bench ./flexnet_multiport disk.dsk
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <linux/ptrace.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+
+#define ACK 0x06
+#define MAXSYS 512
+
+// System calls reported on their own, everything else is summed up
+static const struct { long nr; const char *name; } watched[] = {
+    { SYS_read, "read" },
+    { SYS_write, "write" },
+    { SYS_readv, "readv" },
+    { SYS_writev, "writev" },
+    { SYS_lseek, "lseek" },
+    { SYS_pread64, "pread64" },
+    { SYS_pwrite64, "pwrite64" },
+    { SYS_epoll_wait, "epoll_wait" },
+#ifdef SYS_epoll_pwait
+    { SYS_epoll_pwait, "epoll_pwait" },
+#endif
+    { SYS_clock_gettime, "clock_gettime" },
+};
+#define NWATCHED (int)(sizeof(watched) / sizeof(watched[0]))
+
+/**
+ * Read exactly len bytes from the pty master (client side)
+ *
+ * @return 0 on success, -1 on time-out or error
+ */
+static int get( int fd, uint8_t *buf, int len)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int n;
+
+    while (len > 0) {
+        if (poll( &pfd, 1, 3000) <= 0)
+            return -1;
+        if ((n = read( fd, buf, len)) <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Client side of the benchmark
+ */
+static int client( int fd, int nsect)
+{
+    uint8_t cmd[4], frame[258], c;
+    int tries;
+
+    // Sync, the server may not be listening yet
+    for (tries = 0; tries < 50; tries++) {
+        c = 0x55;
+        write( fd, &c, 1);
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll( &pfd, 1, 100) > 0 && read( fd, &c, 1) == 1 && c == 0x55)
+            break;
+    }
+    if (tries == 50)
+        return 1;
+
+    for (int i = 0; i < nsect; i++) {
+        cmd[0] = 's';
+        cmd[1] = 0;
+        cmd[2] = 1 + i / 10 % 30;       // Stay within a 31 track disk
+        cmd[3] = 1 + i % 10;
+        write( fd, cmd, 4);
+        if (get( fd, frame, sizeof(frame)) < 0)
+            return 1;
+        c = ACK;
+        write( fd, &c, 1);
+    }
+
+    c = 'E';
+    write( fd, &c, 1);
+    return get( fd, &c, 1) < 0 || c != ACK;
+}
+
+/**
+ * Run the server under ptrace and count its system calls
+ *
+ * @return Number of calls of each syscall number in count[]
+ */
+static int run( char *server, char *image, int nsect, long *count)
+{
+    char *slave;
+    int master, status;
+    pid_t srv, cli;
+    struct termios tio;
+    struct ptrace_syscall_info info;
+
+    memset( count, 0, MAXSYS * sizeof(long));
+    if ((master = posix_openpt( O_RDWR | O_NOCTTY)) < 0 ||
+        grantpt( master) < 0 || unlockpt( master) < 0) {
+        perror( "pty");
+        return -1;
+    }
+    slave = ptsname( master);
+    tcgetattr( master, &tio);
+    cfmakeraw( &tio);
+    tcsetattr( master, TCSANOW, &tio);
+
+    if ((srv = fork()) == 0) {
+        ptrace( PTRACE_TRACEME, 0, NULL, NULL);
+        raise( SIGSTOP);
+        execl( server, server, "-d", slave, "-s", "19200", image, (char *)NULL);
+        perror( server);
+        _exit( 127);
+    }
+    waitpid( srv, &status, 0);
+    ptrace( PTRACE_SETOPTIONS, srv, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+
+    if ((cli = fork()) == 0)
+        _exit( client( master, nsect));
+
+    ptrace( PTRACE_SYSCALL, srv, NULL, NULL);
+    while (waitpid( srv, &status, 0) == srv && !WIFEXITED( status) && !WIFSIGNALED( status)) {
+        int sig = 0;
+
+        if (WIFSTOPPED( status) && WSTOPSIG( status) == (SIGTRAP | 0x80)) {
+            if (ptrace( PTRACE_GET_SYSCALL_INFO, srv, sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY && info.entry.nr < MAXSYS)
+                count[info.entry.nr]++;
+        } else if (WIFSTOPPED( status) && WSTOPSIG( status) != SIGTRAP) {
+            sig = WSTOPSIG( status);
+        }
+        ptrace( PTRACE_SYSCALL, srv, NULL, sig);
+    }
+
+    waitpid( cli, &status, 0);
+    close( master);
+    return WIFEXITED( status) && WEXITSTATUS( status) == 0 ? 0 : -1;
+}
+
+int main( int argc, char **argv)
+{
+    static long base[MAXSYS], full[MAXSYS];
+    int opt, nsect = 1000;
+    long other = 0, total = 0;
+
+    while ((opt = getopt( argc, argv, "n:")) != -1) {
+        if (opt == 'n')
+            nsect = atoi( optarg);
+        else
+            break;
+    }
+    if (optind + 2 != argc || nsect <= 0) {
+        fprintf( stderr, "Usage: %s [-n sectors] <server binary> <disk image>\n", argv[0]);
+        exit( 1);
+    }
+
+    if (run( argv[optind], argv[optind + 1], 0, base) < 0 ||
+        run( argv[optind], argv[optind + 1], nsect, full) < 0) {
+        fprintf( stderr, "Benchmark run failed\n");
+        exit( 1);
+    }
+
+    printf( "%s: %d sectors\n", argv[optind], nsect);
+    for (int nr = 0; nr < MAXSYS; nr++) {
+        long n = full[nr] - base[nr];
+        int w;
+
+        total += n;
+        for (w = 0; w < NWATCHED && watched[w].nr != nr; w++)
+            ;
+        if (w == NWATCHED)
+            other += n;
+        else if (n)
+            printf( "  %-14s %8.2f per sector\n", watched[w].name, (double)n / nsect);
+    }
+    if (other)
+        printf( "  %-14s %8.2f per sector\n", "(other)", (double)other / nsect);
+    printf( "  %-14s %8.2f per sector\n", "total", (double)total / nsect);
+    return 0;
+}
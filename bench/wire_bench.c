@@ -0,0 +1,295 @@
+/* wire_bench.c -- bytes on the wire per sector, plain and compressed frames
+ *
+ * Runs a server in single port mode on a pseudo terminal, once as is and
+ * once with -z, and plays the client side: sync, 'X' asking for compressed
+ * frames (second run only), then an 's' read of every sector of the image,
+ * each checked against the image file and ACKed, then 'E'. It reports the
+ * average frame size and what it means in time per sector on a real line.
+ *
+ * Usage: wire_bench <server binary> <disk image>...
+ *
+ * Example, over a few real FLEX disks:
+ *   bench/wire_bench ./flexnet_multiport FLEX9.DSK UTILS.DSK SOURCES.DSK
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+
+#define ACK 0x06
+#define SECSIZE 256
+#define CAP_RLE 0x04
+
+/* Result of one run over an image */
+typedef struct {
+    long sectors;                       // Sectors read
+    long bytes;                         // Frame bytes received for them
+    long empty;                         // Sectors all of one byte value
+} run_t;
+
+/**
+ * Read exactly len bytes from the pty master (client side)
+ *
+ * @return 0 on success, -1 on time-out or error
+ */
+static int get( int fd, uint8_t *buf, int len)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int n;
+
+    while (len > 0) {
+        if (poll( &pfd, 1, 3000) <= 0)
+            return -1;
+        if ((n = read( fd, buf, len)) <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Receive the data bytes of a frame, compressed or not
+ *
+ * @return Bytes received, -1 on time-out or a bad encoding
+ */
+static int get_sector( int fd, uint8_t *sector, int rle)
+{
+    uint8_t c;
+    int n = 0, wire = 0;
+
+    if (!rle)
+        return get( fd, sector, SECSIZE) < 0 ? -1 : SECSIZE;
+    while (n < SECSIZE) {
+        if (get( fd, &c, 1) < 0)
+            return -1;
+        wire++;
+        if (c < 0x80) {             // c+1 bytes as is
+            if (n + c + 1 > SECSIZE || get( fd, sector + n, c + 1) < 0)
+                return -1;
+            n += c + 1;
+            wire += c + 1;
+        } else {                    // c-$7D copies of the next byte
+            if (n + c - 0x7D > SECSIZE || get( fd, sector + n, 1) < 0)
+                return -1;
+            memset( sector + n + 1, sector[n], c - 0x7D - 1);
+            n += c - 0x7D;
+            wire++;
+        }
+    }
+    return wire;
+}
+
+/**
+ * Client side of the benchmark
+ *
+ * @return 0 on success, 1 on a protocol error, 2 on a data mismatch
+ */
+static int client( int fd, const uint8_t *image, int ntrk, int nsec, int trk0, int rle, int out)
+{
+    uint8_t cmd[4], sector[SECSIZE], sum[2], c;
+    run_t r = { 0, 0, 0 };
+    int tries;
+
+    // Sync, the server may not be listening yet
+    for (tries = 0; tries < 50; tries++) {
+        c = 0x55;
+        write( fd, &c, 1);
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll( &pfd, 1, 100) > 0 && read( fd, &c, 1) == 1 && c == 0x55)
+            break;
+    }
+    if (tries == 50)
+        return 1;
+
+    if (rle) {
+        uint8_t caps[3];
+
+        cmd[0] = 'X';
+        cmd[1] = 1;
+        cmd[2] = CAP_RLE;
+        write( fd, cmd, 3);
+        if (get( fd, caps, 3) < 0 || !(caps[2] & CAP_RLE))
+            return 1;
+    }
+
+    for (int t = 0; t <= ntrk; t++) {
+        for (int s = 1; s <= (t ? nsec : trk0); s++) {
+            long blk = t ? trk0 + (t - 1) * nsec + s - 1 : s - 1;
+            const uint8_t *want = image + blk * SECSIZE;
+            int wire, chks = 0;
+
+            cmd[0] = 's';
+            cmd[1] = 0;
+            cmd[2] = t;
+            cmd[3] = s;
+            write( fd, cmd, 4);
+            if ((wire = get_sector( fd, sector, rle)) < 0 || get( fd, sum, 2) < 0)
+                return 1;
+            for (int i = 0; i < SECSIZE; i++)
+                chks += sector[i];
+            if (memcmp( sector, want, SECSIZE) || (chks & 0xFFFF) != sum[0] * 256 + sum[1])
+                return 2;
+            c = ACK;
+            write( fd, &c, 1);
+            r.sectors++;
+            r.bytes += wire + 2;
+            if (memcmp( want, want + 1, SECSIZE - 1) == 0)
+                r.empty++;
+        }
+    }
+
+    c = 'E';
+    write( fd, &c, 1);
+    if (get( fd, &c, 1) < 0 || c != ACK)
+        return 1;
+    write( out, &r, sizeof(r));
+    return 0;
+}
+
+/**
+ * Serve an image and read it all through the server
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int run( char *server, char *name, const uint8_t *image, long nblk, int rle, run_t *r)
+{
+    int ntrk = image[2 * SECSIZE + 0x26], nsec = image[2 * SECSIZE + 0x27];
+    int trk0 = (ntrk + 1) * nsec == nblk ? nsec : nblk - ntrk * nsec;
+    char *slave;
+    int master, pipefd[2], status;
+    pid_t srv, cli;
+    struct termios tio;
+
+    if (nsec == 0 || trk0 <= 0 || trk0 > nsec) {
+        fprintf( stderr, "%s: unsupported geometry\n", name);
+        return -1;
+    }
+    if ((master = posix_openpt( O_RDWR | O_NOCTTY)) < 0 ||
+        grantpt( master) < 0 || unlockpt( master) < 0 || pipe( pipefd) < 0) {
+        perror( "pty");
+        return -1;
+    }
+    slave = ptsname( master);
+    tcgetattr( master, &tio);
+    cfmakeraw( &tio);
+    tcsetattr( master, TCSANOW, &tio);
+
+    if ((srv = fork()) == 0) {
+        int null = open( "/dev/null", O_WRONLY);
+
+        dup2( null, STDOUT_FILENO);
+        if (rle)
+            execl( server, server, "-z", "-d", slave, "-s", "19200", name, (char *)NULL);
+        else
+            execl( server, server, "-d", slave, "-s", "19200", name, (char *)NULL);
+        perror( server);
+        _exit( 127);
+    }
+    if ((cli = fork()) == 0)
+        _exit( client( master, image, ntrk, nsec, trk0, rle, pipefd[1]));
+    close( pipefd[1]);
+
+    waitpid( cli, &status, 0);
+    if (!WIFEXITED( status) || WEXITSTATUS( status) != 0 ||
+        read( pipefd[0], r, sizeof(*r)) != sizeof(*r)) {
+        fprintf( stderr, "%s: %s\n", name, WIFEXITED( status) && WEXITSTATUS( status) == 2 ?
+                 "sector data mismatch" : "protocol error");
+        kill( srv, SIGTERM);
+        waitpid( srv, &status, 0);
+        close( pipefd[0]);
+        close( master);
+        return -1;
+    }
+    waitpid( srv, &status, 0);
+    close( pipefd[0]);
+    close( master);
+    return 0;
+}
+
+/**
+ * Load a disk image in memory
+ *
+ * @return Image, NULL on error (*nblk is its size in sectors)
+ */
+static uint8_t *load( char *name, long *nblk)
+{
+    struct stat st;
+    uint8_t *image;
+    int fd;
+
+    if ((fd = open( name, O_RDONLY)) < 0 || fstat( fd, &st) < 0) {
+        perror( name);
+        return NULL;
+    }
+    *nblk = st.st_size / SECSIZE;
+    if (*nblk < 3 || (image = malloc( st.st_size)) == NULL ||
+        read( fd, image, st.st_size) != st.st_size) {
+        fprintf( stderr, "%s: cannot read image\n", name);
+        close( fd);
+        return NULL;
+    }
+    close( fd);
+    return image;
+}
+
+int main( int argc, char **argv)
+{
+    run_t plain, rle, all_plain = { 0, 0, 0 }, all_rle = { 0, 0, 0 };
+    int status = 0;
+
+    if (argc < 3) {
+        fprintf( stderr, "Usage: %s <server binary> <disk image>...\n", argv[0]);
+        exit( 1);
+    }
+    signal( SIGPIPE, SIG_IGN);
+
+    printf( "%-20s %8s %7s %9s %9s %7s\n", "image", "sectors", "empty", "plain", "rle", "ratio");
+    for (int i = 2; i < argc; i++) {
+        long nblk;
+        uint8_t *image = load( argv[i], &nblk);
+
+        if (image == NULL ||
+            run( argv[1], argv[i], image, nblk, 0, &plain) < 0 ||
+            run( argv[1], argv[i], image, nblk, 1, &rle) < 0) {
+            free( image);
+            status = 1;
+            continue;
+        }
+        free( image);
+        printf( "%-20s %8ld %6.1f%% %9.1f %9.1f %6.1f%%\n", argv[i], rle.sectors,
+                100.0 * rle.empty / rle.sectors, (double)plain.bytes / plain.sectors,
+                (double)rle.bytes / rle.sectors, 100.0 * rle.bytes / plain.bytes);
+        all_plain.sectors += plain.sectors;
+        all_plain.bytes += plain.bytes;
+        all_rle.sectors += rle.sectors;
+        all_rle.bytes += rle.bytes;
+    }
+    if (all_rle.sectors == 0)
+        return 1;
+
+    // 10 bits per byte on the line (8N1)
+    printf( "\nAverage bytes on the wire per sector: %.1f plain, %.1f compressed\n",
+            (double)all_plain.bytes / all_plain.sectors, (double)all_rle.bytes / all_rle.sectors);
+    for (int baud = 9600; baud <= 19200; baud *= 2)
+        printf( "At %5d baud: %.1f ms per sector plain, %.1f ms compressed\n", baud,
+                10000.0 * all_plain.bytes / all_plain.sectors / baud,
+                10000.0 * all_rle.bytes / all_rle.sectors / baud);
+    return status;
+}
@@ -0,0 +1,180 @@
+/* flexdelta.c -- show, merge or discard the delta of a FlexNet overlay drive
+ *
+ * An overlay drive (overlay: in the YAML configuration) serves a base
+ * image it never writes; the sectors the client writes go to a delta file
+ * of its own (see delta_open() in flexnet_final.c):
+ *   0   "FLXDELTA"
+ *   8   sectors of the image, 32 bits big endian
+ *   16  one bit per sector, MSB first, set once the delta holds it
+ *   then the sectors, from the next 4 KiB boundary, at their image offset
+ *
+ * Usage: flexdelta info <delta>
+ *        flexdelta merge <delta> <image>   write the sectors into the image,
+ *                                          then empty the delta
+ *        flexdelta discard <delta>         empty the delta
+ *
+ * The server reads the bitmap when it mounts the drive: stop it (or mount
+ * another image on that drive) before merging or discarding.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+
+#define SECSIZE 256
+#define DELTA_MAGIC "FLXDELTA"
+#define DELTA_HDR   16
+#define DELTA_DATA(n) ((DELTA_HDR + ((n) + 7) / 8 + 4095L) & ~4095L)
+
+/* A delta file, loaded */
+typedef struct {
+    char *name;
+    int fd;
+    int nblk;                           // Sectors of the image
+    uint8_t *bits;                      // (nblk + 7) / 8 bytes
+} delta_t;
+
+/**
+ * Open a delta file and read its bitmap
+ *
+ * @return 0 on success, -1 on error (reported)
+ */
+static int delta_load( delta_t *d, char *name, int mode)
+{
+    uint8_t hdr[DELTA_HDR];
+    int len;
+
+    d->name = name;
+    if ((d->fd = open( name, mode)) < 0) {
+        perror( name);
+        return -1;
+    }
+    if (read( d->fd, hdr, DELTA_HDR) != DELTA_HDR || memcmp( hdr, DELTA_MAGIC, 8)) {
+        fprintf( stderr, "%s: not a FlexNet delta\n", name);
+        return -1;
+    }
+    d->nblk = hdr[8] << 24 | hdr[9] << 16 | hdr[10] << 8 | hdr[11];
+    len = (d->nblk + 7) / 8;
+    if (d->nblk <= 0 || (d->bits = malloc( len)) == NULL ||
+        pread( d->fd, d->bits, len, DELTA_HDR) != len) {
+        fprintf( stderr, "%s: bad sector map\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Empty a delta: clear its bitmap and give its sectors back
+ *
+ * @return 0 on success, -1 on error (reported)
+ */
+static int delta_clear( delta_t *d)
+{
+    int len = (d->nblk + 7) / 8;
+
+    memset( d->bits, 0, len);
+    if (pwrite( d->fd, d->bits, len, DELTA_HDR) != len ||
+        ftruncate( d->fd, DELTA_HDR + len) < 0 || fsync( d->fd) < 0) {
+        perror( d->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int held( const delta_t *d, int blk)
+{
+    return d->bits[blk / 8] & (0x80 >> (blk % 8));
+}
+
+static int info( delta_t *d)
+{
+    int n = 0, t = 0;
+
+    for (int blk = 0; blk < d->nblk; blk++)
+        n += held( d, blk) != 0;
+    printf( "%s: %d of %d sectors written\n", d->name, n, d->nblk);
+    for (int blk = 0; blk < d->nblk; blk++) {
+        if (!held( d, blk))
+            continue;
+        printf( "%s%d", t++ % 16 ? " " : "  ", blk);
+        if (t % 16 == 0)
+            printf( "\n");
+    }
+    if (t % 16)
+        printf( "\n");
+    return 0;
+}
+
+/**
+ * Write the sectors of a delta into its image, then empty the delta
+ *
+ * The image is synced before the delta is cleared, so an interrupted
+ * merge can be run again.
+ */
+static int merge( delta_t *d, char *image)
+{
+    uint8_t sector[SECSIZE];
+    struct stat st;
+    int fd, n = 0;
+
+    if ((fd = open( image, O_RDWR)) < 0 || fstat( fd, &st) < 0) {
+        perror( image);
+        return -1;
+    }
+    if (st.st_size != (off_t)d->nblk * SECSIZE) {
+        fprintf( stderr, "%s: %ld sectors, the delta is of a %d sector image\n",
+                 image, (long)(st.st_size / SECSIZE), d->nblk);
+        close( fd);
+        return -1;
+    }
+    for (int blk = 0; blk < d->nblk; blk++) {
+        if (!held( d, blk))
+            continue;
+        if (pread( d->fd, sector, SECSIZE, DELTA_DATA( d->nblk) + (off_t)blk * SECSIZE) != SECSIZE ||
+            pwrite( fd, sector, SECSIZE, (off_t)blk * SECSIZE) != SECSIZE) {
+            fprintf( stderr, "%s: cannot merge sector %d\n", image, blk);
+            close( fd);
+            return -1;
+        }
+        n++;
+    }
+    if (fsync( fd) < 0) {
+        perror( image);
+        close( fd);
+        return -1;
+    }
+    close( fd);
+    printf( "%s: %d sectors merged into %s\n", d->name, n, image);
+    return delta_clear( d);
+}
+
+static void usage( char *cmd)
+{
+    fprintf( stderr, "Usage: %s info <delta>\n"
+                     "       %s merge <delta> <image>\n"
+                     "       %s discard <delta>\n", cmd, cmd, cmd);
+}
+
+int main( int argc, char **argv)
+{
+    delta_t d;
+
+    if (argc == 3 && strcmp( argv[1], "info") == 0)
+        return delta_load( &d, argv[2], O_RDONLY) < 0 || info( &d) < 0;
+    if (argc == 4 && strcmp( argv[1], "merge") == 0)
+        return delta_load( &d, argv[2], O_RDWR) < 0 || merge( &d, argv[3]) < 0;
+    if (argc == 3 && strcmp( argv[1], "discard") == 0)
+        return delta_load( &d, argv[2], O_RDWR) < 0 || delta_clear( &d) < 0;
+    usage( argv[0]);
+    return 1;
+}
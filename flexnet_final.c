@@ -27,6 +27,9 @@
  * - Q:   Quick drive ready check
  * - V:   Query drive letter (MS-DOS compatibility, ignored)
  * - ?:   Query current directory
+ * - T:   Send consecutive sectors of a track (extension)
+ * - L:   Stream a FLEX sector chain, a whole file (extension)
+ * - X:   Agree on protocol extensions with the client
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -43,6 +46,8 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#define _GNU_SOURCE         // strcasecmp(), strncasecmp()
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
@@ -60,13 +65,29 @@
 #include <syslog.h>
 #include <errno.h>
 #include <stdarg.h>
+#ifndef FLEXNET_LIBRARY
 #include <yaml.h>
+#endif
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <asm/ioctls.h>     // TCGETS2, TCSETS2 (<asm/termbits.h> clashes with <termios.h>)
+#include "flexring.h"
+#include "libflexnet.h"
 
 /* Version Information */
 #define VERSION "2.2.0"
 #define PROGRAM_NAME "flexnet"
-#define MAX_PORTS 8
+#define MAX_PORTS 256        // Serial lines are few, emulators on sockets many
 #define MAX_DRIVES_PER_PORT 4
 
 /* Constants and Protocol Definitions */
@@ -81,119 +102,437 @@
 #define NAK 0x15    // Negative Acknowledge (error response)
 #define ESC 0x1B    // Escape character (27)
 
-/* Port Configuration Structure for Multi-Port Support */
+// Per-port line buffers (a sector frame is 259 bytes at most)
+#define RXBUFSIZE 1024      // Input ring, must be a power of 2
+#define TXBUFSIZE 4096
+#define TXROOM    512       // Room for the largest single answer (frame, listing entry)
+#define FRAMESIZE (SECSIZE + 2)
+
+// Default time a client may stay silent in the middle of a command (ms)
+#define CMD_TIMEOUT 5000
+
+// FLEX disk layout (sectors as 0xTTSS)
+#define SIR_TTSS    0x0003  // System Information Record
+#define SIR_FREE    0x1D    // SIR: first free, last free (t/s), free sectors
+#define DIR_TTSS    0x0005  // First directory sector
+#define DIR_ENTRIES 10      // Entries per directory sector, after a 16-byte header
+#define DIR_ENTSIZE 24
+#define MAP_ENTRIES 168     // Random files: (t, s, count) from byte 4 of the first 2 sectors
+
+// FLEX error numbers, sent after the NAK of an 'F' command
+#define FE_EXISTS   3       // File exists
+#define FE_NOTFOUND 4       // File not found
+#define FE_DIRERR   5       // System directory error
+#define FE_DIRFULL  6       // Directory full (no sector left to extend it)
+#define FE_FULL     7       // All sectors in use
+#define FE_READ     9       // Disk read error
+#define FE_WRITE    10      // Disk write error
+#define FE_WPROT    11      // Disk write protected
+#define FE_ADDRESS  14      // Illegal disk address (broken link or sector map)
+#define FE_DRIVE    15      // Illegal drive number
+#define FE_NOTREADY 16      // Drive not ready
+#define FE_NAME     21      // Illegal file specification
+#define FE_MAPFULL  23      // Sector map overflow
+
+// Per-port protocol parser states (see port_feed())
+#define PS_IDLE  0  // Waiting for a command byte
+#define PS_HDR   1  // S/R: receiving [drive] [track] [sector]
+#define PS_DATA  2  // R: receiving [256 data bytes] [MSB] [LSB], N: the name
+#define PS_PARAM 3  // Receiving CR-terminated parameter(s)
+#define PS_PACE  4  // RLIST: waiting for the pacing byte after the parameter
+#define PS_ACK   5  // Sector sent, waiting for client ACK/NAK
+#define PS_LIST  6  // RDIR/RLIST in progress, waiting for client pacing byte
+#define PS_BULK  7  // T: sectors left to send as the line drains
+#define PS_CHAIN 8  // L: streaming a sector chain, ACKs come back as it goes
+
+// Port transports, from the device name (see port_open())
+#define LINK_SERIAL 0   // Serial line (/dev/ttyS0...), set up with termios
+#define LINK_TCP    1   // tcp://[host]:port, listening for one client at a time
+#define LINK_UNIX   2   // unix:/path, likewise on a Unix socket
+#define LINK_SHM    3   // shm:/path, a Unix socket handing out shared memory rings
+#define LINK_SESSION 4  // No line: bytes come and go through libflexnet.h
+
+// Serial line flow control (see port_open())
+#define FLOW_NONE    0  // None, RTS/CTS handshake turned off
+#define FLOW_RTSCTS  1  // RTS/CTS hardware handshake (CRTSCTS)
+#define FLOW_XONXOFF 2  // Refused: $11/$13 are data on this 8-bit binary link
+
+// Line speeds outside the Bxxx table (see line_speed()), as in the
+// generic <asm/termbits.h>. PowerPC, MIPS, Alpha and SPARC lay termios2
+// out their own way: they keep to the Bxxx rates
+#if defined(TCGETS2) && (defined(__x86_64__) || defined(__i386__) || \
+    defined(__aarch64__) || defined(__arm__) || defined(__riscv))
+#define HAVE_TERMIOS2
+struct termios2 {
+    tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed, c_ospeed;
+};
+#ifndef BOTHER
+#define BOTHER  0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT 16          // Input speed bits, above the output ones
+#endif
+#endif
+
+// Disk image I/O backends (see dsk_read()/dsk_write())
+#define IO_MMAP  0  // Image mapped MAP_SHARED, sectors sent from the mapping
+#define IO_PREAD 1  // pread()/pwrite() through the drive sector buffer
+
+// When sector writes reach the disk (see dsk_write() and wb_flush())
+#define DUR_NONE     0  // Left to the kernel, like write() was
+#define DUR_ASYNC    1  // Writeback started after each sector write
+#define DUR_SYNC     2  // Each sector write is on disk before the ACK
+#define DUR_INTERVAL 3  // Written back together, a delay after the first one
+#define DUR_IDLE     4  // Written back together once the line is quiet
+
+#define WB_DELAY 1000       // Default write-back delay (ms)
+#define WB_MAX   256        // Sectors held for write-back
+
+#define CACHE_SIZE 1024     // Default sector cache budget (KiB, see cache_init())
+
+// Sector cache queues (2Q: recent once, recent ghosts, frequent)
+#define Q_A1IN  0
+#define Q_A1OUT 1
+#define Q_AM    2
+
+/* Sector cache entry, ghost entries (Q_A1OUT) keep no data */
+typedef struct {
+    dev_t dev;                          // Image device
+    ino_t ino;                          // Image inode
+    int blk;                            // Block number in the image
+    int queue;                          // Q_xxx
+    int slot;                           // Data slot, -1 for a ghost
+    int prev, next;                     // Queue links
+    int hnext;                          // Hash chain
+} cache_node_t;
+
+// Directories whose RDIR/RLIST names are kept (see listing_get())
+#define LISTING_MAX 16
+
+// Device of the drives an emulator serves (flexnet_attach()): no file
+// system has it, each drive gets an inode of its own
+#define DEV_BACKEND ((dev_t)-1)
+
+// Images whose geometry is remembered (see geometry_find())
+#define GEOMETRY_MAX 64
+
+/* Geometry cache entry: what load_dsk() made of an image, as long as the
+ * image has the same size and modification time */
+typedef struct {
+    dev_t dev;                          // Image device
+    ino_t ino;                          // Image inode, 0 if the slot is free
+    struct timespec mtime;              // Image state it holds for
+    off_t size;
+    uint8_t nbtrk, nbsec, track0l;      // Geometry (see load_dsk())
+    uint8_t id[13];                     // SIR label and volume number (0x10-0x1C)
+    uint8_t maxtrk, maxsec;             // SIR size (0x26, 0x27)
+    unsigned long used;                 // Last use, the oldest is evicted
+} geometry_t;
+
+/* Names found in a directory, shared by the listing cache and the ports
+ * sending them */
+typedef struct {
+    int refs;                           // Holders, freed with the last one
+    int n;                              // Number of names
+    char **name;                        // Sorted, case folded (names_compare())
+} names_t;
+
+/* Listing cache entry: what RDIR and RLIST show of one directory */
+typedef struct {
+    char path[256];                     // Directory, "" if the slot is free
+    dev_t dev;                          // Its device and inode, the key: ports may
+    ino_t ino;                          // know one directory under different paths
+    int wd;                             // Its inotify watch
+    names_t *dsk;                       // .DSK files, NULL once stale
+    names_t *dirs;                      // Subdirectories, NULL once stale
+    unsigned long used;                 // Last use, the oldest is evicted
+} listing_t;
+
+/* Protocol Extensions ('X' command), granted only to clients that ask */
+#define CAP_VERSION 2       // Version of the extension set
+#define CAP_BITS    5       // Capability bits per byte, so bytes stay below 0x20
+#define CAP_BULK    0x01    // 'T' command, several sectors per request
+#define CAP_NOQ     0x02    // Drives are always ready, 'Q' checks can be skipped
+#define CAP_RLE     0x04    // Compressed sector frames (see rle_encode()), if enabled
+#define CAP_CHAIN   0x08    // 'L' command, a whole sector chain per request
+#define CAP_COPY    0x10    // 'F' command, files copied between drives by the server
+#define CAP_LOOKUP  0x20    // 'N' command, directory lookups (version 2, second byte)
+#define CAP_OFFERED (CAP_BULK | CAP_NOQ | CAP_CHAIN | CAP_COPY | CAP_LOOKUP)
+
+#define CHAIN_WINDOW 8      // Most L frames waiting for their ACK
+
+// Adaptive pacing of the output (see pace_count() and port_flush())
+#define PACE_WINDOW 16      // Frames answered per NAK count
+#define PACE_NAKS   2       // NAKs in a window that slow the output down
+#define PACE_MAX    6       // Slowest level: 8 byte chunks, 6 ms gaps
+#define PACE_CHUNK  256     // Bytes per write at level 1, halved at each level
+
+#define RLE_MINRUN 3        // Shortest run worth repeating
+#define RLE_MAXRUN 130      // Longest run in one token ($FF)
+#define RLE_MAXLIT 128      // Longest literal in one token ($7F)
+
+// Overlay delta file (see delta_open()): header, sector bitmap, sectors
+#define DELTA_MAGIC "FLXDELTA"
+#define DELTA_HDR   16      // Magic, image sectors (32 bits, big endian), reserved
+#define DELTA_DATA(n) ((DELTA_HDR + ((n) + 7) / 8 + 4095L) & ~4095L)   // Sector 0
+
+#define PREFETCH_MAX   8    // Sectors read ahead per drive
+#define PREFETCH_DEPTH 1    // Default number of successors read ahead
+
+/* Sector read ahead of the client along a FLEX link chain */
+typedef struct {
+    int pos;                            // Byte offset in the image
+    const uint8_t *data;                // Sector (mapping or buf), NULL if free
+    long long cost;                     // Time the read took (us)
+    uint8_t buf[SECSIZE];               // Sector copy when not mapped
+} prefetch_t;
+
+/* FLEX directory entry, in the index of a mounted image (see dir_index()) */
+typedef struct {
+    char name[13];                      // "NAME.EXT", as getname() formats it
+    uint16_t ttss;                      // Directory sector holding it
+    uint8_t off;                        // Its offset in the sector
+    uint8_t entry[DIR_ENTSIZE];         // The entry itself
+} dir_entry_t;
+
+/* Drive Structure: one mounted disk image and its geometry */
 typedef struct {
-    char device[64];                    // Serial device path
-    int speed;                          // Baud rate
-    struct {
-        char disk_image[256];           // Disk image file path
-        int fd_disk;                    // Disk image file descriptor
-        int ready;                      // Disk mounted and ready
-        int readonly;                   // Disk is read-only
-        char *diskname;                 // Just filename part
-        uint8_t nbtrk;                  // Number of tracks
-        uint8_t nbsec;                  // Sectors per track
-        uint8_t track0l;                // Track 0 sectors
-        uint8_t bloc[SECSIZE];          // Sector buffer
-    } drives[MAX_DRIVES_PER_PORT];      // Up to 4 drives per port (A:, B:, C:, D:)
-    FILE *serial;                       // Serial port handle
-    char curdir[256];                   // Current directory for this port
+    char disk_image[256];               // Disk image file path
+    int fd_disk;                        // Disk image file descriptor
+    int ready;                          // Disk mounted and ready
+    int readonly;                       // Disk is read-only
+    char *diskname;                     // Just filename part
+    uint8_t nbtrk;                      // Number of tracks
+    uint8_t nbsec;                      // Sectors per track
+    uint8_t track0l;                    // Track 0 sectors
+    dev_t dev;                          // Image device and inode, the
+    ino_t ino;                          // sector cache key with the block
+    int io;                             // I/O backend (IO_xxx)
+    int durability;                     // Write policy (DUR_xxx)
+    uint8_t *map;                       // Image mapping (IO_MMAP), NULL if not mapped
+    size_t mapsize;                     // Mapped length
+    int dirty_lo, dirty_hi;             // Mapped bytes to write back
+    uint8_t bloc[SECSIZE];              // Sector buffer
+    int prefetch;                       // Successors to read ahead (0 = off)
+    prefetch_t ahead[PREFETCH_MAX];     // Sectors read ahead
+    int iahead;                         // Next ahead[] slot to reuse
+    unsigned long pf_hits;              // Requests answered from ahead[]
+    unsigned long pf_misses;            // Requests that had to be read
+    long long pf_saved;                 // Read time spared to the client (us)
+    dir_entry_t *dir;                   // Directory index sorted by name, NULL until
+    int ndir;                           // the first lookup or after a directory write
+    int *dirblk;                        // Directory sectors (blocks) it was built from
+    int ndirblk;
+    int dir_partial;                    // Some entries could not be indexed
+    char overlay[256];                  // Delta file of an overlay drive, "" if none
+    uint8_t *delta;                     // Sectors held by the delta (bitmap), NULL
+    int fd_delta;                       // unless an overlay is mounted
+    int ndelta;                         // Number of sectors held
+    int delta_blks;                     // Sectors the bitmap covers, those of the image
+    long delta_data;                    // Offset of sector 0 in the delta
+    int delta_sync;                     // Delta written since the last write back
+    const flexnet_disk_t *backend;      // Sectors served by an embedding emulator,
+    void *backend_ctx;                  // NULL for an image file (flexnet_attach())
+    int unit;                           // Drive number, for the backend
+} flex_drive_t;
+
+/* Port Structure: configuration and session state of one serial line
+ *
+ * Everything a command handler needs lives here, so ports are served
+ * independently of each other. A libflexnet session is a port with no
+ * line (LINK_SESSION). */
+typedef struct flexnet_session {
+    char device[128];                   // Serial device path, tcp://, unix: or shm: address
+    int speed;                          // Baud rate (serial lines only)
+    int baud;                           // Rate the line runs at, as the driver set it
+    int transport;                      // LINK_xxx
+    int listen_fd;                      // Listening socket (LINK_TCP, LINK_UNIX, LINK_SHM)
+    flex_drive_t drives[MAX_DRIVES_PER_PORT];   // Up to 4 drives per port (A:, B:, C:, D:)
+    char curdir[256];                   // Current directory for this port (RCD, '?')
+    int dirfd;                          // The same, opened O_PATH: names are resolved from it
     int num_drives;                     // Number of drives configured for this port
+    int routed;                         // Drives served apart (bit mask, see port_drive())
+
+    /* Runtime state, driven by the event loop */
+    int link;                           // Serial line file descriptor (non-blocking)
+    int ended;                          // LINK_SESSION: the client sent REXIT
+    struct flexring_shm *shm;           // LINK_SHM: rings shared with the client,
+    int bell;                           // its doorbell for us (watched),
+    int peer_bell;                      // and ours for it (see flexring.h)
+    int events;                         // epoll events currently watched
+    int timeout;                        // Max silence inside a command (ms)
+    int durability;                     // Write policy of its drives (DUR_xxx)
+    int wb_delay;                       // Write-back delay (ms)
+    long long flush_at;                 // When to write back (0 = nothing to write)
+    long long deadline;                 // When the current command times out (0 = none)
+    int state;                          // Parser state (PS_xxx)
+    int cmd;                            // Command being received
+    int count;                          // Bytes received in the current state
+    int nparam;                         // Parameters still expected
+    uint8_t hdr[4];                     // S/R/T/L [drive] [track] [sector], T [count],
+                                        // L [window], X [version] [caps] [caps],
+                                        // N [drive], m [drive], d [drive],
+                                        // F [source drive] [destination drive],
+                                        // RLIST pacing byte
+    int nbulk;                          // T: sectors still to send,
+                                        // L: frames sent, not ACKed yet
+    int nchain;                         // L: sectors left before a looping chain is
+                                        // cut, 0 = end mark next, -1 = end mark sent
+    int caps;                           // Extensions granted (CAP_xxx), until next sync
+    int compress;                       // Compressed frames may be granted (CAP_RLE)
+    unsigned long frames;               // Sector frames sent
+    unsigned long frame_bytes;          // Their size on the wire
+    int flow;                           // Serial line flow control (FLOW_xxx)
+    int pacing;                         // Adaptive pacing enabled (see pace_count())
+    int pace;                           // Pacing level, 0 = full speed
+    int pace_frames;                    // Frames answered in the current window,
+    int pace_naks;                      // and how many were NAKed
+    unsigned long naks;                 // Frames NAKed since start
+    long long pace_at;                  // When the next chunk may be written
+    uint8_t data[FRAMESIZE];            // R sector data and checksum, N name
+    char arg[128];                      // Command parameter (param[] in NetPC)
+    uint8_t rxbuf[RXBUFSIZE];           // Input ring: received, not yet parsed
+    unsigned rxhead;                    // Ring read index (free running)
+    unsigned rxtail;                    // Ring write index (free running)
+    uint8_t txbuf[TXBUFSIZE];           // Bytes waiting to be written to the line
+    int txlen;                          // Number of bytes in txbuf
+    names_t *names;                     // RDIR/RLIST names (a reference is held)
+    int nlist;                          // End of the entries to send in names
+    int ilist;                          // Next entry to send
 } port_config_t;
 
+#ifndef FLEXNET_LIBRARY
 // Help message
 void usage( char *cmd) {
     fprintf( stderr, "FlexNet %s - NetPC server for Flex systems\n", VERSION);
     fprintf( stderr, "Usage: %s [-h] => this help\n", cmd);
     fprintf( stderr, "       %s [-V] => show version\n", cmd);
     fprintf( stderr, "       %s [-v] [-D] -c <config.yaml>\n", cmd);
-    fprintf( stderr, "       %s [-v] [-D] -d <device> -s <speed> disk_image\n", cmd);
+    fprintf( stderr, "       %s [-v] [-D] [-z] [-a] [-t <timeout>] [-i <io>] [-w <durability>] [-p <n>] [-f <flow>] -d <device> -s <speed> disk_image\n", cmd);
     fprintf( stderr, "Options:\n");
     fprintf( stderr, " -c <config> : YAML configuration file (multi-port mode)\n");
-    fprintf( stderr, " -d <device> : serial line to use (single port mode)\n");
-    fprintf( stderr, " -s <speed> : baudrate to use (single port mode)\n");
+    fprintf( stderr, " -d <device> : serial line to use (single port mode), or\n");
+    fprintf( stderr, "               tcp://host:port, unix:/path or shm:/path to listen on\n");
+    fprintf( stderr, " -s <speed> : baudrate to use, any the adapter can make (single port mode,\n");
+    fprintf( stderr, "              serial lines)\n");
+    fprintf( stderr, " -t <timeout> : seconds a client may stall inside a command (default 5)\n");
+    fprintf( stderr, " -i <io> : disk image access, mmap (default) or pread\n");
+    fprintf( stderr, " -w <durability> : when sector writes reach the disk, none (default),\n");
+    fprintf( stderr, "                   async, sync, interval or on-idle\n");
+    fprintf( stderr, " -p <n> : sectors read ahead along FLEX file chains, 0-%d (default %d)\n",
+             PREFETCH_MAX, PREFETCH_DEPTH);
+    fprintf( stderr, " -z : offer compressed sector frames to clients that ask\n");
+    fprintf( stderr, " -f <flow> : serial line flow control, none (default) or rtscts\n");
+    fprintf( stderr, " -a : slow the output down while the client NAKs frames (adaptive pacing)\n");
     fprintf( stderr, " -v : verbose debug output\n");
     fprintf( stderr, " -D : run as daemon (background)\n");
     fprintf( stderr, " -V : show version and exit\n");
     fprintf( stderr, " -h : show this help\n");
     fprintf( stderr, "\nMulti-drive support: Each port can serve up to 4 disk images (drives A-D)\n");
 }
+#endif
 
 /* Global Variables */
 
+#ifndef FLEXNET_LIBRARY     // Options of the daemon
 /* Serial Communication */
-char line[32];              // Serial device path (/dev/ttyS0, /dev/ttyUSB0, etc.)
-int  speed = 0;             // Serial line speed in baud (e.g., 19200 for Microbox)
-FILE *serial;               // Serial port file handle for communication
+static char line[128];             // Serial device path (/dev/ttyS0, /dev/ttyUSB0, etc.)
+static int  speed = 0;             // Serial line speed in baud (e.g., 19200 for Microbox)
+static int  timeout = CMD_TIMEOUT; // Command timeout in ms (single port mode)
+
+/* Disk Image Access (defaults for every drive, see -i, -w and -p) */
+static const char *io_names[] = { "mmap", "pread", NULL };
+static const char *durability_names[] = { "none", "async", "sync", "interval", "on-idle", NULL };
+static const char *flow_names[] = { "none", "rtscts", "xonxoff", NULL };
+static int  io_backend = IO_MMAP;
+static int  durability = DUR_NONE;
+static int  prefetch_depth = PREFETCH_DEPTH;
+static int  compress = 0;          // Offer compressed frames (-z, single port mode)
+static int  flow = FLOW_NONE;      // Serial line flow control (-f, single port mode)
+static int  pacing = 0;            // Adaptive pacing (-a, single port mode)
+#endif
 
 /* Command Processing */
-char param[128];            // Buffer for NetPC command parameters
 static int verbose = 0;     // Debug output flag (set with -v option)
 
-/* Directory Management */
-char curdir[256];           // Current working directory path
-
-/* Disk Image Management */
-char filename[256];         // Full path to the current disk image file
-char *diskname;             // Pointer to just the disk image filename (no path)
-int fd;                     // File descriptor for the open disk image
-int ready;                  // Flag: is a disk image currently mounted and ready?
-int readonly;               // Flag: is the current disk image read-only?
-
-/* Disk Geometry and I/O */
-uint8_t bloc[SECSIZE];      // Sector buffer for read/write operations (256 bytes)
-uint8_t nbtrk;              // Number of data tracks on the disk (from SIR)
-uint8_t nbsec;              // Number of sectors per track (from SIR)
-uint8_t track0l;            // Number of sectors on track 0 (may differ from nbsec)
-
 /* Multi-Port Support Variables */
 static port_config_t ports[MAX_PORTS];  // Array of port configurations
-static int num_ports = 0;               // Number of configured ports (0 = single-port mode)
+static int num_ports = 0;               // Number of configured ports
 static char config_file[256] = "";      // YAML configuration file path
 static int daemon_mode = 0;             // Run as daemon flag
+#ifndef FLEXNET_LIBRARY
 static char *pid_file = "/var/run/flexnet.pid";  // Daemon PID file
+#endif
+static volatile sig_atomic_t stats_requested = 0;  // SIGUSR1 received
+static volatile sig_atomic_t stop_requested = 0;   // SIGTERM or SIGINT received
+
+/* Sector Cache, shared by all ports and drives */
+static int cache_kb = CACHE_SIZE;       // Data budget in KiB (0 = no cache)
+static struct {
+    int nslots;                         // Sectors that fit in the budget
+    int used;                           // Slots handed out so far
+    int kin, kout;                      // Max A1in entries, max ghosts
+    uint8_t *data;                      // nslots sectors
+    cache_node_t *node;                 // nslots + kout + 1 entries
+    int nnodes, freenode;               // Pool size, free list
+    int *hash;                          // Bucket heads (hmask + 1)
+    unsigned hmask;
+    struct { int head, tail, len; } q[3];
+    unsigned long hits, misses, evictions;
+} cache;
+
+/* Write-back Buffer: sectors ACKed, not yet written (interval, on-idle) */
+static struct {
+    flex_drive_t *drv;                  // Drive that will write it
+    int blk;                            // Block number in the image
+    uint8_t data[SECSIZE];
+} wb[WB_MAX];
+static int wb_count = 0;
+
+/* Listing Cache, shared by all ports */
+static struct {
+    int fd;                             // inotify descriptor, -1 = nothing kept
+    listing_t dir[LISTING_MAX];
+    unsigned long clock;                // Use counter
+    unsigned long hits, scans;
+} listings = { .fd = -1 };
+
+/* Geometry Cache, shared by all ports */
+static struct {
+    geometry_t img[GEOMETRY_MAX];
+    unsigned long clock;                // Use counter
+    unsigned long hits, misses;
+} geometries;
 
 /**
- * Convert Flex track/sector address to linear block number in disk image (multi-drive version)
- * 
- * @param port Pointer to port configuration
- * @param drive_num Drive number (0-3 for A-D)
- * @param ntrk Track number (0-based)
- * @param nsec Sector number (1-based, except track 0 sector 0 is valid)
- * @return Linear block number (0-based), or -1 if invalid track/sector
+ * Logging function that works in both daemon and console modes
  */
-int ts2blk_multi(port_config_t *port, int drive_num, uint8_t ntrk, uint8_t nsec)
-{
-    if (drive_num < 0 || drive_num >= port->num_drives || drive_num >= MAX_DRIVES_PER_PORT) {
-        return -1;
-    }
+void log_message(int priority, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
     
-    // Validate track and sector numbers
-    if (ntrk > port->drives[drive_num].nbtrk || nsec > port->drives[drive_num].nbsec || 
-        (nsec == 0 && ntrk != 0)) {
-        return -1;
-    }
-
-    if (ntrk == 0) {        // Track 0 has special handling
-        if (nsec == 0) {    // Track 0, sector 0 is valid (Boot sector)
-            return 0;
-        } else {
-            return (nsec - 1);  // Track 0 sectors are 0-based in image
-        }
+    if (daemon_mode) {
+        vsyslog(priority, format, args);
     } else {
-        // Other tracks: skip track 0, then count full tracks, then add sector
-        return port->drives[drive_num].track0l + (ntrk - 1) * port->drives[drive_num].nbsec + nsec - 1;
+        vprintf(format, args);
+        printf("\n");
     }
+    
+    va_end(args);
 }
 
 /**
- * Convert Flex track/sector address to linear block number in disk image (legacy single-drive version)
+ * Convert Flex track/sector address to linear block number in disk image
  * 
  * Flex uses track/sector addressing, but Unix files are linear. This function
  * converts between the two addressing schemes, handling the complexity that
  * track 0 may have a different number of sectors than other tracks (common
  * in double-density disks with single-density track 0).
  * 
+ * @param drv Drive holding the disk geometry
  * @param ntrk Track number (0-based)
  * @param nsec Sector number (1-based, except track 0 sector 0 is valid)
  * @return Linear block number (0-based), or -1 if invalid track/sector
@@ -205,10 +544,10 @@ int ts2blk_multi(port_config_t *port, int drive_num, uint8_t ntrk, uint8_t nsec)
  * - ...
  * - Track N: sectors 1 to nbsec          [nbsec sectors]
  */
-int ts2blk( uint8_t ntrk, uint8_t nsec)
+int ts2blk( flex_drive_t *drv, uint8_t ntrk, uint8_t nsec)
 {
     // Validate track and sector numbers
-    if (ntrk > nbtrk || nsec > nbsec || (nsec == 0 && ntrk != 0)) {
+    if (ntrk > drv->nbtrk || nsec > drv->nbsec || (nsec == 0 && ntrk != 0)) {
         return( -1);
     }
 
@@ -220,8 +559,45 @@ int ts2blk( uint8_t ntrk, uint8_t nsec)
         }
     } else {
         // Other tracks: skip track 0, then count full tracks, then add sector
-        return track0l + (ntrk - 1) * nbsec + nsec - 1;
+        return drv->track0l + (ntrk - 1) * drv->nbsec + nsec - 1;
+    }
+}
+
+/**
+ * Convert Flex track/sector address to linear block number (multi-drive version)
+ * 
+ * @param port Pointer to port configuration
+ * @param drive_num Drive number (0-3 for A-D)
+ * @param ntrk Track number (0-based)
+ * @param nsec Sector number (1-based, except track 0 sector 0 is valid)
+ * @return Linear block number (0-based), or -1 if invalid drive/track/sector
+ */
+int ts2blk_multi(port_config_t *port, int drive_num, uint8_t ntrk, uint8_t nsec)
+{
+    if (drive_num < 0 || drive_num >= port->num_drives || drive_num >= MAX_DRIVES_PER_PORT) {
+        return -1;
     }
+    return ts2blk( &port->drives[drive_num], ntrk, nsec);
+}
+
+/**
+ * Get the drive a command addresses by its drive byte
+ *
+ * Drives configured with an image, or mounted with 'm' (even if that
+ * failed), are served separately. Other drive numbers are served by
+ * drive 0, the one RMOUNT mounts, as they were before drives were told
+ * apart: a client that maps any FLEX drive to the host and mounts with
+ * RMOUNT keeps working.
+ *
+ * @param p Port the command was received on
+ * @param drv Drive byte of the command
+ * @return The drive (never NULL)
+ */
+flex_drive_t *port_drive( port_config_t *p, int drv)
+{
+    if (drv < 0 || drv >= p->num_drives || !(p->routed & (1 << drv)))
+        return &p->drives[0];
+    return &p->drives[drv];
 }
 
 /**
@@ -271,103 +647,196 @@ int getname( uint8_t *pos, char *name, int dot)
 }
 
 /**
- * Load and validate a Flex disk image file
- * 
- * This function opens a disk image file, validates it as a proper Flex disk,
- * extracts geometry information from the System Information Record (SIR),
- * and sets up global variables for disk access.
- * 
- * @param name Path to the disk image file to load
- * @return 0 on success, -1 on error
- * 
- * FLEX DISK STRUCTURE:
- * - Sector 0,0: Boot sector (if bootable)
- * - Sector 0,1: System Information Record (SIR) - unused
- * - Sector 0,2: Directory Information Record (DIR) - contains disk geometry
- * - Sector 0,3+: Directory entries
- * 
- * GEOMETRY DETECTION:
- * The function analyzes the disk size and SIR data to determine:
- * - Single Density: all tracks have same number of sectors
- * - Double Density: track 0 may have fewer sectors (SD format)
- * - Custom geometry: handles unusual configurations
- * 
- * GLOBAL VARIABLES SET:
- * - fd: file descriptor for the disk image
- * - ready: set to 1 if disk loaded successfully
- * - readonly: set based on file permissions
- * - nbtrk, nbsec, track0l: disk geometry parameters
- * - filename, diskname: file path information
+ * Find the geometry entry of an image, whatever its state
+ *
+ * @return The entry, NULL if the image has none
  */
-int load_dsk( char *name)
+geometry_t *geometry_of( dev_t dev, ino_t ino)
 {
+    for (int i = 0; i < GEOMETRY_MAX; i++)
+        if (geometries.img[i].ino == ino && geometries.img[i].dev == dev && ino)
+            return &geometries.img[i];
+    return NULL;
+}
 
-    struct stat dsk_stat;
-    int size;
-    int nb_sectors;
-    char label[16];
-    int volnum;
-    int last_trk_sec;	
-    int freesec; 
-
-    strncpy( filename, name, sizeof(filename) - 1);
-    filename[sizeof(filename) - 1] = '\0';
-    diskname = strrchr( filename, '/');
-    if (diskname == NULL)
-        diskname = filename;
-    else
-        diskname++;
+/**
+ * Get the geometry of an image if it is known
+ *
+ * load_dsk() keeps what it found out about each image it validated, so
+ * mounting it again skips reading and checking the SIR. The entry holds
+ * while the image keeps its size and modification time.
+ *
+ * @param st Image status (stat())
+ * @return The entry, NULL if the image has to be checked
+ */
+geometry_t *geometry_find( const struct stat *st)
+{
+    geometry_t *g = geometry_of( st->st_dev, st->st_ino);
 
-    if (stat( filename, &dsk_stat)) {
-        if (verbose)
-            perror( filename); 
-        return -1;
+    if (g == NULL || g->size != st->st_size || g->mtime.tv_sec != st->st_mtim.tv_sec ||
+        g->mtime.tv_nsec != st->st_mtim.tv_nsec) {
+        geometries.misses++;
+        return NULL;
     }
+    g->used = ++geometries.clock;
+    geometries.hits++;
+    return g;
+}
 
-    // Open disk image
-    diskname = strrchr( filename, '/');
-    if (diskname == NULL)
-        diskname = filename;
-    else
-        diskname++;
+/**
+ * Remember the geometry found for an image
+ *
+ * @param st Image status (stat())
+ * @param sir Its SIR
+ */
+void geometry_put( const struct stat *st, const uint8_t *sir,
+                   uint8_t nbtrk, uint8_t nbsec, uint8_t track0l)
+{
+    geometry_t *g = geometry_of( st->st_dev, st->st_ino);
 
-    size = dsk_stat.st_size;
+    if (g == NULL) {                    // Least recently used, free slots first
+        g = &geometries.img[0];
+        for (int i = 1; i < GEOMETRY_MAX; i++)
+            if (geometries.img[i].used < g->used)
+                g = &geometries.img[i];
+    }
+    g->dev = st->st_dev;
+    g->ino = st->st_ino;
+    g->mtime = st->st_mtim;
+    g->size = st->st_size;
+    g->nbtrk = nbtrk;
+    g->nbsec = nbsec;
+    g->track0l = track0l;
+    memcpy( g->id, sir + 0x10, sizeof(g->id));
+    g->maxtrk = sir[0x26];
+    g->maxsec = sir[0x27];
+    g->used = ++geometries.clock;
+}
 
-    if (dsk_stat.st_mode & S_IWUSR) {
-        if ((fd = open( filename, O_RDWR)) < 0) {
-            if (verbose)
-                perror( diskname);
-            return -1;
-        }
-        readonly = 0;
-    } else {
-        if ((fd = open( filename, O_RDONLY)) < 0 ) {
-            if (verbose)
-                perror( diskname);
-            return -1;
+/**
+ * Open the delta file of an overlay drive
+ *
+ * An overlay drive serves a base image it never writes, so many ports
+ * can share one copy of it (its mapping, or its sectors in the sector
+ * cache). The sectors written by the client go to the delta, a sparse
+ * file private to the drive:
+ * - DELTA_MAGIC, then the number of sectors of the image (big endian)
+ * - one bit per sector, MSB first, set once the delta holds the sector
+ * - the sectors themselves from DELTA_DATA(), at their offset in the image
+ * A missing or empty delta file is created. flexdelta merges a delta into
+ * its image, or discards it.
+ *
+ * @param drv Drive, its base image loaded
+ * @param dirfd Directory a relative delta name is resolved from
+ * @param nblk Number of sectors of the image
+ * @return 0 on success, -1 on error
+ */
+int delta_open( flex_drive_t *drv, int dirfd, int nblk)
+{
+    uint8_t hdr[DELTA_HDR] = DELTA_MAGIC;
+    int len = (nblk + 7) / 8;
+    struct stat st;
+
+    if ((drv->fd_delta = openat( dirfd, drv->overlay, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+        fstat( drv->fd_delta, &st) < 0) {
+        perror( drv->overlay);
+        goto fail;
+    }
+    if ((drv->delta = calloc( 1, len)) == NULL)
+        goto fail;
+
+    if (st.st_size == 0) {
+        hdr[8] = nblk >> 24;
+        hdr[9] = nblk >> 16;
+        hdr[10] = nblk >> 8;
+        hdr[11] = nblk;
+        if (pwrite( drv->fd_delta, hdr, DELTA_HDR, 0) != DELTA_HDR ||
+            pwrite( drv->fd_delta, drv->delta, len, DELTA_HDR) != len) {
+            perror( drv->overlay);
+            goto fail;
         }
-        readonly = 1;
+    } else if (pread( drv->fd_delta, hdr, DELTA_HDR, 0) != DELTA_HDR ||
+               memcmp( hdr, DELTA_MAGIC, 8) ||
+               (hdr[8] << 24 | hdr[9] << 16 | hdr[10] << 8 | hdr[11]) != nblk ||
+               pread( drv->fd_delta, drv->delta, len, DELTA_HDR) != len) {
+        fprintf( stderr, "%s: not a delta of a %d sector image\n", drv->overlay, nblk);
+        goto fail;
     }
 
-    lseek( fd, SECSIZE*2, SEEK_SET);
+    drv->ndelta = 0;
+    for (int i = 0; i < len; i++)
+        drv->ndelta += __builtin_popcount( drv->delta[i]);
+    drv->delta_blks = nblk;
+    drv->delta_data = DELTA_DATA( nblk);
+    drv->delta_sync = 0;
+    drv->readonly = 0;
+    if (verbose)
+        printf( "Overlay %s: %d sectors written over %s\n", drv->overlay, drv->ndelta, drv->diskname);
+    return 0;
 
-    if (read( fd, bloc, SECSIZE) != SECSIZE)
-        return -1;
+fail:
+    if (drv->fd_delta >= 0)
+        close( drv->fd_delta);
+    drv->fd_delta = -1;
+    free( drv->delta);
+    drv->delta = NULL;
+    return -1;
+}
 
-    nb_sectors = size / SECSIZE;
+/**
+ * Write a sector of an overlay drive to its delta
+ *
+ * The sector is written before its bit, so a crash in between leaves the
+ * sector as the image has it. The delta only holds sectors of the image:
+ * ts2blk() lets through the rest of a partial last track, which an overlay
+ * cannot grow into.
+ *
+ * @return 0 on success, -1 on error
+ */
+int delta_write( flex_drive_t *drv, int blk, const uint8_t *data)
+{
+    uint8_t *bits = drv->delta + blk / 8, bit = 0x80 >> (blk % 8);
 
-    if (nb_sectors * SECSIZE != size) {
-        fprintf( stderr, "Disk size don't match an integer number of sectors: %u bytes left]\n",
-                 size % SECSIZE);
+    if (blk >= drv->delta_blks)
         return -1;
+    if (pwrite( drv->fd_delta, data, SECSIZE, drv->delta_data + (off_t)blk * SECSIZE) != SECSIZE)
+        return -1;
+    if (!(*bits & bit)) {
+        *bits |= bit;
+        drv->ndelta++;
+        if (pwrite( drv->fd_delta, bits, 1, DELTA_HDR + blk / 8) != 1)
+            return -1;
     }
+    if (drv->durability == DUR_SYNC && fdatasync( drv->fd_delta) < 0)
+        return -1;
+    if (drv->durability >= DUR_INTERVAL)
+        drv->delta_sync = 1;
+    return 0;
+}
 
-    if (verbose)
-        printf( "Opening %s (%u sectors)\n", diskname, nb_sectors);
+/**
+ * Work out the geometry of a FLEX disk from its SIR (sector 2)
+ *
+ * The SIR gives the last track and the sectors per track; the size of
+ * the image tells whether track 0 is a single density one.
+ *
+ * @param bloc The SIR
+ * @param nb_sectors Size of the image in sectors
+ * @param diskname Image name, for messages
+ * @param geo Last track, sectors per track and track 0 sectors, set on success
+ * @return 0 on success, -1 if this is no FLEX disk (reported)
+ */
+int sir_geometry( const uint8_t *bloc, int nb_sectors, const char *diskname, uint8_t geo[3])
+{
+    char label[16];
+    int volnum;
+    int last_trk_sec;
+    int freesec;
+    uint8_t nbtrk, nbsec, track0l;
 
     // Not a flex disk ?
-    if (getname( bloc + 0x10, label, 0) < 0 || bloc[0x26] == 0 || bloc[0x27] == 0) {
-        fprintf( stderr, "Not a valid Flex disk image: ");
+    if (getname( (uint8_t *)bloc + 0x10, label, 0) < 0 || bloc[0x26] == 0 || bloc[0x27] == 0) {
+        fprintf( stderr, "Not a valid Flex disk image: %s\n", diskname);
         return -1;
     }
 
@@ -422,592 +891,3817 @@ int load_dsk( char *name)
             return -1;
         }
     }
-    ready = 1;
+    geo[0] = nbtrk;
+    geo[1] = nbsec;
+    geo[2] = track0l;
     return 0;
 }
 
 /**
- * Write process ID to PID file for daemon management
+ * Load and validate a Flex disk image file
+ * 
+ * This function opens a disk image file, validates it as a proper Flex disk,
+ * extracts geometry information from the System Information Record (SIR),
+ * and sets up the drive for disk access.
+ * 
+ * @param drv Drive to load the image into
+ * @param dirfd Directory relative names are resolved from (or AT_FDCWD)
+ * @param name Path to the disk image file to load
+ * @return 0 on success, -1 on error (the drive is then not ready)
+ * 
+ * FLEX DISK STRUCTURE:
+ * - Sector 0,0: Boot sector (if bootable)
+ * - Sector 0,1: System Information Record (SIR) - unused
+ * - Sector 0,2: Directory Information Record (DIR) - contains disk geometry
+ * - Sector 0,3+: Directory entries
+ * 
+ * GEOMETRY DETECTION:
+ * The function analyzes the disk size and SIR data to determine:
+ * - Single Density: all tracks have same number of sectors
+ * - Double Density: track 0 may have fewer sectors (SD format)
+ * - Custom geometry: handles unusual configurations
+ * The result is kept (geometry_put()): an image mounted again unchanged
+ * takes its geometry from there, with no SIR read (geometry_find()).
+ * 
+ * OVERLAY DRIVES:
+ * With drv->overlay set, the image is opened read-only and the client's
+ * writes go to the delta file (delta_open()).
+ * 
+ * DRIVE FIELDS SET:
+ * - fd_disk: file descriptor for the disk image
+ * - map, mapsize: shared mapping of the image with the IO_MMAP backend,
+ *   left NULL (pread()/pwrite() are used) if the image can't be mapped
+ * - ready: set to 1 if disk loaded successfully
+ * - readonly: set based on file permissions
+ * - nbtrk, nbsec, track0l: disk geometry parameters
+ * - disk_image, diskname: file path information
  */
-void write_pid_file(void) {
-    FILE *f = fopen(pid_file, "w");
-    if (f) {
-        fprintf(f, "%d\n", getpid());
-        fclose(f);
+int load_dsk( flex_drive_t *drv, int dirfd, char *name)
+{
+
+    struct stat dsk_stat;
+    int size;
+    int nb_sectors;
+    uint8_t *bloc = drv->bloc;
+    uint8_t nbtrk, nbsec, track0l, geo[3];
+    geometry_t *g;
+
+    drv->ready = 0;
+    if (name != drv->disk_image) {
+        strncpy( drv->disk_image, name, sizeof(drv->disk_image) - 1);
+        drv->disk_image[sizeof(drv->disk_image) - 1] = '\0';
     }
-}
+    drv->diskname = strrchr( drv->disk_image, '/');
+    if (drv->diskname == NULL)
+        drv->diskname = drv->disk_image;
+    else
+        drv->diskname++;
 
-/**
- * Remove PID file on daemon exit
- */
-void remove_pid_file(void) {
-    unlink(pid_file);
-}
+    if (fstatat( dirfd, drv->disk_image, &dsk_stat, 0)) {
+        if (verbose)
+            perror( drv->disk_image); 
+        return -1;
+    }
 
-/**
- * Signal handler for daemon cleanup
- */
-void signal_handler(int sig) {
-    if (sig == SIGTERM || sig == SIGINT) {
-        syslog(LOG_INFO, "Received signal %d, shutting down", sig);
-        remove_pid_file();
-        if (num_ports > 0) {
-            for (int i = 0; i < num_ports; i++) {
-                if (ports[i].serial) {
-                    fclose(ports[i].serial);
-                }
-                for (int d = 0; d < ports[i].num_drives; d++) {
-                    if (ports[i].drives[d].fd_disk > 0) {
-                        close(ports[i].drives[d].fd_disk);
-                    }
-                }
-            }
-        } else {
-            // Single-port mode cleanup
-            if (serial) {
-                fclose(serial);
-            }
-            if (fd > 0) {
-                close(fd);
-            }
+    size = dsk_stat.st_size;
+    drv->dev = dsk_stat.st_dev;
+    drv->ino = dsk_stat.st_ino;
+
+    // Open disk image
+    if ((dsk_stat.st_mode & S_IWUSR) && drv->overlay[0] == 0) {
+        if ((drv->fd_disk = openat( dirfd, drv->disk_image, O_RDWR | O_CLOEXEC)) < 0) {
+            if (verbose)
+                perror( drv->diskname);
+            return -1;
         }
-        closelog();
-        exit(0);
+        drv->readonly = 0;
+    } else {
+        if ((drv->fd_disk = openat( dirfd, drv->disk_image, O_RDONLY | O_CLOEXEC)) < 0 ) {
+            if (verbose)
+                perror( drv->diskname);
+            return -1;
+        }
+        drv->readonly = 1;
     }
-}
 
-/**
- * Initialize daemon mode
- */
-void daemonize(void) {
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork");
-        exit(1);
+    nb_sectors = size / SECSIZE;
+
+    // Mounted before, and unchanged since ?
+    if ((g = geometry_find( &dsk_stat)) != NULL) {
+        nbtrk = g->nbtrk;
+        nbsec = g->nbsec;
+        track0l = g->track0l;
+        if (verbose)
+            printf( "Opening %s (%u sectors), known geometry: %d tracks, %d sectors/track, %d on track 0\n",
+                    drv->diskname, nb_sectors, nbtrk+1, nbsec, track0l);
+        goto known;
     }
-    if (pid > 0) {
-        exit(0); // Parent exits
+
+    if (pread( drv->fd_disk, bloc, SECSIZE, SECSIZE*2) != SECSIZE)
+        goto fail;
+
+    if (nb_sectors * SECSIZE != size) {
+        fprintf( stderr, "Disk size don't match an integer number of sectors: %u bytes left]\n",
+                 size % SECSIZE);
+        goto fail;
     }
-    
-    // Child continues
-    setsid();
-    chdir("/");
-    umask(0);
-    
-    // Close standard file descriptors
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
-    close(STDERR_FILENO);
-    
-    // Setup signal handlers
-    signal(SIGTERM, signal_handler);
-    signal(SIGINT, signal_handler);
-    signal(SIGCHLD, SIG_IGN);
-    
-    write_pid_file();
-    openlog(PROGRAM_NAME, LOG_PID, LOG_DAEMON);
-    syslog(LOG_INFO, "Daemon started, version %s", VERSION);
+
+    if (verbose)
+        printf( "Opening %s (%u sectors)\n", drv->diskname, nb_sectors);
+
+    if (sir_geometry( bloc, nb_sectors, drv->diskname, geo) < 0)
+        goto fail;
+    nbtrk = geo[0];
+    nbsec = geo[1];
+    track0l = geo[2];
+    geometry_put( &dsk_stat, bloc, nbtrk, nbsec, track0l);
+
+known:
+    drv->nbtrk = nbtrk;
+    drv->nbsec = nbsec;
+    drv->track0l = track0l;
+
+    if (drv->io == IO_MMAP) {
+        void *map = mmap( NULL, size, drv->readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+                          MAP_SHARED, drv->fd_disk, 0);
+        if (map == MAP_FAILED) {
+            if (verbose)
+                printf( "Cannot map %s (%s), using pread/pwrite\n", drv->diskname, strerror( errno));
+        } else {
+            drv->map = map;
+            drv->mapsize = size;
+        }
+    }
+    if (drv->overlay[0] && delta_open( drv, dirfd, nb_sectors) < 0) {
+        if (drv->map)
+            munmap( drv->map, drv->mapsize);
+        drv->map = NULL;
+        drv->mapsize = 0;
+        goto fail;
+    }
+    drv->ready = 1;
+    return 0;
+
+fail:
+    close( drv->fd_disk);
+    drv->fd_disk = -1;
+    return -1;
 }
 
 /**
- * Logging function that works in both daemon and console modes
+ * Current time in microseconds, for prefetch accounting
  */
-void log_message(int priority, const char *format, ...) {
-    va_list args;
-    va_start(args, format);
-    
-    if (daemon_mode) {
-        vsyslog(priority, format, args);
-    } else {
-        vprintf(format, args);
-        printf("\n");
-    }
-    
-    va_end(args);
+long long now_us( void)
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
 }
 
 /**
- * Parse YAML configuration file for multi-port setup
- * 
- * @param config_path Path to YAML configuration file
- * @return 0 on success, -1 on error
+ * Current time in milliseconds, for command timeouts
  */
-int load_config(const char *config_path) {
-    FILE *fh = fopen(config_path, "r");
-    if (!fh) {
-        fprintf(stderr, "Error: Cannot open config file %s: %s\n", 
-                config_path, strerror(errno));
-        return -1;
+long long now_ms( void)
+{
+    return now_us() / 1000;
+}
+
+/**
+ * Find a sector of an image in the write-back buffer (written through any
+ * drive mapping the same image)
+ *
+ * @return Index in wb[], -1 if the sector is not waiting there
+ */
+int wb_find( flex_drive_t *drv, int blk)
+{
+    for (int i = 0; i < wb_count; i++)
+        if (wb[i].blk == blk && wb[i].drv->ino == drv->ino && wb[i].drv->dev == drv->dev)
+            return i;
+    return -1;
+}
+
+int wb_compare( const void *a, const void *b)
+{
+    return wb[*(const int *)a].blk - wb[*(const int *)b].blk;
+}
+
+/**
+ * Forget the sectors a drive holds for write-back
+ */
+void wb_drop( flex_drive_t *drv)
+{
+    int n = 0;
+
+    for (int i = 0; i < wb_count; i++)
+        if (wb[i].drv != drv)
+            wb[n++] = wb[i];
+    wb_count = n;
+}
+
+/**
+ * Write back the sectors a drive holds, and make them durable
+ *
+ * Held sectors are sorted, and each run of contiguous blocks goes out
+ * with one pwritev(), so a file copied sector by sector ends up as a few
+ * large writes. Mapped images only need their dirty range synced.
+ * The client was ACKed for these sectors: when a write or the sync
+ * fails, they are all kept (and the dirty range, and the delta to sync)
+ * for the next write back to try again.
+ *
+ * @param drv Drive to write back
+ * @return 0 on success, -1 if some sectors could not be written
+ */
+int wb_flush( flex_drive_t *drv)
+{
+    struct iovec iov[WB_MAX];
+    int idx[WB_MAX];
+    int n = 0, runs = 0, retval = 0;
+
+    if (drv->delta && drv->delta_sync) {
+        if (fdatasync( drv->fd_delta) < 0)
+            retval = -1;
+        else
+            drv->delta_sync = 0;
     }
-    
-    yaml_parser_t parser;
-    yaml_document_t document;
-    
-    if (!yaml_parser_initialize(&parser)) {
-        fprintf(stderr, "Error: Failed to initialize YAML parser\n");
-        fclose(fh);
-        return -1;
+    if (drv->dirty_hi > drv->dirty_lo) {
+        long page = sysconf( _SC_PAGESIZE);
+        int start = drv->dirty_lo & ~(page - 1);
+
+        if (msync( drv->map + start, drv->dirty_hi - start, MS_SYNC) < 0)
+            retval = -1;
+        else
+            drv->dirty_lo = drv->dirty_hi = 0;
     }
-    
-    yaml_parser_set_input_file(&parser, fh);
-    
-    if (!yaml_parser_load(&parser, &document)) {
-        fprintf(stderr, "Error: Failed to load YAML document\n");
-        yaml_parser_delete(&parser);
-        fclose(fh);
-        return -1;
+
+    for (int i = 0; i < wb_count; i++)
+        if (wb[i].drv == drv)
+            idx[n++] = i;
+    if (n == 0)
+        return retval;
+    qsort( idx, n, sizeof(int), wb_compare);
+
+    for (int i = 0, j; i < n; i = j, runs++) {
+        for (j = i; j < n && (j == i || wb[idx[j]].blk == wb[idx[j - 1]].blk + 1); j++) {
+            iov[j - i].iov_base = wb[idx[j]].data;
+            iov[j - i].iov_len = SECSIZE;
+        }
+        if (pwritev( drv->fd_disk, iov, j - i, (off_t)wb[idx[i]].blk * SECSIZE) != (j - i) * SECSIZE)
+            retval = -1;
     }
-    
-    yaml_node_t *root = yaml_document_get_root_node(&document);
-    if (!root || root->type != YAML_MAPPING_NODE) {
-        fprintf(stderr, "Error: YAML root must be a mapping\n");
-        yaml_document_delete(&document);
-        yaml_parser_delete(&parser);
-        fclose(fh);
+    if (fdatasync( drv->fd_disk) < 0)
+        retval = -1;
+
+    if (retval < 0) {
+        log_message( LOG_ERR, "%s: write back of %d sectors failed, kept to retry: %s",
+                     drv->diskname, n, strerror( errno));
         return -1;
     }
-    
-    // Enhanced parsing - support multiple drives per port
-    num_ports = 1;
-    strcpy(ports[0].device, "/dev/ttyS0");
-    ports[0].speed = 19200;
-    strcpy(ports[0].curdir, ".");
-    
-    // Configure multiple drives for the port (example configuration)
-    ports[0].num_drives = 2;
-    strcpy(ports[0].drives[0].disk_image, "flex_disk_a.dsk");
-    strcpy(ports[0].drives[1].disk_image, "flex_disk_b.dsk");
-    
-    for (int d = 0; d < ports[0].num_drives; d++) {
-        ports[0].drives[d].ready = 0;
-        ports[0].drives[d].fd_disk = -1;
+    if (verbose)
+        printf( "Wrote back %d sectors of %s in %d writes\n", n, drv->diskname, runs);
+    wb_drop( drv);
+    return 0;
+}
+
+/**
+ * Drop the directory index of a drive, rebuilt by the next lookup
+ */
+void dir_drop( flex_drive_t *drv)
+{
+    free( drv->dir);
+    free( drv->dirblk);
+    drv->dir = NULL;
+    drv->dirblk = NULL;
+    drv->ndir = drv->ndirblk = 0;
+}
+
+/**
+ * Unmount the disk image of a drive, writing back what it holds
+ */
+void close_dsk( flex_drive_t *drv)
+{
+    geometry_t *g;
+    struct stat st;
+
+    if (drv->fd_disk >= 0 && wb_flush( drv) < 0) {
+        log_message( LOG_ERR, "%s: unmounted with sectors not written back", drv->diskname);
+        wb_drop( drv);
     }
-    
-    yaml_document_delete(&document);
-    yaml_parser_delete(&parser);
-    fclose(fh);
-    
-    if (verbose) {
-        printf("Multi-port config loaded: %d ports with multi-drive support\n", num_ports);
-        printf("Port 0: %s at %d baud, %d drives configured\n", 
-               ports[0].device, ports[0].speed, ports[0].num_drives);
+    if (drv->map) {
+        munmap( drv->map, drv->mapsize);
+        drv->map = NULL;
+        drv->mapsize = 0;
     }
-    
-    return 0;
+    // Writes leave the geometry as it was unless the SIR changed it
+    // (dsk_write()), so it holds for the image as written
+    if (drv->fd_disk >= 0 && !drv->readonly && (g = geometry_of( drv->dev, drv->ino)) != NULL &&
+        fstat( drv->fd_disk, &st) == 0 && st.st_size == g->size) {
+        g->mtime = st.st_mtim;
+    }
+    if (drv->fd_disk >= 0)
+        close( drv->fd_disk);
+    if (drv->delta) {
+        close( drv->fd_delta);
+        drv->fd_delta = -1;
+        free( drv->delta);
+        drv->delta = NULL;
+    }
+    drv->fd_disk = -1;
+    drv->backend = NULL;
+    drv->ready = 0;
+    for (int i = 0; i < PREFETCH_MAX; i++)
+        drv->ahead[i].data = NULL;
+    dir_drop( drv);
 }
 
 /**
- * Read command parameters from serial line until CR
- * 
- * Many NetPC protocol commands are followed by parameters (strings)
- * terminated by a carriage return (CR). This function reads these
- * parameters into the global param[] buffer.
- * 
- * @param none (uses global serial file handle)
- * @return none (stores result in global param[] buffer)
- * 
- * BUFFER MANAGEMENT:
- * - Reads up to 127 characters to prevent overflow
- * - Always null-terminates the result
- * - Silently truncates if input exceeds buffer size
- */
-void getparam()
-{
-    int c, i;
-    i = 0;
-	
-    while ((c = fgetc( serial)) != CR) {
-        if (i<127)
-            param[i++] = c;
-        else
-            param[i] = 0;
+ * Allocate the sector cache
+ *
+ * Sectors read with pread() go through a cache shared by every port and
+ * drive, keyed by image inode and block, so machines booting from the
+ * same image share their reads. Mapped images need none: the mappings of
+ * one file already share the kernel page cache.
+ *
+ * The replacement policy is 2Q: a sector read once enters A1in, a FIFO
+ * of a quarter of the cache. Leaving it, only its key is kept in A1out.
+ * A sector asked for again while in A1out is promoted to Am, an LRU of
+ * the rest. A directory scan thus flows through A1in without evicting
+ * the boot and system sectors held in Am.
+ *
+ * @param kb Data budget in KiB (0 disables the cache)
+ */
+void cache_init( int kb)
+{
+    int n = kb * 1024 / SECSIZE;
+    unsigned buckets = 1;
+
+    if (n < 4)
+        return;
+    cache.kin = n / 4;
+    cache.kout = n / 2;
+    cache.nnodes = n + cache.kout + 1;
+    while (buckets < (unsigned)cache.nnodes)
+        buckets <<= 1;
+    cache.data = malloc( (size_t)n * SECSIZE);
+    cache.node = malloc( cache.nnodes * sizeof(cache_node_t));
+    cache.hash = malloc( buckets * sizeof(int));
+    if (!cache.data || !cache.node || !cache.hash) {
+        fprintf( stderr, "No memory for a %d KiB sector cache, running without\n", kb);
+        free( cache.data);
+        free( cache.node);
+        free( cache.hash);
+        cache.data = NULL;
+        return;
     }
-    param[i] = 0;
+    cache.nslots = n;
+    cache.hmask = buckets - 1;
+    for (unsigned i = 0; i < buckets; i++)
+        cache.hash[i] = -1;
+    for (int i = 0; i < cache.nnodes; i++)
+        cache.node[i].next = i + 1 < cache.nnodes ? i + 1 : -1;
+    cache.freenode = 0;
+    for (int i = 0; i < 3; i++)
+        cache.q[i].head = cache.q[i].tail = -1;
+}
+
+unsigned cache_bucket( dev_t dev, ino_t ino, int blk)
+{
+    return (unsigned)(((uint64_t)ino * 31 + dev) ^ (blk * 0x9E3779B1u)) & cache.hmask;
 }
 
 /**
- * Calculate checksum for sector data transmission
- * 
- * The NetPC protocol uses a simple additive checksum to verify data
- * integrity during sector transfers. All 256 bytes of sector data
- * are summed and the result is sent as a 16-bit value (MSB, LSB).
- * 
- * @param data Pointer to 256-byte sector buffer
- * @return 16-bit checksum value (sum of all bytes)
- * 
- * CHECKSUM FORMAT:
- * - Transmitted as: [256 data bytes] [MSB] [LSB]
- * - MSB = (checksum >> 8) & 0xFF
- * - LSB = checksum & 0xFF
+ * Find the entry (data or ghost) of an image block
+ *
+ * @return Node index, -1 if the block is unknown
  */
-int checksum( uint8_t *data)
+int cache_find( dev_t dev, ino_t ino, int blk)
 {
-    int chks;
+    int i;
 
-    chks = 0;
-    for (int i = 0; i < 256; i++)
-        chks += (unsigned int) data[i];
-    return chks & 0xFFFF;
+    if (cache.nslots == 0)
+        return -1;
+    for (i = cache.hash[cache_bucket( dev, ino, blk)]; i >= 0; i = cache.node[i].hnext)
+        if (cache.node[i].blk == blk && cache.node[i].ino == ino && cache.node[i].dev == dev)
+            break;
+    return i;
+}
+
+void cache_unlink( int i)
+{
+    cache_node_t *e = &cache.node[i];
+
+    if (e->prev >= 0)
+        cache.node[e->prev].next = e->next;
+    else
+        cache.q[e->queue].head = e->next;
+    if (e->next >= 0)
+        cache.node[e->next].prev = e->prev;
+    else
+        cache.q[e->queue].tail = e->prev;
+    cache.q[e->queue].len--;
+}
+
+void cache_push( int i, int queue)
+{
+    cache_node_t *e = &cache.node[i];
+
+    e->queue = queue;
+    e->prev = -1;
+    e->next = cache.q[queue].head;
+    if (e->next >= 0)
+        cache.node[e->next].prev = i;
+    else
+        cache.q[queue].tail = i;
+    cache.q[queue].head = i;
+    cache.q[queue].len++;
 }
 
 /**
- * Handle 'S' (Send) command - read sector from disk and transmit to client
- * 
- * PROTOCOL SEQUENCE:
- * 1. Receive: [drive] [track] [sector]
- * 2. Read sector from disk image at calculated position
- * 3. Send: [256 data bytes] [checksum MSB] [checksum LSB]
- * 4. Receive: ACK (success) or NAK (retransmit request)
- * 
- * ERROR HANDLING:
- * - If no disk mounted: send zeros with bad checksum to force NAK
- * - If invalid track/sector: send zeros
- * - If read error: send zeros
- * 
- * DEBUGGING:
- * With verbose mode, prints read status and transmission result
+ * Forget an entry altogether
  */
-void sndblk()
+void cache_drop( int i)
 {
-    int drv, msb, lsb, chks;		// For checksum computing and transmitting
-    int retval;
-    int pos;
-    uint8_t nsec, ntrk;
+    cache_node_t *e = &cache.node[i];
+    int *link = &cache.hash[cache_bucket( e->dev, e->ino, e->blk)];
 
-    drv = fgetc( serial);
-    ntrk = fgetc( serial);
-    nsec = fgetc( serial);
-    retval = 1;
+    while (*link != i)
+        link = &cache.node[*link].hnext;
+    *link = e->hnext;
+    cache_unlink( i);
+    e->next = cache.freenode;
+    cache.freenode = i;
+}
 
-    if (ready == 0) {		// force checksum error if disk not ready
-        if (verbose)
-            printf( "No disk mounted, force CRC error!\n");
-        for (int i = 0; i < 258; i++)
-            fputc( 0, serial);
-        fputc( 1, serial);
-        if ((retval = fgetc( serial)) != NAK && verbose)
-            printf ("... unexpected return value : 0x%02X\n", retval);
-        return ;
-    }
+/**
+ * Free a data slot for a new sector, evicting one if the cache is full
+ *
+ * @return Slot number
+ */
+int cache_reclaim( void)
+{
+    int i, slot;
 
-    if ((pos = SECSIZE * ts2blk( ntrk, nsec)) < 0) {
-        retval = 0;
+    if (cache.used < cache.nslots)
+        return cache.used++;
+
+    cache.evictions++;
+    if (cache.q[Q_A1IN].len > cache.kin || cache.q[Q_AM].len == 0) {
+        // Oldest sector read once: keep its key in A1out
+        i = cache.q[Q_A1IN].tail;
+        slot = cache.node[i].slot;
+        cache_unlink( i);
+        cache.node[i].slot = -1;
+        cache_push( i, Q_A1OUT);
+        if (cache.q[Q_A1OUT].len > cache.kout)
+            cache_drop( cache.q[Q_A1OUT].tail);
     } else {
-        if (lseek( fd, pos, SEEK_SET) != pos)
-            retval = 0;
-        if (read( fd, bloc, SECSIZE) != SECSIZE)
-            retval = 0;
+        i = cache.q[Q_AM].tail;
+        slot = cache.node[i].slot;
+        cache_drop( i);
     }
-    if (retval == 0)
-        for( int i = 0; i< 256; i++)
-            bloc[i] = 0;
-    if (verbose) {
-        if (retval) {
-            printf( "Bloc dsk %d [0x%02X/0x%02X] (pos = %d) read", drv, ntrk, nsec, pos);
-        } else {
-            printf( "Fail to read bloc dsk %d [0x%02X/0x%02X] (pos = %d)", drv, ntrk, nsec, pos);
-        }
+    return slot;
+}
+
+/**
+ * Look a sector up in the cache
+ *
+ * @param drv Drive the sector belongs to
+ * @param blk Block number in the image
+ * @param buf Where to copy the sector
+ * @return 1 if the sector was cached, 0 otherwise
+ */
+int cache_get( flex_drive_t *drv, int blk, uint8_t *buf)
+{
+    int i;
+
+    if (cache.nslots == 0)
+        return 0;
+    if ((i = cache_find( drv->dev, drv->ino, blk)) < 0 || cache.node[i].slot < 0) {
+        cache.misses++;
+        return 0;
+    }
+    cache.hits++;
+    if (cache.node[i].queue == Q_AM) {
+        cache_unlink( i);
+        cache_push( i, Q_AM);
     }
+    memcpy( buf, cache.data + (size_t)cache.node[i].slot * SECSIZE, SECSIZE);
+    return 1;
+}
 
-    chks = checksum( bloc);
-    lsb = chks & 0xFF;
-    msb = (chks >> 8) & 0xFF;
-    for( int i = 0; i< 256; i++)
-        fputc( bloc[i], serial);
-    fputc( msb, serial);
-    fputc( lsb, serial);
+/**
+ * Add a sector just read from an image to the cache
+ */
+void cache_put( flex_drive_t *drv, int blk, const uint8_t *data)
+{
+    int i, queue = Q_A1IN;
 
-    retval = fgetc( serial);
-    if (verbose) {
-        if (retval == NAK) {
-            printf( "... transmission failed\n");
-        } else if (retval == ACK) {
-            printf ("... transmission OK\n");
-        } else {
-            printf ("... return value not expected : 0x%02X\n", retval);
-        }
+    if (cache.nslots == 0)
+        return;
+    if ((i = cache_find( drv->dev, drv->ino, blk)) >= 0) {
+        if (cache.node[i].slot >= 0)
+            return;
+        cache_drop( i);         // Asked for again soon after it left A1in
+        queue = Q_AM;
+    }
+
+    int slot = cache_reclaim();
+    cache_node_t *e;
+    unsigned b = cache_bucket( drv->dev, drv->ino, blk);
+
+    i = cache.freenode;
+    e = &cache.node[i];
+    cache.freenode = e->next;
+    e->dev = drv->dev;
+    e->ino = drv->ino;
+    e->blk = blk;
+    e->slot = slot;
+    e->hnext = cache.hash[b];
+    cache.hash[b] = i;
+    cache_push( i, queue);
+    memcpy( cache.data + (size_t)slot * SECSIZE, data, SECSIZE);
+}
+
+/**
+ * Refresh a cached sector written by a client, on whatever drive
+ */
+void cache_update( flex_drive_t *drv, int blk, const uint8_t *data)
+{
+    int i = cache_find( drv->dev, drv->ino, blk);
+
+    if (i >= 0 && cache.node[i].slot >= 0)
+        memcpy( cache.data + (size_t)cache.node[i].slot * SECSIZE, data, SECSIZE);
+}
+
+/**
+ * Write back and unmount every drive of every port, before exiting
+ */
+void close_all( void)
+{
+    for (int i = 0; i < num_ports; i++)
+        for (int d = 0; d < ports[i].num_drives; d++)
+            close_dsk( &ports[i].drives[d]);
+}
+
+/**
+ * Get a sector of a drive's disk image
+ *
+ * With a mapped image this is a pointer into the mapping, so the sector
+ * is transmitted without being copied. Otherwise the sector is copied
+ * from the sector cache, or read into the buffer and cached. A sector
+ * still held for write-back is always copied from there. Sectors past the end of the mapping (the
+ * image was grown by a write) are read with pread() as well.
+ *
+ * @param drv Drive to read from
+ * @param pos Byte offset of the sector in the image
+ * @param buf 256-byte buffer to use when the sector is not mapped
+ * @return Pointer to the 256 sector bytes, NULL on error
+ */
+const uint8_t *dsk_read( flex_drive_t *drv, int pos, uint8_t *buf)
+{
+    int i = pos / SECSIZE;
+
+    if (drv->delta && i < drv->delta_blks && (drv->delta[i / 8] & (0x80 >> (i % 8))))
+        return pread( drv->fd_delta, buf, SECSIZE, drv->delta_data + pos) == SECSIZE ? buf : NULL;
+    if (wb_count && (i = wb_find( drv, pos / SECSIZE)) >= 0) {
+        memcpy( buf, wb[i].data, SECSIZE);
+        return buf;
+    }
+    if (drv->map && pos + SECSIZE <= (long)drv->mapsize)
+        return drv->map + pos;
+    if (drv->backend)
+        return drv->backend->read( drv->backend_ctx, drv->unit, pos / SECSIZE, buf) == 0 ? buf : NULL;
+    if (cache_get( drv, pos / SECSIZE, buf))
+        return buf;
+    if (pread( drv->fd_disk, buf, SECSIZE, pos) != SECSIZE)
+        return NULL;
+    cache_put( drv, pos / SECSIZE, buf);
+    return buf;
+}
+
+/**
+ * Find a sector among those read ahead on a drive
+ *
+ * @return The prefetch entry, NULL if the sector was not read ahead
+ */
+prefetch_t *prefetch_find( flex_drive_t *drv, int pos)
+{
+    for (int i = 0; i < PREFETCH_MAX; i++)
+        if (drv->ahead[i].data && drv->ahead[i].pos == pos)
+            return &drv->ahead[i];
+    return NULL;
+}
+
+/**
+ * Write a sector to a drive's disk image, as its durability policy asks
+ *
+ * - DUR_NONE: written, the kernel writes it back when it sees fit
+ * - DUR_ASYNC: written, write-back started (msync MS_ASYNC)
+ * - DUR_SYNC: written and on disk (msync MS_SYNC, or fdatasync())
+ * - DUR_INTERVAL, DUR_IDLE: held in memory (wb[], or the dirty range of
+ *   the mapping) until wb_flush(), scheduled by the port
+ *
+ * @param drv Drive to write to
+ * @param pos Byte offset of the sector in the image
+ * @param data 256 checked sector bytes
+ * @return 0 on success, -1 on error
+ */
+int dsk_write( flex_drive_t *drv, int pos, const uint8_t *data)
+{
+    int blk = pos / SECSIZE;
+    geometry_t *g;
+    int i;
+
+    if (drv->readonly)
+        return -1;
+
+    // Sectors read ahead from this image, on any port, are read again,
+    // and its directory indexed again if this is a directory sector
+    // (only on this drive for an overlay: the others keep the image)
+    for (int n = 0; n < num_ports; n++) {
+        for (int d = 0; d < ports[n].num_drives; d++) {
+            flex_drive_t *other = &ports[n].drives[d];
+            prefetch_t *e;
+
+            if (other != drv && (drv->delta || other->ino != drv->ino || other->dev != drv->dev))
+                continue;
+            if ((e = prefetch_find( other, pos)) != NULL)
+                e->data = NULL;
+            for (i = 0; i < other->ndirblk; i++)
+                if (other->dirblk[i] == blk)
+                    dir_drop( other);
+        }
+    }
+    if (drv->delta)
+        return delta_write( drv, blk, data);
+    if (drv->backend)
+        return drv->backend->write( drv->backend_ctx, drv->unit, blk, data);
+    cache_update( drv, blk, data);
+
+    // A SIR with another name or size outdates the geometry known
+    if (blk == 2 && (g = geometry_of( drv->dev, drv->ino)) != NULL &&
+        (memcmp( g->id, data + 0x10, sizeof(g->id)) ||
+         g->maxtrk != data[0x26] || g->maxsec != data[0x27]))
+        memset( g, 0, sizeof(*g));
+
+    // A copy held for write-back is the latest one, keep it so
+    if ((i = wb_find( drv, blk)) >= 0) {
+        memcpy( wb[i].data, data, SECSIZE);
+        if (drv->durability >= DUR_INTERVAL && !drv->map)
+            return 0;
+    }
+
+    if (drv->map && pos + SECSIZE <= (long)drv->mapsize) {
+        long page = sysconf( _SC_PAGESIZE);
+        int start = pos & ~(page - 1);
+
+        memcpy( drv->map + pos, data, SECSIZE);
+        switch (drv->durability) {
+        case DUR_ASYNC:
+        case DUR_SYNC:
+            return msync( drv->map + start, pos + SECSIZE - start,
+                          drv->durability == DUR_SYNC ? MS_SYNC : MS_ASYNC);
+        case DUR_INTERVAL:
+        case DUR_IDLE:
+            if (drv->dirty_hi == drv->dirty_lo || pos < drv->dirty_lo)
+                drv->dirty_lo = pos;
+            if (pos + SECSIZE > drv->dirty_hi)
+                drv->dirty_hi = pos + SECSIZE;
+            break;
+        }
+        return 0;
+    }
+
+    if (drv->durability >= DUR_INTERVAL) {
+        if (wb_count == WB_MAX)
+            wb_flush( drv);
+        if (wb_count == WB_MAX)         // Held by other drives
+            wb_flush( wb[0].drv);
+        if (wb_count == WB_MAX)         // Write back failing: not ACKed
+            return -1;
+        wb[wb_count].drv = drv;
+        wb[wb_count].blk = blk;
+        memcpy( wb[wb_count++].data, data, SECSIZE);
+        return 0;
+    }
+
+    if (pwrite( drv->fd_disk, data, SECSIZE, pos) != SECSIZE)
+        return -1;
+    if (drv->durability == DUR_SYNC && fdatasync( drv->fd_disk) < 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Get a sector the client asked for from the sectors read ahead
+ *
+ * @param drv Drive the sector is read from
+ * @param pos Byte offset of the sector in the image
+ * @return The sector, NULL if it was not read ahead
+ */
+const uint8_t *prefetch_get( flex_drive_t *drv, int pos)
+{
+    prefetch_t *e;
+
+    if (drv->prefetch == 0)
+        return NULL;
+    if ((e = prefetch_find( drv, pos)) == NULL) {
+        drv->pf_misses++;
+        return NULL;
+    }
+    drv->pf_hits++;
+    drv->pf_saved += e->cost;
+    return e->data;
+}
+
+/**
+ * Read ahead along the FLEX link chain of a sector just sent
+ *
+ * Bytes 0-1 of FLEX file and directory sectors are the track/sector of the
+ * next sector in the chain (0/0 ends it), which is what the client reads
+ * next. The successors are read while the sector is on the line and the
+ * client checks it, so the next 'S' is answered from memory. With a mapped
+ * image, reading the link bytes is what faults the page in.
+ *
+ * @param drv Drive the sector was read from
+ * @param sector The sector sent
+ */
+void prefetch_chain( flex_drive_t *drv, const uint8_t *sector)
+{
+    uint8_t ntrk = sector[0], nsec = sector[1];
+
+    for (int n = 0; n < drv->prefetch && (ntrk || nsec); n++) {
+        int blk = ts2blk( drv, ntrk, nsec);
+        prefetch_t *e;
+
+        if (blk < 0)
+            break;
+        if ((e = prefetch_find( drv, blk * SECSIZE)) == NULL) {
+            long long start = now_us();
+            const uint8_t *data;
+
+            e = &drv->ahead[drv->iahead];
+            drv->iahead = (drv->iahead + 1) % PREFETCH_MAX;
+            e->data = NULL;
+            if ((data = dsk_read( drv, blk * SECSIZE, e->buf)) == NULL)
+                break;
+            ntrk = data[0];
+            nsec = data[1];
+            e->pos = blk * SECSIZE;
+            e->cost = now_us() - start;
+            e->data = data;
+        } else {
+            ntrk = e->data[0];
+            nsec = e->data[1];
+        }
+    }
+}
+
+#ifndef FLEXNET_LIBRARY
+/**
+ * Look a name up in a NULL terminated list of option values
+ *
+ * @return Index of the name, -1 if unknown
+ */
+int option_index( const char **names, const char *name)
+{
+    for (int i = 0; names[i]; i++)
+        if (strcasecmp( names[i], name) == 0)
+            return i;
+    return -1;
+}
+
+/**
+ * Write process ID to PID file for daemon management
+ */
+void write_pid_file(void) {
+    FILE *f = fopen(pid_file, "w");
+    if (f) {
+        fprintf(f, "%d\n", getpid());
+        fclose(f);
+    }
+}
+
+/**
+ * Remove PID file on daemon exit
+ */
+void remove_pid_file(void) {
+    unlink(pid_file);
+}
+
+/**
+ * SIGTERM/SIGINT handler: ask the event loop to stop, main() then writes
+ * back the sectors held and exits
+ */
+void signal_handler(int sig) {
+    stop_requested = sig;
+}
+
+/**
+ * Initialize daemon mode
+ */
+void daemonize(void) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid > 0) {
+        exit(0); // Parent exits
+    }
+    
+    // Child continues
+    setsid();
+    chdir("/");
+    umask(0);
+    
+    // Close standard file descriptors
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+    close(STDERR_FILENO);
+    
+    // Setup signal handlers
+    signal(SIGTERM, signal_handler);
+    signal(SIGINT, signal_handler);
+    signal(SIGCHLD, SIG_IGN);
+    
+    write_pid_file();
+    openlog(PROGRAM_NAME, LOG_PID, LOG_DAEMON);
+    syslog(LOG_INFO, "Daemon started, version %s", VERSION);
+}
+#endif
+
+/**
+ * Log the statistics of every mounted drive and of the sector cache
+ * (on SIGUSR1 and at exit)
+ */
+void report_stats( void)
+{
+    for (int i = 0; i < num_ports; i++) {
+        for (int d = 0; d < ports[i].num_drives; d++) {
+            flex_drive_t *drv = &ports[i].drives[d];
+            unsigned long asked = drv->pf_hits + drv->pf_misses;
+
+            if (drv->prefetch == 0 || asked == 0)
+                continue;
+            log_message( LOG_INFO, "%s drive %d: prefetch %lu/%lu hits (%.1f%%), %.2f ms saved",
+                         ports[i].device, d, drv->pf_hits, asked,
+                         100.0 * drv->pf_hits / asked, drv->pf_saved / 1000.0);
+        }
+        if (ports[i].naks)
+            log_message( LOG_INFO, "%s: %lu frames NAKed, pacing level %d",
+                         ports[i].device, ports[i].naks, ports[i].pace);
+        if (ports[i].compress && ports[i].frames)
+            log_message( LOG_INFO, "%s: %lu sector frames, %.1f bytes each on the wire",
+                         ports[i].device, ports[i].frames,
+                         (double)ports[i].frame_bytes / ports[i].frames);
+    }
+    if (cache.hits + cache.misses)
+        log_message( LOG_INFO, "Sector cache: %lu hits, %lu misses, %lu evictions (%d/%d sectors)",
+                     cache.hits, cache.misses, cache.evictions, cache.used, cache.nslots);
+    if (listings.hits + listings.scans)
+        log_message( LOG_INFO, "Listing cache: %lu hits, %lu directory reads",
+                     listings.hits, listings.scans);
+    if (geometries.hits + geometries.misses)
+        log_message( LOG_INFO, "Geometry cache: %lu hits, %lu images checked",
+                     geometries.hits, geometries.misses);
+}
+
+#ifndef FLEXNET_LIBRARY
+/**
+ * SIGUSR1 handler: ask the event loop to report statistics
+ */
+void stats_handler( int sig)
+{
+    (void)sig;
+    stats_requested = 1;
+}
+
+/**
+ * Transport of a port, from its device name
+ */
+int port_transport( const char *device)
+{
+    if (strncmp( device, "tcp://", 6) == 0)
+        return LINK_TCP;
+    if (strncmp( device, "unix:", 5) == 0)
+        return LINK_UNIX;
+    if (strncmp( device, "shm:", 4) == 0)
+        return LINK_SHM;
+    return LINK_SERIAL;
+}
+#endif
+
+#ifndef FLEXNET_LIBRARY     // The daemon's configuration
+
+static const char *switch_names[] = { "off", "on", NULL };
+static const char *pacing_names[] = { "off", "adaptive", NULL };
+
+/**
+ * Look up a key in a YAML mapping node
+ *
+ * @param doc YAML document
+ * @param map Mapping node to search
+ * @param key Key name
+ * @return Value node, or NULL if the key is absent
+ */
+static yaml_node_t *yaml_map_get(yaml_document_t *doc, yaml_node_t *map, const char *key)
+{
+    yaml_node_pair_t *pair;
+
+    if (map == NULL || map->type != YAML_MAPPING_NODE)
+        return NULL;
+    for (pair = map->data.mapping.pairs.start; pair < map->data.mapping.pairs.top; pair++) {
+        yaml_node_t *k = yaml_document_get_node(doc, pair->key);
+        if (k && k->type == YAML_SCALAR_NODE && strcmp((char *)k->data.scalar.value, key) == 0)
+            return yaml_document_get_node(doc, pair->value);
+    }
+    return NULL;
+}
+
+/**
+ * Get the text of a YAML scalar node
+ *
+ * @return Scalar value, or NULL if the node is missing or not a scalar
+ */
+static const char *yaml_scalar(yaml_node_t *node)
+{
+    if (node == NULL || node->type != YAML_SCALAR_NODE)
+        return NULL;
+    return (const char *)node->data.scalar.value;
+}
+
+/**
+ * Parse YAML configuration file for multi-port setup
+ * 
+ * Expected layout (see example.yaml):
+ *   cache: 1024             (optional, sector cache budget in KiB, 0 = none)
+ *   ports:
+ *     - device: /dev/ttyS0  (or tcp://host:port, unix:/path, shm:/path)
+ *       speed: 19200        (serial lines only)
+ *       timeout: 5          (optional, seconds of silence inside a command)
+ *       io: mmap            (optional, mmap or pread)
+ *       durability: none    (optional, none, async, sync, interval or on-idle)
+ *       interval: 1         (optional, write-back delay in seconds)
+ *       prefetch: 1         (optional, sectors read ahead along file chains)
+ *       compress: off       (optional, offer compressed sector frames)
+ *       drives:
+ *         - disk: system.dsk
+ *
+ * @param config_path Path to YAML configuration file
+ * @return 0 on success, -1 on error
+ */
+int load_config(const char *config_path) {
+    FILE *fh = fopen(config_path, "r");
+    if (!fh) {
+        fprintf(stderr, "Error: Cannot open config file %s: %s\n", 
+                config_path, strerror(errno));
+        return -1;
+    }
+    
+    yaml_parser_t parser;
+    yaml_document_t document;
+    
+    if (!yaml_parser_initialize(&parser)) {
+        fprintf(stderr, "Error: Failed to initialize YAML parser\n");
+        fclose(fh);
+        return -1;
+    }
+    
+    yaml_parser_set_input_file(&parser, fh);
+    
+    if (!yaml_parser_load(&parser, &document)) {
+        fprintf(stderr, "Error: Failed to load YAML document\n");
+        yaml_parser_delete(&parser);
+        fclose(fh);
+        return -1;
+    }
+    
+    yaml_node_t *root = yaml_document_get_root_node(&document);
+    yaml_node_t *list = yaml_map_get(&document, root, "ports");
+    const char *cache_size = yaml_scalar(yaml_map_get(&document, root, "cache"));
+    int retval = 0;
+
+    if (cache_size)
+        cache_kb = atoi(cache_size);
+
+    if (!list || list->type != YAML_SEQUENCE_NODE) {
+        fprintf(stderr, "Error: YAML root must be a mapping with a 'ports' list\n");
+        retval = -1;
+        goto done;
+    }
+
+    num_ports = 0;
+    for (yaml_node_item_t *item = list->data.sequence.items.start;
+         item < list->data.sequence.items.top; item++) {
+        yaml_node_t *node = yaml_document_get_node(&document, *item);
+        const char *device = yaml_scalar(yaml_map_get(&document, node, "device"));
+        const char *baud = yaml_scalar(yaml_map_get(&document, node, "speed"));
+        const char *timeout = yaml_scalar(yaml_map_get(&document, node, "timeout"));
+        const char *io = yaml_scalar(yaml_map_get(&document, node, "io"));
+        const char *sync = yaml_scalar(yaml_map_get(&document, node, "durability"));
+        const char *delay = yaml_scalar(yaml_map_get(&document, node, "interval"));
+        const char *ahead = yaml_scalar(yaml_map_get(&document, node, "prefetch"));
+        const char *rle = yaml_scalar(yaml_map_get(&document, node, "compress"));
+        const char *handshake = yaml_scalar(yaml_map_get(&document, node, "flow"));
+        const char *pace = yaml_scalar(yaml_map_get(&document, node, "pacing"));
+        int rle_mode = rle ? option_index(switch_names, rle) : compress;
+        int flow_mode = handshake ? option_index(flow_names, handshake) : flow;
+        int pace_mode = pace ? option_index(pacing_names, pace) : pacing;
+        int io_mode = io ? option_index(io_names, io) : io_backend;
+        int sync_mode = sync ? option_index(durability_names, sync) : durability;
+        int depth = ahead ? atoi(ahead) : prefetch_depth;
+        yaml_node_t *drives = yaml_map_get(&document, node, "drives");
+        port_config_t *p;
+
+        if (num_ports >= MAX_PORTS) {
+            fprintf(stderr, "Warning: only %d ports supported, extra ports ignored\n", MAX_PORTS);
+            break;
+        }
+        if (!device || (!baud && port_transport(device) == LINK_SERIAL)) {
+            fprintf(stderr, "Error: port %d needs a device and a speed\n", num_ports);
+            retval = -1;
+            goto done;
+        }
+        if (io_mode < 0 || sync_mode < 0) {
+            fprintf(stderr, "Error: %s: unknown %s '%s'\n", device,
+                    io_mode < 0 ? "io" : "durability", io_mode < 0 ? io : sync);
+            retval = -1;
+            goto done;
+        }
+        if (rle_mode < 0) {
+            fprintf(stderr, "Error: %s: compress must be off or on\n", device);
+            retval = -1;
+            goto done;
+        }
+        if (depth < 0 || depth > PREFETCH_MAX) {
+            fprintf(stderr, "Error: %s: prefetch must be 0 to %d\n", device, PREFETCH_MAX);
+            retval = -1;
+            goto done;
+        }
+        if (flow_mode < 0 || pace_mode < 0) {
+            fprintf(stderr, "Error: %s: %s\n", device, flow_mode < 0 ?
+                    "flow must be none or rtscts" : "pacing must be off or adaptive");
+            retval = -1;
+            goto done;
+        }
+        if (pace_mode && port_transport(device) != LINK_SERIAL)
+            fprintf(stderr, "Warning: %s: pacing is for serial lines, ignored\n", device);
+        if (flow_mode == FLOW_XONXOFF) {
+            fprintf(stderr, "Error: %s: flow xonxoff cannot be used, the link is 8-bit binary "
+                    "($11 and $13 are frame bytes)\n", device);
+            retval = -1;
+            goto done;
+        }
+
+        p = &ports[num_ports++];
+        memset(p, 0, sizeof(*p));
+        strncpy(p->device, device, sizeof(p->device) - 1);
+        p->speed = baud ? atoi(baud) : 0;
+        p->timeout = timeout ? atof(timeout) * 1000 : CMD_TIMEOUT;
+        p->durability = sync_mode;
+        p->wb_delay = delay ? atof(delay) * 1000 : WB_DELAY;
+        p->compress = rle_mode;
+        p->flow = flow_mode;
+        p->pacing = pace_mode;
+        p->link = -1;
+        for (int d = 0; d < MAX_DRIVES_PER_PORT; d++) {
+            p->drives[d].fd_disk = -1;
+            p->drives[d].io = io_mode;
+            p->drives[d].durability = sync_mode;
+            p->drives[d].prefetch = depth;
+        }
+
+        if (!drives || drives->type != YAML_SEQUENCE_NODE)
+            continue;
+        for (yaml_node_item_t *di = drives->data.sequence.items.start;
+             di < drives->data.sequence.items.top; di++) {
+            yaml_node_t *dn = yaml_document_get_node(&document, *di);
+            const char *disk = yaml_scalar(yaml_map_get(&document, dn, "disk"));
+            const char *overlay = yaml_scalar(yaml_map_get(&document, dn, "overlay"));
+            if (p->num_drives >= MAX_DRIVES_PER_PORT) {
+                fprintf(stderr, "Warning: %s: only %d drives per port, extra drives ignored\n",
+                        p->device, MAX_DRIVES_PER_PORT);
+                break;
+            }
+            if (disk)
+                strncpy(p->drives[p->num_drives].disk_image, disk,
+                        sizeof(p->drives[0].disk_image) - 1);
+            if (overlay)
+                strncpy(p->drives[p->num_drives].overlay, overlay,
+                        sizeof(p->drives[0].overlay) - 1);
+            p->num_drives++;
+        }
+    }
+
+    if (num_ports == 0) {
+        fprintf(stderr, "Error: no port defined in %s\n", config_path);
+        retval = -1;
+    }
+
+    if (retval == 0 && verbose) {
+        printf("Multi-port config loaded: %d ports with multi-drive support\n", num_ports);
+        for (int i = 0; i < num_ports; i++)
+            printf("Port %d: %s at %d baud, %d drives configured\n", 
+                   i, ports[i].device, ports[i].speed, ports[i].num_drives);
+    }
+
+done:
+    yaml_document_delete(&document);
+    yaml_parser_delete(&parser);
+    fclose(fh);
+    return retval;
+}
+
+#endif
+
+/**
+ * Calculate checksum for sector data transmission
+ * 
+ * The NetPC protocol uses a simple additive checksum to verify data
+ * integrity during sector transfers. All 256 bytes of sector data
+ * are summed and the result is sent as a 16-bit value (MSB, LSB).
+ * 
+ * @param data Pointer to 256-byte sector buffer
+ * @return 16-bit checksum value (sum of all bytes)
+ * 
+ * CHECKSUM FORMAT:
+ * - Transmitted as: [256 data bytes] [MSB] [LSB]
+ * - MSB = (checksum >> 8) & 0xFF
+ * - LSB = checksum & 0xFF
+ */
+int checksum( uint8_t *data)
+{
+    int chks;
+
+    chks = 0;
+    for (int i = 0; i < 256; i++)
+        chks += (unsigned int) data[i];
+    return chks & 0xFFFF;
+}
+
+/**
+ * Queue bytes for transmission on a port
+ *
+ * Output is flushed by the event loop when the line is writable.
+ */
+void link_write(port_config_t *p, const void *buf, int len)
+{
+    if (p->txlen + len > TXBUFSIZE) {
+        log_message(LOG_ERR, "%s: output overflow, %d bytes dropped", p->device, len);
+        return;
+    }
+    memcpy(p->txbuf + p->txlen, buf, len);
+    p->txlen += len;
+}
+
+void link_putc(port_config_t *p, int c)
+{
+    uint8_t b = c;
+    link_write(p, &b, 1);
+}
+
+void link_puts(port_config_t *p, const char *str)
+{
+    link_write(p, str, strlen(str));
+}
+
+/**
+ * Write to the line of a port, as much as it takes now
+ *
+ * On a LINK_SHM port the bytes go straight into the client's ring.
+ *
+ * @return Bytes written, -1 on error (EAGAIN when none could be)
+ */
+int link_writev( port_config_t *p, const struct iovec *iov, int cnt)
+{
+    int n = 0;
+
+    if (p->transport == LINK_SESSION) {     // Queued for flexnet_output()
+        errno = EAGAIN;
+        return -1;
+    }
+    if (p->transport != LINK_SHM)
+        return writev( p->link, iov, cnt);
+    for (int i = 0; i < cnt; i++) {
+        size_t put = flexring_put( &p->shm->to_client, iov[i].iov_base, iov[i].iov_len, p->peer_bell);
+
+        n += put;
+        if (put < iov[i].iov_len)
+            break;
+    }
+    if (n == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+
+#ifndef FLEXNET_LIBRARY
+/**
+ * Read from the line of a port, what is available
+ *
+ * @return Bytes read, -1 on error (EAGAIN when none were)
+ */
+int link_readv( port_config_t *p, const struct iovec *iov, int cnt)
+{
+    int n = 0;
+
+    if (p->transport != LINK_SHM)
+        return readv( p->link, iov, cnt);
+    do {
+        for (int i = 0; i < cnt; i++) {
+            size_t got = flexring_get( &p->shm->to_server, iov[i].iov_base, iov[i].iov_len, p->peer_bell);
+
+            n += got;
+            if (got < iov[i].iov_len)
+                break;
+        }
+        // Empty: the client rings when it writes again
+    } while (n == 0 && flexring_wait( &p->shm->to_server));
+    if (n == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+#endif
+
+/**
+ * Compress a sector for a compressed frame (CAP_RLE)
+ *
+ * The sector becomes a list of tokens, decoded until 256 bytes are out:
+ * - $00-$7F n: the next n+1 bytes are sent as is
+ * - $80-$FF c: the next byte stands for c-$7D copies of itself (3 to 130)
+ * The encoding never crosses the end of the sector. It is at most 2 bytes
+ * longer than the sector, and an empty sector takes 4.
+ *
+ * @param data 256-byte sector
+ * @param out Encoded sector, room for SECSIZE + 2 bytes
+ * @return Length of the encoded sector
+ */
+int rle_encode( const uint8_t *data, uint8_t *out)
+{
+    int i = 0, lit = 0, n = 0;      // Bytes lit to i-1 are still to be sent as is
+
+    for (;;) {
+        int run = 1;
+
+        while (i + run < SECSIZE && run < RLE_MAXRUN && data[i + run] == data[i])
+            run++;
+        if ((i == SECSIZE || run >= RLE_MINRUN || i - lit == RLE_MAXLIT) && i > lit) {
+            out[n++] = i - lit - 1;
+            memcpy( out + n, data + lit, i - lit);
+            n += i - lit;
+            lit = i;
+        }
+        if (i == SECSIZE)
+            return n;
+        if (run >= RLE_MINRUN) {
+            out[n++] = run + 0x7D;
+            out[n++] = data[i];
+            i += run;
+            lit = i;
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * Send a sector frame: [256 data bytes] [checksum MSB] [checksum LSB]
+ *
+ * When nothing else is pending on the line, the frame goes out with a
+ * single writev() straight from the sector buffer. Whatever the line does
+ * not accept is queued, and contiguous in txbuf, like any other output.
+ * Once the client has been granted CAP_RLE, the data bytes are sent
+ * compressed (rle_encode()); the checksum is still that of the sector.
+ *
+ * @param p Port to send on
+ * @param data 256-byte sector
+ */
+void link_sector(port_config_t *p, const uint8_t *data)
+{
+    int chks = checksum( (uint8_t *)data);
+    uint8_t trailer[2] = { (chks >> 8) & 0xFF, chks & 0xFF };
+    uint8_t packed[SECSIZE + 2];
+    struct iovec iov[2] = {
+        { (void *)data, SECSIZE },
+        { trailer, 2 }
+    };
+    int len, n = 0;
+
+    if (p->caps & CAP_RLE) {
+        iov[0].iov_base = packed;
+        iov[0].iov_len = rle_encode( data, packed);
+    }
+    len = iov[0].iov_len;
+    p->frames++;
+    p->frame_bytes += len + 2;
+
+    if (p->txlen == 0 && p->pace == 0 && (n = link_writev( p, iov, 2)) < 0)
+        n = 0;      // EAGAIN or line error: queue it, port_flush() will tell
+    if (n < len) {
+        link_write( p, (uint8_t *)iov[0].iov_base + n, len - n);
+        n = len;
+    }
+    link_write( p, trailer + n - len, len + 2 - n);
+}
+
+/**
+ * Handle 'S' (Send) command - read sector from disk and transmit to client
+ * 
+ * PROTOCOL SEQUENCE:
+ * 1. Receive: [drive] [track] [sector] (collected by port_feed())
+ * 2. Get the sector from the sectors read ahead, or from the disk image
+ *    (dsk_read(), no copy when mapped)
+ * 3. Send: [256 data bytes] [checksum MSB] [checksum LSB]
+ * 4. Read ahead the next sectors of the chain (prefetch_chain())
+ * 5. Receive: ACK (success) or NAK (retransmit request), handled by the
+ *    event loop once it arrives (see sndack())
+ * 
+ * ERROR HANDLING:
+ * - If no disk mounted: send zeros with bad checksum to force NAK
+ * - If invalid track/sector: send zeros
+ * - If read error: send zeros
+ * 
+ * @param p Port the command was received on
+ * @param drv Drive number (see port_drive())
+ * @param ntrk Track number
+ * @param nsec Sector number
+ * 
+ * DEBUGGING:
+ * With verbose mode, prints read status and transmission result
+ */
+void sndblk( port_config_t *p, int drv, uint8_t ntrk, uint8_t nsec)
+{
+    static const uint8_t nodisk[FRAMESIZE + 1] = { [FRAMESIZE] = 1 };
+    flex_drive_t *disk = port_drive( p, drv);
+    const uint8_t *sector = NULL;
+    int retval;
+    int pos;
+
+    retval = 1;
+    p->state = PS_ACK;
+
+    if (disk->ready == 0) {		// force checksum error if disk not ready
+        if (verbose)
+            printf( "No disk mounted, force CRC error!\n");
+        if (p->caps & CAP_RLE) {    // Same zeros, compressed, with a bad checksum
+            uint8_t frame[FRAMESIZE + 2];
+            int n = rle_encode( nodisk, frame);
+
+            frame[n++] = 0;
+            frame[n++] = 1;
+            link_write( p, frame, n);
+        } else {
+            link_write( p, nodisk, sizeof(nodisk));
+        }
+        return ;
+    }
+
+    if ((pos = SECSIZE * ts2blk( disk, ntrk, nsec)) >= 0)
+        sector = prefetch_get( disk, pos);
+    if (pos < 0 || (sector == NULL && (sector = dsk_read( disk, pos, disk->bloc)) == NULL)) {
+        retval = 0;
+        memset( disk->bloc, 0, SECSIZE);
+        sector = disk->bloc;
+    }
+    if (verbose) {
+        if (retval) {
+            printf( "Bloc dsk %d [0x%02X/0x%02X] (pos = %d) read", drv, ntrk, nsec, pos);
+        } else {
+            printf( "Fail to read bloc dsk %d [0x%02X/0x%02X] (pos = %d)", drv, ntrk, nsec, pos);
+        }
+    }
+
+    link_sector( p, sector);
+    if (retval)
+        prefetch_chain( disk, sector);
+}
+
+/**
+ * Count a frame answered by the client, for adaptive pacing
+ *
+ * A line that loses bytes (a UART without handshake overrun by bursts,
+ * a slow client CPU) shows as NAKs. When PACE_NAKS come in a window of
+ * PACE_WINDOW frames, the output is slowed down one level: port_flush()
+ * then writes it in smaller chunks, each followed by the time it takes
+ * on the wire and a gap. A window without a NAK speeds it up again, so a
+ * clean line runs at full speed.
+ *
+ * @param p Port the answer was received on
+ * @param ok The frame was ACKed
+ */
+void pace_count( port_config_t *p, int ok)
+{
+    if (!ok)
+        p->naks++;
+    // Sockets, rings and sessions lose no bytes, and have no line rate
+    if (!p->pacing || p->transport != LINK_SERIAL)
+        return;
+    p->pace_frames++;
+    p->pace_naks += !ok;
+    if (p->pace_naks >= PACE_NAKS && p->pace < PACE_MAX) {
+        p->pace++;
+        log_message( LOG_INFO, "%s: %d NAKs in %d frames, pacing level %d",
+                     p->device, p->pace_naks, p->pace_frames, p->pace);
+    } else if (p->pace_frames == PACE_WINDOW && p->pace_naks == 0 && p->pace > 0) {
+        p->pace--;
+        if (verbose)
+            printf( "%s: line clean, pacing level %d\n", p->device, p->pace);
+    } else if (p->pace_frames < PACE_WINDOW) {
+        return;
+    }
+    p->pace_frames = p->pace_naks = 0;
+}
+
+/**
+ * Handle the client answer to a sector sent by sndblk()
+ *
+ * @param p Port the answer was received on
+ * @param retval Byte received from the client (ACK or NAK expected)
+ */
+void sndack( port_config_t *p, int retval)
+{
+    p->state = PS_IDLE;
+    if (port_drive( p, p->hdr[0])->ready)     // Not the NAK of a missing disk
+        pace_count( p, retval == ACK);
+    if (verbose) {
+        if (retval == NAK) {
+            printf( "... transmission failed\n");
+        } else if (retval == ACK) {
+            printf ("... transmission OK\n");
+        } else {
+            printf ("... return value not expected : 0x%02X\n", retval);
+        }
+    }
+}
+
+/**
+ * Handle 'T' (read ahead) command - send consecutive sectors of a track
+ *
+ * PROTOCOL SEQUENCE:
+ * 1. Receive: [drive] [track] [sector] [count] (collected by port_feed())
+ * 2. Send: [n], the number of sectors that follow: count, cut at the end
+ *    of the track; 0 if no disk is mounted or the sector is not on it
+ * 3. Send n times: [256 data bytes] [checksum MSB] [checksum LSB],
+ *    back to back, as fast as the line drains (see port_pump())
+ * 4. Receive: ACK (all sectors good) or NAK, unless n was 0
+ *
+ * A client that gets 0 sectors or a bad checksum falls back to 'S' for the
+ * sector it needs. Old clients never send 'T'.
+ *
+ * @param p Port the command was received on
+ */
+void sndtrk( port_config_t *p)
+{
+    flex_drive_t *disk = port_drive( p, p->hdr[0]);
+    int ntrk = p->hdr[1], nsec = p->hdr[2], count = p->hdr[3];
+    int last = ntrk == 0 ? disk->track0l : disk->nbsec;
+    int n = 0;
+
+    if (disk->ready && nsec > 0 && nsec <= last && ts2blk( disk, ntrk, nsec) >= 0)
+        n = count < last - nsec + 1 ? count : last - nsec + 1;
+    if (verbose)
+        printf( "Read ahead %d sectors from [0x%02X/0x%02X]\n", n, ntrk, nsec);
+
+    link_putc( p, n);
+    p->nbulk = n;
+    p->state = n ? PS_BULK : PS_IDLE;
+}
+
+/**
+ * Handle 'L' (Load) command - stream a FLEX sector chain
+ *
+ * PROTOCOL SEQUENCE:
+ * 1. Receive: [drive] [track] [sector] [window] (collected by port_feed())
+ * 2. Send for each sector of the chain, starting with the one asked for and
+ *    following the link in the first two bytes of each:
+ *    [track] [sector] [256 data bytes] [checksum MSB] [checksum LSB]
+ *    then [0] [0] once the chain ends (see port_pump())
+ * 3. Receive: one ACK or NAK per frame, while the next ones go out
+ *
+ * At most window frames wait for their ACK, so the client sets how far
+ * ahead the server may run. A NAK stops the stream: the frames already on
+ * their way are answered too, then the client asks again from the bad
+ * sector. The stream also ends at a link off the disk, or after as many
+ * sectors as the disk holds, so a looping chain cannot run forever.
+ * A client that finds a non-zero link in the last frame knows the chain
+ * was cut.
+ *
+ * @param p Port the command was received on
+ */
+void sndchain( port_config_t *p)
+{
+    flex_drive_t *disk = port_drive( p, p->hdr[0]);
+    int window = p->hdr[3];
+
+    p->hdr[3] = window < 1 ? 1 : window > CHAIN_WINDOW ? CHAIN_WINDOW : window;
+    p->nbulk = 0;
+    p->nchain = disk->ready ? disk->track0l + disk->nbtrk * disk->nbsec : 0;
+    p->state = PS_CHAIN;
+    if (verbose)
+        printf( "Stream chain from [0x%02X/0x%02X], window %d\n",
+                p->hdr[1], p->hdr[2], p->hdr[3]);
+}
+
+/**
+ * Handle the client answer to a frame sent by sndchain()
+ *
+ * @param p Port the answer was received on
+ * @param reply Byte received from the client: ACK, anything else stops
+ *              the stream
+ */
+void chain_ack( port_config_t *p, int reply)
+{
+    if (p->nbulk > 0)
+        p->nbulk--;
+    if (reply == ACK || p->nchain > 0)      // The frames after a NAK are not
+        pace_count( p, reply == ACK);       // counted, the stream has stopped
+    if (reply != ACK) {
+        if (verbose && p->nchain >= 0)
+            printf( "Chain stream stopped by client (0x%02X)\n", reply);
+        if (p->nchain > 0)
+            p->nchain = 0;
+    }
+    if (p->nchain < 0 && p->nbulk == 0)
+        p->state = PS_IDLE;
+}
+
+/**
+ * Send the next sectors of a 'T' or 'L' command while the output queue
+ * has room (and, for 'L', while the client window is open)
+ *
+ * Each sector queued counts as activity for the command timeout, as a
+ * whole track takes seconds to go out at 19200 baud.
+ *
+ * @param p Port to send on
+ */
+void port_pump( port_config_t *p)
+{
+    flex_drive_t *disk = port_drive( p, p->hdr[0]);    // Of the T or L command
+
+    while (p->state == PS_CHAIN && p->nchain >= 0 && TXBUFSIZE - p->txlen >= TXROOM &&
+           (p->nbulk < p->hdr[3] || p->nchain == 0)) {
+        int pos = -1;
+        const uint8_t *sector = NULL;
+
+        if (p->nchain > 0 && (p->hdr[1] || p->hdr[2]))
+            pos = SECSIZE * ts2blk( disk, p->hdr[1], p->hdr[2]);
+        if (pos >= 0)
+            sector = dsk_read( disk, pos, disk->bloc);
+        if (sector == NULL) {           // End of chain, bad link or read error
+            link_putc( p, 0);
+            link_putc( p, 0);
+            p->nchain = -1;
+            if (p->nbulk == 0)
+                p->state = PS_IDLE;
+            break;
+        }
+        link_putc( p, p->hdr[1]);
+        link_putc( p, p->hdr[2]);
+        link_sector( p, sector);
+        p->hdr[1] = sector[0];
+        p->hdr[2] = sector[1];
+        p->nchain--;
+        p->nbulk++;
+        p->deadline = now_ms() + p->timeout;
+    }
+
+    while (p->state == PS_BULK && TXBUFSIZE - p->txlen >= TXROOM) {
+        int pos = SECSIZE * ts2blk( disk, p->hdr[1], p->hdr[2]++);
+        const uint8_t *sector = NULL;
+
+        if (pos >= 0)
+            sector = dsk_read( disk, pos, disk->bloc);
+        if (sector == NULL) {           // Read error: zeros, like sndblk()
+            memset( disk->bloc, 0, SECSIZE);
+            sector = disk->bloc;
+        }
+        link_sector( p, sector);
+        if (--p->nbulk == 0)
+            p->state = PS_ACK;
+        p->deadline = now_ms() + p->timeout;
     }
 }
 
 /**
  * Handle 'R' (Receive) command - receive sector from client and write to disk
  * 
- * PROTOCOL SEQUENCE:
- * 1. Receive: [drive] [track] [sector] [256 data bytes] [checksum MSB] [checksum LSB]
- * 2. Verify checksum of received data
- * 3. If checksum OK and valid position: write sector to disk
- * 4. Return: 1 for success (ACK will be sent), 0 for failure (NAK will be sent)
+ * PROTOCOL SEQUENCE:
+ * 1. Receive: [drive] [track] [sector] [256 data bytes] [checksum MSB] [checksum LSB]
+ *    (collected by port_feed())
+ * 2. Verify checksum of received data, in place in the receive frame
+ * 3. If checksum OK and valid position: write sector to disk (dsk_write(),
+ *    a single copy into the mapping when the image is mapped)
+ * 4. Return: 1 for success (ACK will be sent), 0 for failure (NAK will be sent)
+ * 
+ * ERROR CONDITIONS:
+ * - Checksum mismatch: data corruption during transmission
+ * - Invalid track/sector: address out of range
+ * - No disk ready: disk not mounted
+ * - Write failure: disk I/O error
+ * 
+ * @param p Port the command was received on
+ * @param drv Drive number (see port_drive())
+ * @param ntrk Track number
+ * @param nsec Sector number
+ * @param data Received [256 data bytes] [checksum MSB] [checksum LSB]
+ * @return 1 on successful write, 0 on any error
+ * 
+ * DEBUGGING:
+ * With verbose mode, displays checksum errors and hex dump of bad data
+ */
+int rcvblk( port_config_t *p, int drv, uint8_t ntrk, uint8_t nsec, uint8_t *data)
+{
+    flex_drive_t *disk = port_drive( p, drv);
+    int msb, lsb, chks;		// For checksum computing and transmitting
+    int retval;
+    int pos;
+    int i;
+
+    pos = SECSIZE * ts2blk( disk, ntrk, nsec);
+
+    msb = data[SECSIZE];
+    lsb = data[SECSIZE + 1];
+    retval = 1;
+
+    if ((chks = checksum( data)) == msb * 256 + lsb) {
+        if (pos < 0)
+            retval = 0;
+        else {
+            if (disk->ready == 0)
+                return (retval = 0);
+            if (dsk_write( disk, pos, data) < 0)
+                retval = 0;
+            else if (p->durability >= DUR_INTERVAL &&
+                     (p->flush_at == 0 || p->durability == DUR_IDLE))
+                p->flush_at = now_ms() + p->wb_delay;
+        }
+    } else {
+        retval = 0;
+        if (verbose) {
+            printf( "Bad checksum (0x%04X instead of 0x%04X)\n", msb * 256 + lsb, chks);
+            for (i = 0; i< 256; i++)
+                printf ("%c0x%02x", i%16?' ':'\n', data[i]);
+        }
+    }
+    if (verbose) {
+        if (retval) {
+            printf( "Bloc dsk %d [0x%02X/0x%02X] (pos = %d) written\n", drv, ntrk, nsec, pos);
+        } else {
+            printf( "Fail to write bloc dsk %d [0x%02X/0x%02X] (pos = %d)\n", drv, ntrk, nsec, pos);
+        }
+    }
+    return retval;
+}
+
+/**
+ * Read a sector of a drive by its FLEX address
+ *
+ * @param drv Drive to read from
+ * @param ttss Track (high byte) and sector (low byte)
+ * @param buf 256-byte buffer to use when the sector is not mapped
+ * @return Pointer to the sector, NULL if off the disk or unreadable
+ */
+const uint8_t *flex_read( flex_drive_t *drv, int ttss, uint8_t *buf)
+{
+    int blk = ts2blk( drv, ttss >> 8, ttss & 0xFF);
+
+    return blk < 0 ? NULL : dsk_read( drv, blk * SECSIZE, buf);
+}
+
+/**
+ * Write a sector of a drive by its FLEX address
+ *
+ * @return 0 on success, -1 if off the disk or on write error
+ */
+int flex_write( flex_drive_t *drv, int ttss, const uint8_t *data)
+{
+    int blk = ts2blk( drv, ttss >> 8, ttss & 0xFF);
+
+    return blk < 0 ? -1 : dsk_write( drv, blk * SECSIZE, data);
+}
+
+/**
+ * Turn a "NAME.EXT" parameter into an 11-byte FLEX directory name
+ *
+ * The name has 1 to 8 characters, the first being a letter, and the
+ * extension up to 3; both are upper-cased and padded with zeros.
+ *
+ * @return 0 on success, -1 if the name is not a valid FLEX file name
+ */
+int flex_name( const char *arg, uint8_t *name)
+{
+    int k = 0, max = 8;
+
+    memset( name, 0, 11);
+    if (!isalpha( (unsigned char)*arg))
+        return -1;
+    for (; *arg; arg++) {
+        if (*arg == '.' && max == 8) {
+            k = 8;
+            max = 11;
+        } else if ((isalnum( (unsigned char)*arg) || *arg == '-' || *arg == '_') && k < max) {
+            name[k++] = toupper( (unsigned char)*arg);
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Look a file up in the directory of a drive
+ *
+ * Deleted entries (first byte with the high bit set) and never used ones
+ * (first byte 0) are skipped, the first of them is kept as a free slot.
+ *
+ * @param drv Drive to search
+ * @param name 11-byte FLEX name
+ * @param where Out: directory sector (0xTTSS) and entry offset of the file,
+ *              or of the first free entry (sector 0 if the directory is full)
+ * @param last Out: last directory sector, to extend a full directory
+ * @return 1 if found, 0 if not, -1 on a broken directory chain
+ */
+int flex_lookup( flex_drive_t *drv, const uint8_t *name, int *where, int *last)
+{
+    int guard = drv->track0l + drv->nbtrk * drv->nbsec;
+    const uint8_t *sector;
+    uint8_t buf[SECSIZE];
+
+    where[0] = 0;
+    for (int ttss = DIR_TTSS; ttss; ttss = sector[0] << 8 | sector[1]) {
+        if (guard-- == 0 || (sector = flex_read( drv, ttss, buf)) == NULL)
+            return -1;
+        *last = ttss;
+        for (int off = 16; off < 16 + DIR_ENTRIES * DIR_ENTSIZE; off += DIR_ENTSIZE) {
+            if (sector[off] == 0 || sector[off] & 0x80) {
+                if (where[0] == 0) {
+                    where[0] = ttss;
+                    where[1] = off;
+                }
+            } else if (memcmp( sector + off, name, 11) == 0) {
+                where[0] = ttss;
+                where[1] = off;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Order directory index entries by name, then by directory position
+ */
+int dir_compare( const void *a, const void *b)
+{
+    const dir_entry_t *x = a, *y = b;
+    int c = strcmp( x->name, y->name);
+
+    if (c)
+        return c;
+    return x->ttss != y->ttss ? x->ttss - y->ttss : x->off - y->off;
+}
+
+/**
+ * Build the directory index of a drive
+ *
+ * Live entries are keyed by their getname() form and sorted, so a lookup
+ * is a binary search instead of a walk of the directory chain. The index
+ * lasts until one of the sectors it was built from is written (see
+ * dsk_write()) or the image is unmounted. Entries getname() rejects are
+ * left out, and the index is then marked partial: a name it misses may
+ * still be on the disk.
+ *
+ * @param drv Drive to index
+ * @return 0 on success, -1 on a broken directory chain or no memory
+ */
+int dir_index( flex_drive_t *drv)
+{
+    int guard = drv->track0l + drv->nbtrk * drv->nbsec;
+    const uint8_t *sector;
+    uint8_t buf[SECSIZE];
+    int size = 0, nblk = 0;
+
+    dir_drop( drv);
+    drv->dir_partial = 0;
+    for (int ttss = DIR_TTSS; ttss; ttss = sector[0] << 8 | sector[1]) {
+        if (guard-- == 0 || (sector = flex_read( drv, ttss, buf)) == NULL)
+            goto fail;
+        if (drv->ndirblk == nblk) {
+            int *more = realloc( drv->dirblk, (nblk += 16) * sizeof(int));
+
+            if (more == NULL)
+                goto fail;
+            drv->dirblk = more;
+        }
+        drv->dirblk[drv->ndirblk++] = ts2blk( drv, ttss >> 8, ttss & 0xFF);
+
+        for (int off = 16; off < 16 + DIR_ENTRIES * DIR_ENTSIZE; off += DIR_ENTSIZE) {
+            dir_entry_t *e;
+
+            if (sector[off] == 0 || sector[off] & 0x80)
+                continue;
+            if (drv->ndir == size) {
+                dir_entry_t *more = realloc( drv->dir, (size += 64) * sizeof(dir_entry_t));
+
+                if (more == NULL)
+                    goto fail;
+                drv->dir = more;
+            }
+            e = &drv->dir[drv->ndir];
+            if (getname( (uint8_t *)sector + off, e->name, 1) < 0) {
+                drv->dir_partial = 1;
+                continue;
+            }
+            e->ttss = ttss;
+            e->off = off;
+            memcpy( e->entry, sector + off, DIR_ENTSIZE);
+            drv->ndir++;
+        }
+    }
+    qsort( drv->dir, drv->ndir, sizeof(dir_entry_t), dir_compare);
+    if (drv->dir == NULL)               // Empty directory, still indexed
+        drv->dir = malloc( sizeof(dir_entry_t));
+    if (drv->dir == NULL)
+        goto fail;
+    if (verbose)
+        printf( "Directory of %s indexed: %d files in %d sectors%s\n", drv->diskname,
+                drv->ndir, drv->ndirblk, drv->dir_partial ? " (partial)" : "");
+    return 0;
+
+fail:
+    dir_drop( drv);
+    return -1;
+}
+
+/**
+ * Translate the sector map of a random file for its copy
+ *
+ * Each map entry of the source, a run of count sectors from (t, s), is
+ * found in the source chain; the same sectors of the copy are entered in
+ * the new map, a run being cut wherever the copy is not contiguous.
+ *
+ * @param src Source file sectors, in chain order
+ * @param dst Sectors of the copy, in the same order
+ * @param n Number of sectors
+ * @param map First 2 sectors of the source; their maps are rewritten
+ * @return 0 on success, or a FLEX error number
+ */
+int flex_remap( const int *src, const int *dst, int n, uint8_t map[2][SECSIZE])
+{
+    uint8_t old[MAP_ENTRIES * 3];
+    int k = 0, i = 0;
+
+    for (int m = 0; m < 2; m++) {
+        memcpy( old + m * (SECSIZE - 4), map[m] + 4, SECSIZE - 4);
+        memset( map[m] + 4, 0, SECSIZE - 4);
+    }
+    for (uint8_t *e = old; e < old + sizeof(old) && (e[0] || e[1]); e += 3) {
+        int start = e[0] << 8 | e[1];
+
+        if (i >= n || src[i] != start)         // Runs usually follow each other
+            for (i = 0; i < n && src[i] != start; i++)
+                ;
+        if (i + e[2] > n)
+            return FE_ADDRESS;
+        for (int j = i; j < i + e[2]; j++) {
+            uint8_t *run = k ? map[(k - 1) / 84] + 4 + (k - 1) % 84 * 3 : NULL;
+
+            if (run && run[2] < 255 && dst[j] == (run[0] << 8 | run[1]) + run[2] &&
+                (dst[j] & 0xFF) > run[2]) {
+                run[2]++;                       // Same track, next sector
+                continue;
+            }
+            if (k == MAP_ENTRIES)
+                return FE_MAPFULL;
+            run = map[k / 84] + 4 + k % 84 * 3;
+            run[0] = dst[j] >> 8;
+            run[1] = dst[j] & 0xFF;
+            run[2] = 1;
+            k++;
+        }
+        i += e[2];
+    }
+    return 0;
+}
+
+/**
+ * Handle 'F' (File copy) command - copy a FLEX file between two drives
+ *
+ * The parameter is [source drive] [destination drive] "NAME.EXT" CR. The
+ * server does what FLEX COPY would, without the sectors crossing the line:
+ * 1. Find the file in the source directory, and a free entry (not the same
+ *    name) in the destination one
+ * 2. Take as many sectors from the head of the destination free chain,
+ *    plus one to extend the directory if it is full
+ * 3. Write the copied sectors, linked in their new order (the sector map
+ *    of a random file is rebuilt), then the SIR, then the new entry
+ *
+ * Sectors are written as the durability policy of the destination asks,
+ * except that DUR_SYNC and DUR_ASYNC flush the image once, at the end.
+ *
+ * @param p Port the command was received on
+ * @return 0 on success (ACK will be sent), or the FLEX error number to
+ *         send after the NAK
+ */
+int flexcopy( port_config_t *p)
+{
+    int s = p->hdr[0], d = p->hdr[1];
+    flex_drive_t *src, *dst;
+    uint8_t name[11], entry[DIR_ENTSIZE], sir[SECSIZE], map[2][SECSIZE], buf[SECSIZE];
+    const uint8_t *sector;
+    int where[2], last, ttss, n, nfree, need, err, dur;
+    int *chain = NULL, *alloc = NULL;
+
+    if (s >= MAX_DRIVES_PER_PORT || d >= MAX_DRIVES_PER_PORT)
+        return FE_DRIVE;
+    src = port_drive( p, s);        // Drives apart, or drive 0 as for 's'
+    dst = port_drive( p, d);
+    if (src == dst)
+        return FE_DRIVE;
+    if (!src->ready || !dst->ready)
+        return FE_NOTREADY;
+    if (dst->readonly)
+        return FE_WPROT;
+    if (flex_name( p->arg, name) < 0)
+        return FE_NAME;
+
+    // Source entry, and where the copy goes
+    if ((err = flex_lookup( src, name, where, &last)) <= 0)
+        return err < 0 ? FE_DIRERR : FE_NOTFOUND;
+    if ((sector = flex_read( src, where[0], buf)) == NULL)
+        return FE_READ;
+    memcpy( entry, sector + where[1], DIR_ENTSIZE);
+    if ((err = flex_lookup( dst, name, where, &last)) != 0)
+        return err < 0 ? FE_DIRERR : FE_EXISTS;
+
+    // Source sectors, following the links (the entry count is not trusted)
+    n = src->track0l + src->nbtrk * src->nbsec;
+    if ((chain = malloc( n * sizeof(int))) == NULL)
+        return FE_READ;
+    ttss = entry[13] << 8 | entry[14];
+    for (n = 0; ttss; n++) {
+        if (n == src->track0l + src->nbtrk * src->nbsec ||
+            (sector = flex_read( src, ttss, buf)) == NULL) {
+            free( chain);
+            return FE_ADDRESS;
+        }
+        chain[n] = ttss;
+        ttss = sector[0] << 8 | sector[1];
+    }
+    if (n == 0 || (entry[19] && n < 2)) {
+        free( chain);
+        return FE_ADDRESS;
+    }
+
+    // Sectors of the copy, from the head of the destination free chain
+    if ((sector = flex_read( dst, SIR_TTSS, sir)) == NULL) {
+        free( chain);
+        return FE_READ;
+    }
+    if (sector != sir)
+        memcpy( sir, sector, SECSIZE);
+    nfree = sir[SIR_FREE + 4] << 8 | sir[SIR_FREE + 5];
+    need = n + (where[0] == 0);
+    if (nfree < need) {
+        free( chain);
+        return nfree < n ? FE_FULL : FE_DIRFULL;
+    }
+    if ((alloc = malloc( need * sizeof(int))) == NULL) {
+        free( chain);
+        return FE_READ;
+    }
+    ttss = sir[SIR_FREE] << 8 | sir[SIR_FREE + 1];
+    for (int i = 0; i < need; i++) {
+        if (ttss == 0 || (sector = flex_read( dst, ttss, buf)) == NULL) {
+            free( chain);
+            free( alloc);
+            return FE_ADDRESS;
+        }
+        alloc[i] = ttss;
+        ttss = sector[0] << 8 | sector[1];
+    }
+    if (nfree == need)
+        ttss = 0;                       // Free chain used up
+    sir[SIR_FREE] = ttss >> 8;
+    sir[SIR_FREE + 1] = ttss & 0xFF;
+    if (ttss == 0)
+        sir[SIR_FREE + 2] = sir[SIR_FREE + 3] = 0;
+    sir[SIR_FREE + 4] = (nfree - need) >> 8;
+    sir[SIR_FREE + 5] = (nfree - need) & 0xFF;
+
+    // A random file gets a new sector map
+    if (entry[19]) {
+        for (int m = 0; m < 2; m++) {
+            if ((sector = flex_read( src, chain[m], map[m])) == NULL) {
+                err = FE_READ;
+                goto done;
+            }
+            if (sector != map[m])
+                memcpy( map[m], sector, SECSIZE);
+        }
+        if ((err = flex_remap( chain, alloc, n, map)) != 0)
+            goto done;
+    }
+
+    dur = dst->durability;
+    if (dur == DUR_ASYNC || dur == DUR_SYNC)
+        dst->durability = DUR_NONE;
+    err = FE_WRITE;
+    for (int i = 0; i < n; i++) {
+        if (entry[19] && i < 2) {
+            sector = map[i];
+        } else if ((sector = flex_read( src, chain[i], buf)) == NULL) {
+            err = FE_READ;
+            goto restore;
+        }
+        if (sector != buf)
+            memcpy( buf, sector, SECSIZE);
+        buf[0] = i < n - 1 ? alloc[i + 1] >> 8 : 0;
+        buf[1] = i < n - 1 ? alloc[i + 1] & 0xFF : 0;
+        if (flex_write( dst, alloc[i], buf) < 0)
+            goto restore;
+    }
+    if (flex_write( dst, SIR_TTSS, sir) < 0)
+        goto restore;
+
+    // Directory entry, in a new directory sector if none was free
+    if (where[0] == 0) {
+        memset( buf, 0, SECSIZE);
+        if (flex_write( dst, alloc[n], buf) < 0 ||
+            (sector = flex_read( dst, last, buf)) == NULL)
+            goto restore;
+        if (sector != buf)
+            memcpy( buf, sector, SECSIZE);
+        buf[0] = alloc[n] >> 8;
+        buf[1] = alloc[n] & 0xFF;
+        if (flex_write( dst, last, buf) < 0)
+            goto restore;
+        where[0] = alloc[n];
+        where[1] = 16;
+    }
+    if ((sector = flex_read( dst, where[0], buf)) == NULL)
+        goto restore;
+    if (sector != buf)
+        memcpy( buf, sector, SECSIZE);
+    memcpy( buf + where[1], entry, DIR_ENTSIZE);
+    buf[where[1] + 13] = alloc[0] >> 8;
+    buf[where[1] + 14] = alloc[0] & 0xFF;
+    buf[where[1] + 15] = alloc[n - 1] >> 8;
+    buf[where[1] + 16] = alloc[n - 1] & 0xFF;
+    buf[where[1] + 17] = n >> 8;
+    buf[where[1] + 18] = n & 0xFF;
+    if (flex_write( dst, where[0], buf) < 0)
+        goto restore;
+    err = 0;
+
+restore:
+    dst->durability = dur;
+    if (err == 0 && dur == DUR_SYNC && (dst->delta || !dst->map) &&
+        fdatasync( dst->delta ? dst->fd_delta : dst->fd_disk) < 0)
+        err = FE_WRITE;
+    if (dst->delta && dur >= DUR_INTERVAL)
+        dst->delta_sync = 1;
+    if (err == 0 && (dur == DUR_ASYNC || dur == DUR_SYNC) && dst->map && !dst->delta &&
+        msync( dst->map, dst->mapsize, dur == DUR_SYNC ? MS_SYNC : MS_ASYNC) < 0)
+        err = FE_WRITE;
+    if (dur >= DUR_INTERVAL && (p->flush_at == 0 || dur == DUR_IDLE))
+        p->flush_at = now_ms() + p->wb_delay;
+done:
+    free( chain);
+    free( alloc);
+    if (verbose)
+        printf( "Copy %s from drive %d to %d: %d sectors, %s (%d)\n", p->arg, s, d, n,
+                err ? "failed" : "done", err);
+    return err;
+}
+
+/**
+ * Handle 'N' (Name lookup) command - find a file in the directory
+ *
+ * PROTOCOL SEQUENCE:
+ * 1. Receive: [drive] [11-byte FLEX name] (collected by port_feed())
+ * 2. Send: [ACK] [track] [sector] [offset] [24-byte entry] [checksum MSB]
+ *    [checksum LSB], the checksum being the sum of the 27 bytes after the
+ *    ACK; or [NAK] [FLEX error number]
+ *
+ * The answer comes from the directory index of the drive (dir_index()),
+ * so opening a file costs the client one exchange instead of a read per
+ * directory sector. Error 4 means the file is not in the directory; with
+ * any other error the client has to search the directory itself.
+ *
+ * @param p Port the command was received on
+ */
+void dirlook( port_config_t *p)
+{
+    flex_drive_t *disk = port_drive( p, p->hdr[0]);
+    uint8_t *query = p->data;
+    dir_entry_t key = { 0 }, *e = NULL;
+    uint8_t reply[3 + DIR_ENTSIZE];
+    int err = 0, chks = 0;
+
+    if (!disk->ready)
+        err = FE_NOTREADY;
+    else if (getname( query, key.name, 1) < 0)
+        err = FE_NAME;
+    else if (disk->dir == NULL && dir_index( disk) < 0)
+        err = FE_DIRERR;
+    else {
+        int lo = 0, hi = disk->ndir;
+
+        while (lo < hi) {                   // First entry of that name (key.ttss, off 0)
+            int mid = (lo + hi) / 2;
+
+            if (dir_compare( &disk->dir[mid], &key) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        // getname() drops padding, the raw names must match too
+        e = &disk->dir[lo];
+        for (; e < disk->dir + disk->ndir && strcmp( e->name, key.name) == 0; e++)
+            if (memcmp( e->entry, query, 11) == 0)
+                break;
+        if (e == disk->dir + disk->ndir || strcmp( e->name, key.name) != 0)
+            err = disk->dir_partial ? FE_DIRERR : FE_NOTFOUND;
+    }
+
+    if (verbose)
+        printf( "Lookup %s: %s (%d)\n", key.name, err ? "failed" : "found", err);
+    if (err) {
+        link_putc( p, NAK);
+        link_putc( p, err);
+        return;
+    }
+    reply[0] = e->ttss >> 8;
+    reply[1] = e->ttss & 0xFF;
+    reply[2] = e->off;
+    memcpy( reply + 3, e->entry, DIR_ENTSIZE);
+    for (int i = 0; i < (int)sizeof(reply); i++)
+        chks += reply[i];
+    link_putc( p, ACK);
+    link_write( p, reply, sizeof(reply));
+    link_putc( p, chks >> 8);
+    link_putc( p, chks & 0xFF);
+}
+
+/**
+ * Absolute path of an opened directory, as getcwd() would give it
+ *
+ * @param fd Directory (an O_PATH descriptor will do)
+ * @param path Out: the path
+ * @param size Size of path
+ * @return 0 on success, -1 if the path is unknown or too long
+ */
+int dir_path( int fd, char *path, size_t size)
+{
+    char link[32];
+    ssize_t len;
+
+    snprintf( link, sizeof(link), "/proc/self/fd/%d", fd);
+    if ((len = readlink( link, path, size)) < 0 || (size_t)len >= size || path[0] != '/')
+        return -1;
+    path[len] = 0;
+    return 0;
+}
+
+/**
+ * Handle RCD (Remote Change Directory) command
+ * 
+ * Changes the port's current directory. The new directory path is the
+ * command parameter (p->arg, set by port_feed()), relative to the port's
+ * current directory. The process working directory is left alone: each
+ * port keeps its own directory open (p->dirfd), so ports move around
+ * independently.
+ * 
+ * @param p Port the command was received on
+ * @return 1 on success (ACK will be sent), 0 on failure (NAK will be sent)
+ * 
+ * SIDE EFFECTS:
+ * - Replaces p->dirfd with the new directory
+ * - Updates p->curdir with its absolute path (dir_path())
+ * 
+ * DEBUGGING:
+ * With verbose mode, shows directory change attempts and results
+ */
+int chngd( port_config_t *p)
+{
+    int fd = openat( p->dirfd, p->arg, O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0 || dir_path( fd, p->curdir, sizeof(p->curdir)) < 0) {
+        if (fd >= 0)
+            close( fd);
+        if (verbose)
+            printf( "Cannot change directory to %s\n", p->arg);
+        return 0;
+    }
+    close( p->dirfd);
+    p->dirfd = fd;
+    if (verbose)
+        printf( "Changing directory to %s\n", p->curdir);
+    return 1;
+}
+
+/**
+ * Handle 'X' (eXtensions) command - agree on protocol extensions
+ *
+ * Sent by the client after the 0x55/0xAA sync:
+ *   'X' [version] [caps wanted]  ->  [version] [caps offered] [caps granted]
+ * Granted extensions last until the next sync byte, so a client restarted
+ * with an old driver gets the plain protocol again. Clients that never send
+ * 'X' see no difference. Capability bytes are kept below 0x20, so an old
+ * server ignores the whole request and the client times out with none.
+ *
+ * Each byte carries CAP_BITS bits. From version 2 on, the client sends a
+ * second wanted byte for the next bits, and gets the second offered and
+ * granted bytes after the first ones. A version 1 client gets 3 bytes.
+ *
+ * @param p Port the command was received on
+ */
+void negotiate( port_config_t *p)
+{
+    int version = p->hdr[0], wanted = p->hdr[1];
+    int offered = CAP_OFFERED | (p->compress ? CAP_RLE : 0);
+    int mask = (1 << CAP_BITS) - 1;
+
+    if (version >= 2)
+        wanted |= p->hdr[2] << CAP_BITS;
+    else
+        offered &= mask;
+    p->caps = wanted & offered;
+    link_putc( p, CAP_VERSION);
+    link_putc( p, offered & mask);
+    link_putc( p, p->caps & mask);
+    if (version >= 2) {
+        link_putc( p, offered >> CAP_BITS);
+        link_putc( p, p->caps >> CAP_BITS);
+    }
+    if (verbose)
+        printf( "Extensions: client v%d asks $%02X, offered $%02X, granted $%02X\n",
+                version, wanted, offered, p->caps);
+}
+
+/**
+ * Release a names vector, freed with its last holder
+ */
+void names_release( names_t *v)
+{
+    if (v == NULL || --v->refs > 0)
+        return;
+    for (int i = 0; i < v->n; i++)
+        free( v->name[i]);
+    free( v->name);
+    free( v);
+}
+
+/**
+ * Append a name to a names vector
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+int names_add( names_t *v, const char *name)
+{
+    if (v->n % 64 == 0) {
+        char **more = realloc( v->name, (v->n + 64) * sizeof(char *));
+
+        if (more == NULL)
+            return -1;
+        v->name = more;
+    }
+    if ((v->name[v->n] = strdup( name)) == NULL)
+        return -1;
+    v->n++;
+    return 0;
+}
+
+/**
+ * Order names case folded, the way RDIR matches them (ties in byte order)
+ */
+int names_compare( const void *a, const void *b)
+{
+    const char *x = *(char * const *)a, *y = *(char * const *)b;
+    int c = strcasecmp( x, y);
+
+    return c ? c : strcmp( x, y);
+}
+
+/**
+ * Find the names starting with a prefix, case insensitive
+ *
+ * The names matching form one run of the sorted vector, found with two
+ * binary searches.
+ *
+ * @param v Sorted names
+ * @param prefix Prefix ("" matches every name)
+ * @param hi Out: end of the run
+ * @return Start of the run (equal to *hi if no name matches)
+ */
+int names_prefix( const names_t *v, const char *prefix, int *hi)
+{
+    size_t len = strlen( prefix);
+    int lo = 0, end = v->n;
+
+    while (lo < end) {                  // First name not below the prefix
+        int mid = (lo + end) / 2;
+
+        if (strncasecmp( v->name[mid], prefix, len) < 0)
+            lo = mid + 1;
+        else
+            end = mid;
+    }
+    *hi = v->n;
+    for (int start = lo; start < *hi; ) {   // First name past it
+        int mid = (start + *hi) / 2;
+
+        if (strncasecmp( v->name[mid], prefix, len) <= 0)
+            start = mid + 1;
+        else
+            *hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Read a directory for RDIR and RLIST
+ *
+ * One pass gives both lists: names ending in "DSK" (any case), and
+ * subdirectories other than "." and "..". The type of an entry comes
+ * from d_type, or from fstatat() for symbolic links (followed, like
+ * stat()) and file systems that do not fill d_type in. Both lists are
+ * sorted for names_prefix().
+ *
+ * @param dirfd Directory to read (an O_PATH descriptor will do)
+ * @param dsk Out: .DSK names
+ * @param dirs Out: subdirectory names
+ * @return 0 on success, -1 on error (nothing is returned)
+ */
+int listing_scan( int dirfd, names_t **dsk, names_t **dirs)
+{
+    struct dirent *entry;
+    DIR *dirp = NULL;
+    int fd, err = 0;
+
+    *dsk = calloc( 1, sizeof(names_t));
+    *dirs = calloc( 1, sizeof(names_t));
+    fd = openat( dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (*dsk == NULL || *dirs == NULL || fd < 0 || (dirp = fdopendir( fd)) == NULL) {
+        if (fd >= 0)
+            close( fd);
+        free( *dsk);
+        free( *dirs);
+        return -1;
+    }
+    (*dsk)->refs = (*dirs)->refs = 1;
+
+    while (err == 0 && (entry = readdir( dirp)) != NULL) {
+        size_t len = strlen( entry->d_name);
+        int isdir = entry->d_type == DT_DIR;
+        struct stat statbuf;
+
+        if (len >= 3 && strcasecmp( entry->d_name + len - 3, "DSK") == 0)
+            err = names_add( *dsk, entry->d_name);
+        if (strcmp(entry->d_name, ".") * strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            if (fstatat( fd, entry->d_name, &statbuf, 0) == -1) {
+                if (verbose)
+                    perror( entry->d_name);
+                continue;
+            }
+            isdir = S_ISDIR( statbuf.st_mode);
+        }
+        if (isdir && err == 0)
+            err = names_add( *dirs, entry->d_name);
+    }
+    closedir( dirp);
+    if (err) {
+        names_release( *dsk);
+        names_release( *dirs);
+        return -1;
+    }
+    qsort( (*dsk)->name, (*dsk)->n, sizeof(char *), names_compare);
+    qsort( (*dirs)->name, (*dirs)->n, sizeof(char *), names_compare);
+    return 0;
+}
+
+/**
+ * Forget the listing of a directory, and stop watching it
+ */
+void listing_drop( listing_t *l)
+{
+    inotify_rm_watch( listings.fd, l->wd);
+    names_release( l->dsk);
+    names_release( l->dirs);
+    l->dsk = l->dirs = NULL;
+    l->path[0] = 0;
+}
+
+/**
+ * Get the RDIR and RLIST names of a directory
+ *
+ * The listings of the last LISTING_MAX directories read are kept, each
+ * with an inotify watch: once an entry is created, deleted or renamed
+ * the listing is stale (listing_events()) and the next request reads
+ * the directory again. Without inotify, or past the watch limit, every
+ * request reads the directory.
+ *
+ * Directories are told apart by inode, so a port still in a directory
+ * renamed since gets its listing, and a new directory under the old name
+ * is another one.
+ *
+ * @param path Directory (absolute, as kept in curdir, for messages)
+ * @param dirfd The same directory, opened (watched and read through it)
+ * @param dsk Out: .DSK names, to release with names_release()
+ * @param dirs Out: subdirectory names, likewise
+ * @return 0 on success, -1 if the directory can't be read
+ */
+int listing_get( const char *path, int dirfd, names_t **dsk, names_t **dirs)
+{
+    listing_t *l = NULL, *lru = &listings.dir[0];
+    struct stat st;
+    char link[32];
+
+    if (listings.fd < 0 || fstat( dirfd, &st) < 0)
+        return listing_scan( dirfd, dsk, dirs);
+
+    for (int i = 0; i < LISTING_MAX && l == NULL; i++) {
+        listing_t *e = &listings.dir[i];
+
+        if (e->path[0] && e->dev == st.st_dev && e->ino == st.st_ino)
+            l = e;
+        else if (lru->path[0] && (e->path[0] == 0 || e->used < lru->used))
+            lru = e;
+    }
+
+    if (l == NULL) {
+        snprintf( link, sizeof(link), "/proc/self/fd/%d", dirfd);
+        int wd = inotify_add_watch( listings.fd, link, IN_CREATE | IN_DELETE |
+                                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+                                    IN_MOVE_SELF | IN_ONLYDIR);
+        if (wd < 0)
+            return listing_scan( dirfd, dsk, dirs);
+        l = lru;
+        if (l->path[0])
+            listing_drop( l);
+        snprintf( l->path, sizeof(l->path), "%s", path);
+        l->dev = st.st_dev;
+        l->ino = st.st_ino;
+        l->wd = wd;
+    }
+    l->used = ++listings.clock;
+
+    if (l->dsk == NULL) {               // New or stale: watched first, read then
+        if (listing_scan( dirfd, &l->dsk, &l->dirs) < 0) {
+            listing_drop( l);
+            return -1;
+        }
+        listings.scans++;
+        if (verbose)
+            printf( "Listing of %s read: %d images, %d directories\n",
+                    path, l->dsk->n, l->dirs->n);
+    } else {
+        listings.hits++;
+    }
+    l->dsk->refs++;
+    l->dirs->refs++;
+    *dsk = l->dsk;
+    *dirs = l->dirs;
+    return 0;
+}
+
+/**
+ * Handle the inotify events of the watched directories
+ *
+ * A change makes a listing stale; a directory deleted or moved away is
+ * forgotten. A queue overflow makes every listing stale.
+ */
+void listing_events( void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+
+    while ((len = read( listings.fd, buf, sizeof(buf))) > 0) {
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)ptr;
+            for (int i = 0; i < LISTING_MAX; i++) {
+                listing_t *l = &listings.dir[i];
+
+                if (l->path[0] == 0 || (l->wd != ev->wd && !(ev->mask & IN_Q_OVERFLOW)))
+                    continue;
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    listing_drop( l);
+                } else if (l->dsk) {
+                    names_release( l->dsk);
+                    names_release( l->dirs);
+                    l->dsk = l->dirs = NULL;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Find the image file an RMOUNT parameter names
+ *
+ * The listing of the port's directory (listing_get()) is sorted case
+ * folded, so it also serves as a case insensitive index of its images:
+ * of the names equal to "<param>.DSK" in any case, the one in upper case
+ * is preferred, then the one with ".dsk", then the first one. Pending
+ * inotify events are read first, so an image just created is found.
+ *
+ * @param p Port the command was received on
+ * @param name Out: file name of the image
+ * @param size Size of name
+ * @return 1 if found, 0 if there is no such image, -1 if the lookup can't
+ *         tell (parameter with a path, or no listing cache)
+ */
+int image_name( port_config_t *p, char *name, size_t size)
+{
+    names_t *dsk, *dirs;
+    char want[sizeof(p->arg) + 4];
+    int lo, hi, best = -1;
+    size_t len;
+
+    if (listings.fd < 0 || strchr( p->arg, '/') || p->arg[0] == 0)
+        return -1;
+    listing_events();                   // Changes not handled by the event loop yet
+    if (listing_get( p->curdir, p->dirfd, &dsk, &dirs) < 0)
+        return -1;
+    names_release( dirs);
+
+    len = snprintf( want, sizeof(want), "%s.DSK", p->arg);
+    for (lo = names_prefix( dsk, want, &hi); lo < hi; lo++) {
+        const char *n = dsk->name[lo];
+
+        if (strlen( n) != len)
+            continue;
+        if (best < 0 || strncmp( n, want, len - 3) == 0)
+            best = lo;
+        if (strcmp( n, want) == 0)
+            break;
+    }
+    if (best >= 0)
+        snprintf( name, size, "%s", dsk->name[best]);
+    names_release( dsk);
+    return best >= 0;
+}
+
+/**
+ * Handle RMOUNT (Remote Mount) and 'm' (FMOUNT) commands
+ * 
+ * Unmounts the current disk image of a drive and attempts to mount a new
+ * one: drive 0 for RMOUNT, the drive given for 'm'.
+ * The disk name is the command parameter and ".DSK" extension is automatically
+ * appended. If the uppercase version fails, tries lowercase ".dsk". Names
+ * in the port's directory are looked up in its listing (image_name()),
+ * so only an image that exists is opened.
+ * 
+ * @param p Port the command was received on
+ * @param drv Drive to mount (0 to MAX_DRIVES_PER_PORT - 1)
+ * @return 1 on successful mount, 0 on failure
+ * 
+ * PROCESS:
+ * 1. Close current disk image (if any)
+ * 2. Look the name up, and load that image if the lookup could tell
+ * 3. Otherwise try to load "param.DSK" (relative names from the port's
+ *    directory), and if that fails, "param.dsk"
+ * 4. Update ready flag based on success
+ * 
+ * SIDE EFFECTS:
+ * - Closes current disk image file descriptor
+ * - Updates the drive if successful
+ * - Sets ready flag appropriately
+ */
+int rmount( port_config_t *p, int drv)
+{
+    flex_drive_t *disk = &p->drives[drv];
+    char filename[256];
+
+    if (drv >= p->num_drives)
+        p->num_drives = drv + 1;
+    p->routed |= 1 << drv;              // Served apart from now on (port_drive())
+
+    if (disk->fd_disk >= 0 || disk->backend) {
+        close_dsk( disk);
+        if (verbose)
+            printf( "closing %s\n", disk->diskname);
+    }
+    disk->overlay[0] = 0;               // The image mounted is a plain one
+
+    switch (image_name( p, filename, sizeof(filename))) {
+    case 1:
+        load_dsk( disk, p->dirfd, filename);
+        return disk->ready;
+    case 0:
+        if (verbose)
+            printf( "No image %s.DSK in %s\n", p->arg, p->curdir);
+        return 0;
+    }
+
+    snprintf( filename, sizeof(filename), "%s.DSK", p->arg);	// Rmount don't put the extension
+    if (load_dsk( disk, p->dirfd, filename) < 0) {
+        if (verbose)
+            printf( "trying with lowercase...\n");
+        snprintf( filename, sizeof(filename), "%s.dsk", p->arg);
+        load_dsk( disk, p->dirfd, filename);
+    }
+    return disk->ready;
+}
+
+/**
+ * Free the listing of a port
+ */
+void list_free( port_config_t *p)
+{
+    names_release( p->names);
+    p->names = NULL;
+    p->nlist = p->ilist = 0;
+}
+
+/**
+ * Handle a pacing byte from the client during RDIR/RLIST
+ *
+ * Each ' ' asks for the next entry. Once all entries are sent, or when
+ * the client sends anything else (normally ESC to abort), the listing
+ * ends with an ACK.
+ *
+ * @param p Port the byte was received on
+ * @param reply Byte received from the client
+ */
+void list_next( port_config_t *p, int reply)
+{
+    if (reply == ' ' && p->ilist < p->nlist) {
+        if (verbose)
+            printf( "---> %s\n", p->names->name[p->ilist]);
+        link_puts( p, p->names->name[p->ilist++]);
+        link_putc( p, CR);
+        link_putc( p, LF);
+        return;
+    }
+    if (reply != ' ' && verbose && reply != ESC)
+        printf( "Unexpected command (0x%02X) while reading directory\n", reply);
+    list_free( p);
+    p->state = PS_IDLE;
+    link_putc( p, ACK);
+}
+
+/**
+ * Handle RDIR (Remote Directory) command - list .DSK files
+ * 
+ * Lists all .DSK files in current directory that match the given pattern.
+ * The pattern is the command parameter, used for filename filtering.
+ * 
+ * PROTOCOL SEQUENCE:
+ * 1. Send CR LF (start of listing)
+ * 2. For each matching file:
+ *    - Wait for ' ' (space) from client (ready for next entry)
+ *    - Send filename + CR LF
+ * 3. Client sends final ' ' when done receiving
+ * 4. Send ACK to complete command
+ * 
+ * Steps 2-4 are driven by list_next() as the client bytes arrive.
+ * 
+ * FILTERING:
+ * - Only files ending in ".DSK" (case insensitive)
+ * - Only files starting with the parameter string
+ *
+ * Names come from the listing cache (listing_get()), so the directory is
+ * only read again after it changed. They are kept sorted case folded, so
+ * the matching ones are found with a binary search (names_prefix()) and
+ * sent in alphabetical order.
+ * 
+ * EARLY TERMINATION:
+ * Client can send ESC instead of ' ' to abort listing
+ * 
+ * @param p Port the command was received on
+ */
+int lstdsk( port_config_t *p)
+{
+    names_t *dsk, *dirs;
+
+    if (verbose)
+        printf( "RDIR( %s) command\n", p->arg);
+				
+    link_putc( p, CR);
+    link_putc( p, LF);
+
+    p->state = PS_LIST;
+    if (listing_get( p->curdir, p->dirfd, &dsk, &dirs) < 0)
+        return 0;
+    names_release( dirs);
+    p->names = dsk;
+    p->ilist = names_prefix( dsk, p->arg, &p->nlist);
+    return 0;
+}
+
+/**
+ * Handle RLIST (Remote List) command - list subdirectories
+ * 
+ * Lists all subdirectories in the current directory. This allows
+ * the Flex client to navigate the Unix directory structure.
+ * 
+ * PROTOCOL SEQUENCE:
+ * 1. Read parameter (usually empty for full listing)
+ * 2. Wait for 0x20 (space) from client
+ * 3. Send CR LF (start of listing)
+ * 4. For each directory (excluding . and ..):
+ *    - Wait for 0x20 from client (ready signal)
+ *    - Send directory name + CR LF
+ * 5. Send ACK to complete
+ * 
+ * Steps 4-5 are driven by list_next() as the client bytes arrive.
  * 
- * ERROR CONDITIONS:
- * - Checksum mismatch: data corruption during transmission
- * - Invalid track/sector: address out of range
- * - No disk ready: disk not mounted
- * - Write failure: disk I/O error
+ * FILTERING:
+ * - Only directories (not regular files)
+ * - Excludes "." and ".." entries
+ * - Uses d_type, or fstatat() when it tells nothing, to verify directory
+ *   status (see listing_scan())
  * 
- * @return 1 on successful write, 0 on any error
+ * ERROR HANDLING:
+ * - Skips entries that can't be stat()'ed
+ * - Handles early termination via ESC
  * 
- * DEBUGGING:
- * With verbose mode, displays checksum errors and hex dump of bad data
+ * @param p Port the command was received on
+ * @param reply Pacing byte received after the parameter (step 2)
+ */
+int lstdir( port_config_t *p, int reply)
+{
+    names_t *dsk, *dirs;
+
+    if (verbose)
+        printf( "RLIST command\n");
+				
+    if (reply != 0x20) {
+        if (verbose)
+            printf( "Bad char 0x%02X received...\n", reply);
+    } else {
+        link_putc( p, CR);
+        link_putc( p, LF);
+    }
+
+    p->state = PS_LIST;
+    if (listing_get( p->curdir, p->dirfd, &dsk, &dirs) < 0)
+        return 0;
+    names_release( dsk);
+    p->names = dirs;
+    p->ilist = 0;
+    p->nlist = dirs->n;
+    return 0;
+}
+
+/**
+ * Write as much pending output as the line accepts
+ *
+ * A paced port (see pace_count()) writes one chunk, then waits until
+ * pace_at: the chunk's time on the wire and a gap of a millisecond per
+ * level. The event loop writes the next one.
+ *
+ * @return 0 on success, -1 if the line is gone
+ */
+int port_flush( port_config_t *p)
+{
+    long long now = 0;
+    int n;
+
+    while (p->txlen > 0) {
+        struct iovec iov = { p->txbuf, p->txlen };
+
+        if (p->pace) {
+            if (p->pace_at > (now = now_ms()))
+                return 0;
+            if (iov.iov_len > (size_t)(PACE_CHUNK >> (p->pace - 1)))
+                iov.iov_len = PACE_CHUNK >> (p->pace - 1);
+        }
+        if ((n = link_writev( p, &iov, 1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (p->pace)
+                p->pace_at = now + p->pace;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if (p->pace)
+            p->pace_at = now + p->pace + (p->baud ? n * 10000LL / p->baud : 0);
+        memmove( p->txbuf, p->txbuf + n, p->txlen - n);
+        p->txlen -= n;
+    }
+    return 0;
+}
+
+/**
+ * Handle one complete command from the current port
+ *
+ * Called by port_feed() once the command byte and all its arguments
+ * have been received.
+ */
+void port_command( port_config_t *p)
+{
+    int command = p->cmd;
+    int retval;
+
+    p->state = PS_IDLE;         // Handlers may start a new exchange
+
+    switch (command) {
+    /* Synchronization Commands */
+    case 0x55:  // Sync pattern 1
+    case 0xAA:  // Sync pattern 2 (or RESYNC)
+        link_putc( p, command);    // Echo back for synchronization
+        p->caps = 0;               // Extensions must be asked for again
+        if (verbose)
+            printf( "Initial sync or RESYNC command ($%02x)\n", command);
+        break;
+        
+    /* Sector I/O Commands */
+    case 'S':   // Send sector to client (read from disk)
+    case 's':   // FLEXNET uses lowercase variant
+        sndblk( p, p->hdr[0], p->hdr[1], p->hdr[2]);
+        break;
+    case 'T':   // Send consecutive sectors of a track (read ahead extension)
+        sndtrk( p);
+        break;
+    case 'L':   // Stream a sector chain (load extension)
+        sndchain( p);
+        break;
+    case 'X':   // Agree on protocol extensions
+        negotiate( p);
+        break;
+    case 'N':   // Find a file in the directory (lookup extension)
+        dirlook( p);
+        break;
+    case 'F':   // Copy a FLEX file between two drives (copy extension)
+        if ((retval = flexcopy( p)) == 0) {
+            link_putc( p, ACK);
+        } else {
+            link_putc( p, NAK);
+            link_putc( p, retval);
+        }
+        break;
+    case 'R':   // Receive sector from client (write to disk)
+    case 'r':   // FLEXNET uses lowercase variant
+        link_putc( p, rcvblk( p, p->hdr[0], p->hdr[1], p->hdr[2], p->data)?ACK:NAK);  // ACK on success, NAK on error
+        break;
+    /* Drive Management Commands */
+    case 'V':   // Query/change MS-DOS drive letter (ignored on Unix)
+        link_putc( p, ACK);        // Always acknowledge, parameter ignored
+        if (verbose)
+            printf( "Query (change) drive command\n");
+        break;
+        
+    case '?':   // Query current directory
+        link_puts( p, p->curdir);     // Send current directory path
+        link_putc( p, CR);         // Terminate with CR
+        link_putc( p, ACK);
+        if (verbose)
+            printf( "Query current directory (%s) command\n", p->curdir);
+        break;
+        
+    case 'Q':   // Quick drive ready check
+        link_putc( p, ACK);        // Unix files are always "ready"
+        if (verbose)
+            printf( "Quick check: is drive ready ? (unix: always yes)\n");
+        break;
+        
+    /* Directory Listing Commands */
+    case 'A':   // List .DSK files (RDIR command)
+        lstdsk( p);
+        break;
+        
+    case 'I':   // List subdirectories (RLIST command)
+        lstdir( p, p->hdr[0]);
+        break;
+    /* File Management Commands (Not Implemented) */
+    case 'C':   // Create .DSK file (RCREATE command)
+    case 'D':   // Delete .DSK file (RDELETE command)
+        link_putc( p, NAK);        // Not implemented - return error
+        if (verbose)
+            printf( "%s(%s) command (not implemented, reply NAK)\n",
+                    command=='C'?"RCREATE":"RDELETE", p->arg);
+        break;
+        
+    /* Session Management Commands */
+    case 'E':   // Exit/disconnect (REXIT command)
+        link_putc( p, ACK);        // Acknowledge shutdown
+        if (verbose)
+            printf( "Flexnet exit\n");
+        if (p->transport == LINK_SESSION) {
+            p->ended = 1;       // The emulator decides (flexnet_input())
+            break;
+        }
+        if (config_file[0] == 0) {
+            port_flush( p);
+            if (verbose)
+                report_stats();
+            close_all();
+            exit( 0);           // Terminate server (single-port mode)
+        }
+        break;                  // Other ports keep being served
+        
+    case 'P':   // Change directory (RCD command)
+        link_putc( p, chngd( p)?ACK:NAK);     // ACK on success, NAK on error
+        break;
+        
+    case 'M':   // Mount disk image (RMOUNT command)
+    case 'm':   // Mount disk image on a drive (FMOUNT command)
+        retval = command == 'm' ? p->hdr[0] : 0;
+        if (retval < MAX_DRIVES_PER_PORT && rmount( p, retval)) {
+            link_putc( p, ACK);                        // Success
+            link_putc( p, p->drives[retval].readonly?'R':'W');      // Send read/write status
+        } else {
+            link_putc( p, NAK);                        // Mount failed
+        }
+        break;
+
+    case 'd':   // Image mounted on a drive (FMOUNT without a file name)
+        if (port_drive( p, p->hdr[0])->ready)
+            link_puts( p, port_drive( p, p->hdr[0])->disk_image);
+        link_putc( p, ACK);
+        if (verbose)
+            printf( "Query drive %d image command\n", p->hdr[0]);
+        break;
+        
+    default:    // Unknown command - ignore and continue
+        if (verbose)
+            printf( "Unknown command 0x%02x (%c)\n", command, 
+                   isprint( command) ? command : '?');
+        break;
+    }
+}
+
+/**
+ * Feed one byte received on a port to its protocol parser
+ *
+ * The parser keeps the command being received in the port, so it resumes
+ * where it left off whenever the next bytes arrive. The command handler
+ * only runs once all of its arguments are in:
+ * - S/s: 3-byte [drive] [track] [sector] header
+ * - T: same header, then the sector count
+ * - L: same header, then the window
+ * - X: [version] [caps], and a second [caps] from version 2 on
+ * - N: [drive], then the 11-byte name
+ * - F: [source drive] [destination drive], then one CR-terminated parameter
+ * - R/r: same header, then 256 data bytes and the 2 checksum bytes
+ * - V, P, M, A, D: one CR-terminated parameter (RCREATE 'C' sends five,
+ *   only the last one is kept, as the server ignores them)
+ * - I: one parameter, then the pacing byte
+ * Client answers to a sector (PS_ACK), to a chain frame (PS_CHAIN) or to
+ * a listing entry (PS_LIST) are handled the same way.
+ *
+ * @param p Port the byte was received on
+ * @param c Received byte
+ */
+void port_feed( port_config_t *p, int c)
+{
+    switch (p->state) {
+    case PS_IDLE:
+        p->cmd = c;
+        p->count = 0;
+        switch (c) {
+        case 'S':
+        case 's':
+        case 'R':
+        case 'r':
+        case 'T':
+        case 'L':
+        case 'X':
+        case 'F':
+        case 'N':
+        case 'm':
+        case 'd':
+            p->state = PS_HDR;
+            break;
+        case 'V':
+        case 'P':
+        case 'M':
+        case 'A':
+        case 'D':
+        case 'I':
+            p->nparam = 1;
+            p->state = PS_PARAM;
+            break;
+        case 'C':
+            p->nparam = 5;
+            p->state = PS_PARAM;
+            break;
+        default:        // Single byte commands
+            *p->arg = 0;
+            port_command( p);
+            break;
+        }
+        break;
+
+    case PS_HDR:
+        p->hdr[p->count++] = c;
+        if (p->count < (p->cmd == 'T' || p->cmd == 'L' ? 4 :
+                         p->cmd == 'X' ? (p->hdr[0] >= 2 ? 3 : 2) :
+                         p->cmd == 'F' ? 2 : p->cmd == 'N' || p->cmd == 'm' ||
+                         p->cmd == 'd' ? 1 : 3))
+            break;
+        if (p->cmd == 'R' || p->cmd == 'r' || p->cmd == 'N') {
+            p->count = 0;
+            p->state = PS_DATA;
+        } else if (p->cmd == 'F' || p->cmd == 'm') {
+            p->count = 0;
+            p->nparam = 1;
+            p->state = PS_PARAM;
+        } else {
+            port_command( p);
+        }
+        break;
+
+    case PS_DATA:
+        p->data[p->count++] = c;
+        if (p->count == (p->cmd == 'N' ? 11 : SECSIZE + 2))
+            port_command( p);
+        break;
+
+    case PS_PARAM:
+        if (c != CR) {
+            if (p->count < (int)sizeof(p->arg) - 1)    // Silently truncate
+                p->arg[p->count++] = c;
+            break;
+        }
+        p->arg[p->count] = 0;
+        p->count = 0;
+        if (--p->nparam > 0)
+            break;
+        if (p->cmd == 'I')
+            p->state = PS_PACE;
+        else
+            port_command( p);
+        break;
+
+    case PS_PACE:
+        p->hdr[0] = c;
+        port_command( p);
+        break;
+
+    case PS_ACK:
+        sndack( p, c);
+        break;
+
+    case PS_CHAIN:
+        chain_ack( p, c);
+        break;
+
+    case PS_LIST:
+        list_next( p, c);
+        break;
+    }
+}
+
+/**
+ * Parse the bytes waiting in a port's input ring
+ *
+ * Sector payloads of R commands are copied in bulk rather than fed byte
+ * by byte. Parsing pauses while the output queue has no room for a full
+ * answer, so a client that stops reading its line gets backpressure
+ * instead of lost output. It also waits for the sectors of a 'T' command
+ * to be queued, which are sent first.
+ */
+void port_parse( port_config_t *p)
+{
+    for (;;) {
+        unsigned pos = p->rxhead % RXBUFSIZE;
+
+        port_pump( p);
+        if (p->rxhead == p->rxtail || p->state == PS_BULK ||
+            TXBUFSIZE - p->txlen < TXROOM)
+            break;
+
+        if (p->state == PS_DATA) {
+            unsigned n = p->rxtail - p->rxhead;
+            int len = p->cmd == 'N' ? 11 : FRAMESIZE;
+
+            if (n > RXBUFSIZE - pos)                // Contiguous part of the ring
+                n = RXBUFSIZE - pos;
+            if (n > (unsigned)(len - p->count))
+                n = len - p->count;
+            memcpy( p->data + p->count, p->rxbuf + pos, n);
+            p->count += n;
+            p->rxhead += n;
+            if (p->count == len)
+                port_command( p);
+        } else {
+            p->rxhead++;
+            port_feed( p, p->rxbuf[pos]);
+        }
+    }
+}
+
+/**
+ * Restart the timers of a port after its input was parsed
+ *
+ * @param got Bytes were received
+ */
+void port_received( port_config_t *p, int got)
+{
+    // Restart the command timer while a command is incomplete; listings
+    // are paced by the user (RDIR waits for a key at each screen)
+    if (p->state == PS_IDLE || p->state == PS_LIST)
+        p->deadline = 0;
+    else if (got)
+        p->deadline = now_ms() + p->timeout;
+
+    // The line is not quiet yet
+    if (got && p->flush_at && p->durability == DUR_IDLE)
+        p->flush_at = now_ms() + p->wb_delay;
+}
+
+#ifndef FLEXNET_LIBRARY     // Served by the event loop
+/**
+ * Read what is available on a port into its input ring and parse it
+ *
+ * @return 0 on success, -1 if the line is gone
+ */
+int port_input( port_config_t *p)
+{
+    int n;
+
+    // A shared memory ring rings once for all it holds: take it all
+    do {
+        unsigned used = p->rxtail - p->rxhead;
+        unsigned pos = p->rxtail % RXBUFSIZE;
+        struct iovec iov[2];
+
+        if (used == RXBUFSIZE)      // Ring full, wait for the output to drain
+            return 0;
+        iov[0].iov_base = p->rxbuf + pos;
+        iov[0].iov_len = RXBUFSIZE - (used > pos ? used : pos);
+        iov[1].iov_base = p->rxbuf;
+        iov[1].iov_len = RXBUFSIZE - used - iov[0].iov_len;
+
+        n = link_readv( p, iov, 2);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+            return -1;
+        if (n > 0)
+            p->rxtail += n;
+
+        port_parse( p);
+    } while (n > 0 && p->transport == LINK_SHM);
+
+    port_received( p, n > 0);
+    return 0;
+}
+
+/**
+ * Handle epoll events on a port
+ *
+ * @return 0 on success, -1 if the line is gone
+ */
+int port_service( port_config_t *p, int events)
+{
+    if (p->transport == LINK_SHM) {
+        uint64_t rung;
+
+        if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))    // Client socket closed
+            return -1;
+        if (read( p->bell, &rung, sizeof(rung)) < 0 && errno != EAGAIN)
+            return -1;
+    }
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && port_input( p) < 0)
+        return -1;
+    if (port_flush( p) < 0)
+        return -1;
+    // Input held back by a full output queue, or 'T'/'L' sectors to send
+    if (p->rxhead != p->rxtail || p->state == PS_BULK || p->state == PS_CHAIN) {
+        port_parse( p);
+        if (port_flush( p) < 0)
+            return -1;
+    }
+    return 0;
+}
+#endif
+
+/**
+ * Abort the command in progress on a port after the client went silent
+ */
+void port_timeout( port_config_t *p)
+{
+    log_message( LOG_WARNING, "%s: command '%c' timed out (state %d, %d bytes received)",
+                 p->device, isprint( p->cmd) ? p->cmd : '?', p->state, p->count);
+    p->state = PS_IDLE;
+    p->deadline = 0;
+}
+
+/**
+ * Write back the drives of a port (durability interval and on-idle); a
+ * drive failing to is tried again after the write back delay
+ */
+void port_writeback( port_config_t *p)
+{
+    int failed = 0;
+
+    for (int d = 0; d < p->num_drives; d++)
+        if (p->drives[d].fd_disk >= 0 && wb_flush( &p->drives[d]) < 0)
+            failed = 1;
+    p->flush_at = failed ? now_ms() + p->wb_delay : 0;     // Try again later
+}
+
+/**
+ * Set up the port table slot of a libflexnet session
+ *
+ * Sessions live in ports[] with the daemon's ports, so sectors written
+ * through one are seen by the others (dsk_write()) and close_all()
+ * writes them all back.
+ */
+flexnet_session_t *flexnet_open( const char *dir)
+{
+    port_config_t *p = NULL;
+    char cwd[256];
+    int dirfd;
+
+    // The directory first: a slot is only taken for a session that opens
+    if (dir == NULL && (dir = getcwd( cwd, sizeof(cwd))) == NULL)
+        return NULL;
+    if ((dirfd = open( dir, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return NULL;
+
+    for (int i = 0; i < num_ports && p == NULL; i++)
+        if (ports[i].transport == LINK_SESSION && ports[i].device[0] == 0)
+            p = &ports[i];              // Slot of a closed session
+    if (p == NULL) {
+        if (num_ports == MAX_PORTS) {
+            close( dirfd);
+            errno = ENOSPC;
+            return NULL;
+        }
+        if (num_ports == 0)             // First session
+            cache_init( cache_kb);
+        p = &ports[num_ports++];
+    }
+
+    memset( p, 0, sizeof(*p));
+    snprintf( p->device, sizeof(p->device), "session %d", (int)(p - ports));
+    p->transport = LINK_SESSION;
+    p->link = p->listen_fd = -1;
+    p->timeout = CMD_TIMEOUT;
+    p->durability = DUR_NONE;
+    p->wb_delay = WB_DELAY;
+    snprintf( p->curdir, sizeof(p->curdir), "%s", dir);
+    p->dirfd = dirfd;
+    for (int d = 0; d < MAX_DRIVES_PER_PORT; d++) {
+        p->drives[d].fd_disk = -1;
+        p->drives[d].io = IO_MMAP;
+        p->drives[d].durability = DUR_NONE;
+        p->drives[d].prefetch = PREFETCH_DEPTH;
+        p->drives[d].unit = d;
+    }
+    return p;
+}
+
+/**
+ * Close the drive of a session a new disk goes in, and route it
+ *
+ * @return The drive, NULL if there is no such drive
+ */
+static flex_drive_t *session_drive( flexnet_session_t *p, int drive)
+{
+    if (drive < 0 || drive >= MAX_DRIVES_PER_PORT)
+        return NULL;
+    close_dsk( &p->drives[drive]);
+    p->drives[drive].overlay[0] = 0;
+    if (drive >= p->num_drives)
+        p->num_drives = drive + 1;
+    p->routed |= 1 << drive;
+    return &p->drives[drive];
+}
+
+int flexnet_mount( flexnet_session_t *p, int drive, const char *image)
+{
+    flex_drive_t *drv = session_drive( p, drive);
+    char name[256];
+
+    snprintf( name, sizeof(name), "%s", image);
+    return drv ? load_dsk( drv, p->dirfd, name) : -1;
+}
+
+int flexnet_attach( flexnet_session_t *p, int drive, const char *name,
+                    const flexnet_disk_t *disk, void *ctx)
+{
+    static ino_t attached;              // Drives attached so far
+    flex_drive_t *drv = session_drive( p, drive);
+    long nblk;
+    uint8_t geo[3];
+
+    if (drv == NULL)
+        return -1;
+    snprintf( drv->disk_image, sizeof(drv->disk_image), "%s", name);
+    drv->diskname = drv->disk_image;
+    drv->dev = DEV_BACKEND;             // Matches no image file, nor another
+    drv->ino = ++attached;              // attached drive (dsk_write())
+    drv->map = NULL;
+    if ((nblk = disk->sectors( ctx, drive)) < 3 || nblk > 256 * 256 ||
+        disk->read( ctx, drive, 2, drv->bloc) < 0 ||
+        sir_geometry( drv->bloc, nblk, drv->diskname, geo) < 0)
+        return -1;
+    drv->nbtrk = geo[0];
+    drv->nbsec = geo[1];
+    drv->track0l = geo[2];
+    drv->backend = disk;
+    drv->backend_ctx = ctx;
+    drv->readonly = disk->write == NULL;
+    drv->ready = 1;
+    return 0;
+}
+
+int flexnet_input( flexnet_session_t *p, const uint8_t *buf, size_t len)
+{
+    size_t n = 0;
+
+    if (p->ended)
+        return -1;
+    while (n < len && p->rxtail - p->rxhead < RXBUFSIZE) {
+        unsigned pos = p->rxtail % RXBUFSIZE;
+        size_t room = RXBUFSIZE - (p->rxtail - p->rxhead);
+
+        if (room > RXBUFSIZE - pos)             // Contiguous part of the ring
+            room = RXBUFSIZE - pos;
+        if (room > len - n)
+            room = len - n;
+        memcpy( p->rxbuf + pos, buf + n, room);
+        p->rxtail += room;
+        n += room;
+        port_parse( p);
+    }
+    port_received( p, n > 0);
+    return p->ended && n == 0 ? -1 : (int)n;
+}
+
+size_t flexnet_output( flexnet_session_t *p, uint8_t *buf, size_t len)
+{
+    size_t n = len < (size_t)p->txlen ? len : (size_t)p->txlen;
+
+    memcpy( buf, p->txbuf, n);
+    memmove( p->txbuf, p->txbuf + n, p->txlen - n);
+    p->txlen -= n;
+    // Input held back by a full output queue, or 'T'/'L' sectors to send
+    if (p->rxhead != p->rxtail || p->state == PS_BULK || p->state == PS_CHAIN)
+        port_parse( p);
+    return n;
+}
+
+void flexnet_tick( flexnet_session_t *p)
+{
+    long long now = now_ms();
+
+    if (p->flush_at && p->flush_at <= now)
+        port_writeback( p);
+    if (p->deadline && p->deadline <= now)
+        port_timeout( p);
+}
+
+void flexnet_close( flexnet_session_t *p)
+{
+    for (int d = 0; d < MAX_DRIVES_PER_PORT; d++)
+        close_dsk( &p->drives[d]);
+    list_free( p);
+    close( p->dirfd);
+    p->device[0] = 0;                   // Free for flexnet_open()
+    p->num_drives = 0;
+}
+
+#ifndef FLEXNET_LIBRARY     // The daemon: lines, sockets and rings, served by one event loop
+
+/**
+ * Open the listening socket of a port served over TCP or a Unix socket
+ *
+ * "tcp://host:port" listens on that address, "tcp://:port" (or a "*"
+ * host) on all of them, "tcp://[::1]:port" on an IPv6 one;
+ * "unix:/path" (and "shm:/path") on that socket, replacing one left by
+ * a previous run.
+ *
+ * @return 0 on success, -1 on error
+ */
+int port_listen( port_config_t *p)
+{
+    struct addrinfo hints = { .ai_flags = AI_PASSIVE, .ai_socktype = SOCK_STREAM }, *ai = NULL;
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    struct sockaddr *addr = (struct sockaddr *)&sun;
+    socklen_t len = sizeof(sun);
+    char host[sizeof(p->device)], *service;
+    int one = 1, err;
+
+    if (p->transport != LINK_TCP) {
+        const char *path = strchr( p->device, ':') + 1;
+        struct stat st;
+
+        if (strlen( path) >= sizeof(sun.sun_path)) {
+            log_message( LOG_ERR, "%s: socket path too long", p->device);
+            return -1;
+        }
+        strcpy( sun.sun_path, path);
+        if (lstat( sun.sun_path, &st) == 0 && S_ISSOCK( st.st_mode))
+            unlink( sun.sun_path);
+    } else {
+        snprintf( host, sizeof(host), "%s", p->device + 6);
+        if ((service = strrchr( host, ':')) == NULL) {
+            log_message( LOG_ERR, "%s: no port number", p->device);
+            return -1;
+        }
+        *service++ = 0;
+        if (host[0] == '[' && service[-2] == ']') {
+            service[-2] = 0;
+            memmove( host, host + 1, strlen( host));
+        }
+        if ((err = getaddrinfo( host[0] && strcmp( host, "*") ? host : NULL, service,
+                                &hints, &ai)) != 0) {
+            log_message( LOG_ERR, "%s: %s", p->device, gai_strerror( err));
+            return -1;
+        }
+        addr = ai->ai_addr;
+        len = ai->ai_addrlen;
+    }
+
+    if ((p->listen_fd = socket( addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt( p->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind( p->listen_fd, addr, len) < 0 || listen( p->listen_fd, 4) < 0) {
+        log_message( LOG_ERR, "%s: %s", p->device, strerror( errno));
+        if (p->listen_fd >= 0)
+            close( p->listen_fd);
+        p->listen_fd = -1;
+        if (ai)
+            freeaddrinfo( ai);
+        return -1;
+    }
+    if (ai)
+        freeaddrinfo( ai);
+    if (verbose)
+        printf( "Listening on %s\n", p->device);
+    return 0;
+}
+
+/**
+ * Hand a client the shared memory rings of a LINK_SHM port
+ *
+ * The rings and the two doorbells are created for each connection, and
+ * sent over it (SCM_RIGHTS) for flexring_attach() to map.
+ *
+ * @param fd Client connection
+ * @return 0 on success, -1 on error
+ */
+int ring_open( port_config_t *p, int fd)
+{
+    char byte = 0, ctl[CMSG_SPACE( 3 * sizeof(int))] = { 0 };
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR( &msg);
+    int fds[3] = { -1, -1, -1 };
+
+    if ((fds[0] = memfd_create( "flexnet", MFD_CLOEXEC)) < 0 ||
+        ftruncate( fds[0], sizeof(struct flexring_shm)) < 0 ||
+        (p->shm = mmap( NULL, sizeof(struct flexring_shm), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fds[0], 0)) == MAP_FAILED ||
+        (fds[1] = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        (fds[2] = eventfd( 0, EFD_CLOEXEC)) < 0) {
+        log_message( LOG_ERR, "%s: cannot create rings: %s", p->device, strerror( errno));
+        goto fail;
+    }
+    memcpy( p->shm->magic, FLEXRING_MAGIC, 8);
+    p->shm->size = FLEXRING_SIZE;
+    p->shm->to_server.reader_waits = 1;     // Asleep until the first byte
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof(fds));
+    memcpy( CMSG_DATA( cmsg), fds, sizeof(fds));
+    if (sendmsg( fd, &msg, MSG_NOSIGNAL) != 1) {
+        log_message( LOG_ERR, "%s: cannot hand the rings over: %s", p->device, strerror( errno));
+        goto fail;
+    }
+    close( fds[0]);
+    p->bell = fds[1];
+    p->peer_bell = fds[2];
+    return 0;
+
+fail:
+    for (int i = 0; i < 3; i++)
+        if (fds[i] >= 0)
+            close( fds[i]);
+    if (p->shm != MAP_FAILED && p->shm != NULL)
+        munmap( p->shm, sizeof(struct flexring_shm));
+    p->shm = NULL;
+    return -1;
+}
+
+/**
+ * Drop the rings of a LINK_SHM port after its client left
  */
-int rcvblk()
+void ring_close( int epfd, port_config_t *p)
 {
-    int msb, lsb, chks;		// For checksum computing and transmitting
-    int retval;
-    int pos;
-    uint8_t nsec, ntrk;
-    int i;
-
-    fgetc( serial); // Read and discard drive parameter
-    ntrk = fgetc( serial);
-    nsec = fgetc( serial);
-    pos = SECSIZE * ts2blk( ntrk, nsec);
+    epoll_ctl( epfd, EPOLL_CTL_DEL, p->bell, NULL);    // The client may hold it still
+    close( p->bell);
+    close( p->peer_bell);
+    munmap( p->shm, sizeof(struct flexring_shm));
+    p->shm = NULL;
+}
 
-    for (i = 0; i <256; i++)
-        bloc[i] = fgetc( serial);
-    msb = fgetc( serial);
-    lsb = fgetc( serial);
-    retval = 1;
+/**
+ * Take the client connecting to a port served over a socket
+ *
+ * A port serves one client at a time, like a serial line: others are
+ * turned away until it disconnects. Each client starts a new session,
+ * with no extension granted and no command in progress.
+ *
+ * @param epfd Event loop the connection joins
+ * @param p Port listening
+ */
+void port_accept( int epfd, port_config_t *p)
+{
+    struct epoll_event ev;
+    int fd, one = 1;
 
-    if ((chks = checksum( bloc)) == msb * 256 + lsb) {
-        if (pos < 0)
-            retval = 0;
-        else {
-            if (ready == 0)
-                return (retval = 0);
-            if (lseek( fd, pos, SEEK_SET) != pos)
-                retval = 0;
-            if (write( fd, bloc, SECSIZE) != SECSIZE)
-                retval = 0;
+    while ((fd = accept4( p->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (p->link >= 0) {
+            log_message( LOG_WARNING, "%s: busy, connection refused", p->device);
+            close( fd);
+            continue;
         }
-    } else {
-        retval = 0;
-        if (verbose) {
-            printf( "Bad checksum (0x%04X instead of 0x%04X)\n", msb * 256 + lsb, chks);
-            for (i = 0; i< 256; i++)
-                printf ("%c0x%02x", i%16?' ':'\n', bloc[i]);
+        if (p->transport == LINK_TCP)       // Frames are written whole already
+            setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (p->transport == LINK_SHM && ring_open( p, fd) < 0) {
+            close( fd);
+            continue;
         }
-    }
-    if (verbose) {
-        if (retval) {
-            printf( "Bloc [0x%02X/0x%02X] (pos = %d) written\n", ntrk, nsec, pos);
-        } else {
-            printf( "Fail to write bloc [0x%02X/0x%02X] (pos = %d)\n", ntrk, nsec, pos);
+        list_free( p);
+        p->state = PS_IDLE;
+        p->rxhead = p->rxtail = 0;
+        p->txlen = 0;
+        p->caps = 0;
+        p->deadline = 0;
+        p->pace = p->pace_frames = p->pace_naks = 0;
+        p->link = fd;
+        ev.events = p->events = EPOLLIN;
+        ev.data.ptr = p;
+        if (p->transport == LINK_SHM) {
+            epoll_ctl( epfd, EPOLL_CTL_ADD, p->bell, &ev);
+            ev.events = EPOLLRDHUP;         // Nothing comes on the socket but its end
         }
+        epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ev);
+        if (verbose)
+            printf( "%s: client connected\n", p->device);
     }
-    return retval;
 }
 
 /**
- * Handle RCD (Remote Change Directory) command
- * 
- * Changes the server's current working directory. The new directory
- * path is read from the global param[] buffer (set by getparam()).
- * 
- * @return 1 on success (ACK will be sent), 0 on failure (NAK will be sent)
- * 
- * SIDE EFFECTS:
- * - Updates global curdir[] with new current directory
- * - Changes process working directory with chdir()
- * 
- * DEBUGGING:
- * With verbose mode, shows directory change attempts and results
+ * Set the speed of a serial line, any rate the driver can make
+ *
+ * cfsetspeed() only knows the Bxxx rates; others (230400 on some libcs,
+ * 250000, crystal derived rates...) are asked with termios2 and BOTHER.
+ * The driver answers with the rate its divisor gives, which is logged
+ * when it is not the one asked, as a warning past the 2% a UART
+ * tolerates. Without termios2, only the Bxxx rates can be set.
+ *
+ * @return Rate the line runs at, -1 if it cannot be set
  */
-int chngd()
+int line_speed( port_config_t *p)
 {
-    int retval = 0;
-    if (chdir( param) < 0) {
-        retval = 0;
-        if (verbose)
-            printf( "Cannot change directory to %s\n", param);
-    } else {
-        getcwd( curdir, 255);
-        retval = 1;
-        if (verbose)
-            printf( "Changing directory to %s\n", curdir);
+#ifdef HAVE_TERMIOS2
+    struct termios2 tio;
+
+    if (ioctl( p->link, TCGETS2, &tio) < 0)
+        return -1;
+    if (tio.c_ospeed != (speed_t)p->speed) {
+        tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+        tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+        tio.c_ispeed = tio.c_ospeed = p->speed;
+        if (ioctl( p->link, TCSETS2, &tio) < 0 || ioctl( p->link, TCGETS2, &tio) < 0)
+            return -1;
     }
-    return retval;
+    if (tio.c_ospeed != (speed_t)p->speed)
+        log_message( abs( (int)tio.c_ospeed - p->speed) * 50 > p->speed ? LOG_WARNING : LOG_NOTICE,
+                     "%s: %d bauds asked, the line runs at %u",
+                     p->device, p->speed, tio.c_ospeed);
+    return tio.c_ospeed;
+#else
+    struct termios tio;
+
+    // Set by port_open() if cfsetspeed() knows the rate
+    if (tcgetattr( p->link, &tio) < 0 || cfsetspeed( &tio, p->speed) < 0)
+        return -1;
+    return p->speed;
+#endif
 }
 
 /**
- * Handle RMOUNT (Remote Mount) command
- * 
- * Unmounts the current disk image and attempts to mount a new one.
- * The disk name is read from param[] and ".DSK" extension is automatically
- * appended. If the uppercase version fails, tries lowercase ".dsk".
- * 
- * @return 1 on successful mount, 0 on failure
- * 
- * PROCESS:
- * 1. Close current disk image (if any)
- * 2. Try to load "param.DSK"
- * 3. If that fails, try "param.dsk"
- * 4. Update ready flag based on success
- * 
- * SIDE EFFECTS:
- * - Closes current disk image file descriptor
- * - Updates global disk variables if successful
- * - Sets ready flag appropriately
+ * Open and configure the serial line of a port (raw, non-blocking)
+ *
+ * Ports on a socket start listening instead (port_listen()), their link
+ * is opened by port_accept().
+ *
+ * @return 0 on success, -1 on error
  */
-int rmount()
+int port_open( port_config_t *p)
 {
-    char filename[256];
+    struct termios linespec;
 
-    close( fd);
-    if (verbose)
-        printf( "closing %s\n", diskname);
+    if ((p->transport = port_transport( p->device)) != LINK_SERIAL) {
+        p->link = -1;
+        return port_listen( p);
+    }
+    if ((p->link = open( p->device, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0) {
+        log_message( LOG_ERR, "%s: %s", p->device, strerror( errno));
+        return -1;
+    }
 
-    ready = 1;
-    strncpy( filename, param, 255);
-    strncat( filename, ".DSK", 255);	// Rmount don't put the extension
-    if (load_dsk( filename) < 0) {
-        if (verbose)
-            printf( "trying with lowercase...\n");
-        strncpy( filename, param, 255);
-        strncat( filename, ".dsk", 255);
-        if (load_dsk( filename) < 0)
-            ready = 0;
+    if (tcgetattr (p->link, &linespec) < 0) {
+        log_message( LOG_ERR, "%s: ERROR getting current terminal's attributes", p->device);
+        close( p->link);
+        p->link = -1;
+        return -1;
+    }
+    cfmakeraw( &linespec);
+    cfsetspeed( &linespec, p->speed);   // Fails past the Bxxx table, see line_speed()
+    if (p->flow == FLOW_RTSCTS)
+        linespec.c_cflag |= CRTSCTS;
+    else                                // cfmakeraw() leaves it as it was
+        linespec.c_cflag &= ~CRTSCTS;
+    // IXON stays off (cfmakeraw()): the $11/$13 bytes of the client's
+    // frames would be eaten by the driver, and a $13 would stop our output
+		
+    if (tcsetattr (p->link, TCSANOW, &linespec) < 0 || (p->baud = line_speed( p)) < 0) {
+        log_message( LOG_ERR, "%s: ERROR setting current terminal's attributes", p->device);
+        close( p->link);
+        p->link = -1;
+        return -1;
     }
-    return ready;
+
+    if (verbose)
+        printf( "Link on %s, speed is %d bauds, flow control %s\n", p->device, p->baud,
+                p->flow == FLOW_RTSCTS ? "rtscts" : "none");
+    return 0;
 }
 
 /**
- * Handle RDIR (Remote Directory) command - list .DSK files
- * 
- * Lists all .DSK files in current directory that match the given pattern.
- * The pattern is read via getparam() and used for filename filtering.
- * 
- * PROTOCOL SEQUENCE:
- * 1. Send CR LF (start of listing)
- * 2. For each matching file:
- *    - Wait for ' ' (space) from client (ready for next entry)
- *    - Send filename + CR LF
- * 3. Client sends final ' ' when done receiving
- * 4. Send ACK to complete command
- * 
- * FILTERING:
- * - Only files ending in ".DSK" (case insensitive)
- * - Only files starting with the parameter string
- * 
- * EARLY TERMINATION:
- * Client can send ESC instead of ' ' to abort listing
+ * Watch a port's line for what it waits for
+ *
+ * Writability only while output is pending and not held back by pacing
+ * (serve_ports() writes it when due), input only while the input ring
+ * has room. A LINK_SHM port is woken by its doorbell for both.
  */
-int lstdsk()
+void port_watch( int epfd, port_config_t *p)
 {
-    struct dirent *entry;
-    DIR *dirp;
-    int reply;
-    int endlist;
-
-    getparam();
-	
-    if (verbose)
-        printf( "RDIR( %s) command\n", param);
-				
-    fputc( CR, serial);
-    fputc( LF, serial);
+    struct epoll_event ev;
 
-    dirp = opendir( curdir);
-    endlist = 1;
-    while ((entry = readdir( dirp)) != NULL) {
-        if (strcasecmp( (entry->d_name)+strlen(entry->d_name)-3, "DSK") != 0) 
-            continue;
-        if (strcasestr( entry->d_name, param) != entry->d_name)
-            continue;
-        if ((reply = fgetc( serial)) != ' ') {
-            if (verbose && reply != ESC)
-                printf( "Unexpected command (0x%02X) while reading directory\n", reply);
-            endlist = 0;
-            break;
-        }
-        if (verbose)
-            printf( "---> %s\n", entry->d_name);
-        fputs( entry->d_name, serial);
-        fputc( CR, serial);
-        fputc( LF, serial);
+    if (p->transport == LINK_SHM)
+        return;
+    ev.events = (p->rxtail - p->rxhead < RXBUFSIZE ? EPOLLIN : 0) |
+                (p->txlen && p->pace == 0 ? EPOLLOUT : 0);
+    ev.data.ptr = p;
+    if (ev.events != (uint32_t)p->events) {
+        epoll_ctl( epfd, EPOLL_CTL_MOD, p->link, &ev);
+        p->events = ev.events;
     }
-    if (endlist)
-        if ((reply = fgetc( serial)) != ' ')
-            if (verbose)
-                printf( "Unexpected command (0x%02X) while reading directory\n", reply);
-
-    closedir( dirp);
-    fputc( ACK, serial);
-    return 0;
 }
 
 /**
- * Handle RLIST (Remote List) command - list subdirectories
- * 
- * Lists all subdirectories in the current directory. This allows
- * the Flex client to navigate the Unix directory structure.
- * 
- * PROTOCOL SEQUENCE:
- * 1. Read parameter (usually empty for full listing)
- * 2. Wait for 0x20 (space) from client
- * 3. Send CR LF (start of listing)
- * 4. For each directory (excluding . and ..):
- *    - Wait for 0x20 from client (ready signal)
- *    - Send directory name + CR LF
- * 5. Send ACK to complete
- * 
- * FILTERING:
- * - Only directories (not regular files)
- * - Excludes "." and ".." entries
- * - Uses stat() to verify directory status
- * 
- * ERROR HANDLING:
- * - Skips entries that can't be stat()'ed
- * - Handles early termination via ESC
+ * Event loop serving every configured port
+ *
+ * All serial lines are watched with epoll, as are the sockets of ports
+ * served over TCP or a Unix socket, and their clients. Each port keeps
+ * its own input buffer and protocol state, so a stalled client only
+ * holds up its own line. Returns when no port is left open; a socket
+ * port stays open when its client leaves.
+ *
+ * @return 0 when all lines are closed, 1 on error
  */
-int lstdir()
+int serve_ports( void)
 {
-    struct dirent *entry;
-    struct stat statbuf;
-    DIR *dirp;
-    int reply;
-    int endlist;
+    struct epoll_event ev, events[2 * MAX_PORTS + 1];
+    sigset_t stop, waitmask;
+    int epfd, n, active = 0;
 
-    if (verbose)
-        printf( "RLIST command\n");
-				
-    getparam();
-    if ((reply = fgetc( serial)) != 0x20)
-        printf( "Bad char 0x%02X received...\n", reply);
-    else {
-        fputc( CR, serial);
-        fputc( LF, serial);
+    if ((epfd = epoll_create1( 0)) < 0) {
+        perror( "epoll_create1");
+        return 1;
     }
 
-    endlist = 1;
-    dirp = opendir( curdir);
-    while ((entry = readdir( dirp)) != NULL) {
-        if (strcmp(entry->d_name, ".") * strcmp(entry->d_name, "..") == 0)
-            continue;
-        if (stat( entry->d_name, &statbuf) == -1) {
-            if (verbose)
-                perror( entry->d_name);
+    // Directory changes, for the listing cache (no event data: not a port)
+    if ((listings.fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        log_message( LOG_WARNING, "inotify: %s, directory listings not cached",
+                     strerror( errno));
+    } else {
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl( epfd, EPOLL_CTL_ADD, listings.fd, &ev);
+    }
+
+    // Event data: the port for its line, its listen_fd for its listening socket
+    for (int i = 0; i < num_ports; i++) {
+        if (port_open( &ports[i]) < 0)
             continue;
+        ev.events = ports[i].events = EPOLLIN;
+        if (ports[i].transport == LINK_SERIAL) {
+            ev.data.ptr = &ports[i];
+            epoll_ctl( epfd, EPOLL_CTL_ADD, ports[i].link, &ev);
+        } else {
+            ev.data.ptr = &ports[i].listen_fd;
+            epoll_ctl( epfd, EPOLL_CTL_ADD, ports[i].listen_fd, &ev);
         }
-        if (S_ISDIR( statbuf.st_mode) == 0) 
-            continue;
-        if ((reply = fgetc( serial)) != 0x20) {
-            if (verbose && reply != ESC)
-                printf( "Unexpected command (0x%02X) while reading directory\n", reply);
-            endlist = 0;
-            break;
+        active++;
+    }
+    if (active == 0) {
+        fprintf( stderr, "No serial line could be opened\n");
+        return 1;
+    }
+
+    // SIGTERM and SIGINT are only taken while waiting, so a stop request
+    // never lands between the check below and epoll_pwait()
+    sigemptyset( &stop);
+    sigaddset( &stop, SIGTERM);
+    sigaddset( &stop, SIGINT);
+    sigprocmask( SIG_BLOCK, &stop, &waitmask);
+
+    while (active > 0 && !stop_requested) {
+        long long now = now_ms(), next = 0;
+        int wait = -1;
+
+        if (stats_requested) {
+            stats_requested = 0;
+            report_stats();
+        }
+
+        // Expire stalled commands, write back held sectors, write the
+        // next chunk of paced output, and sleep until the next deadline
+        for (int i = 0; i < num_ports; i++) {
+            if (ports[i].link < 0)
+                continue;
+            if (ports[i].pace && ports[i].txlen && ports[i].pace_at <= now) {
+                port_service( &ports[i], 0);    // A line gone is left to epoll
+                port_watch( epfd, &ports[i]);
+            }
+            if (ports[i].pace && ports[i].txlen && (next == 0 || ports[i].pace_at < next))
+                next = ports[i].pace_at;
+            if (ports[i].flush_at && ports[i].flush_at <= now)
+                port_writeback( &ports[i]);
+            else if (ports[i].flush_at && (next == 0 || ports[i].flush_at < next))
+                next = ports[i].flush_at;
+            if (ports[i].deadline == 0)
+                continue;
+            if (ports[i].deadline <= now)
+                port_timeout( &ports[i]);
+            else if (next == 0 || ports[i].deadline < next)
+                next = ports[i].deadline;
+        }
+        if (next)
+            wait = next > now ? next - now : 0;
+
+        if ((n = epoll_pwait( epfd, events, 2 * MAX_PORTS + 1, wait, &waitmask)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror( "epoll_wait");
+            return 1;
+        }
+
+        for (int k = 0; k < n; k++) {
+            port_config_t *p = events[k].data.ptr;
+
+            if (p == NULL) {
+                listing_events();
+                continue;
+            }
+            for (int i = 0; i < num_ports && p; i++) {
+                if (events[k].data.ptr == &ports[i].listen_fd) {
+                    port_accept( epfd, &ports[i]);
+                    p = NULL;
+                }
+            }
+            if (p == NULL)
+                continue;
+            if (port_service( p, events[k].events) < 0) {
+                if (p->transport != LINK_SERIAL) {
+                    if (verbose)
+                        printf( "%s: client disconnected\n", p->device);
+                } else if (config_file[0] == 0) {
+                    fprintf( stderr, "Serial line disappeared - Panic exit\n");
+                    close_all();
+                    exit( 1);
+                } else {
+                    log_message( LOG_ERR, "Serial line %s disappeared", p->device);
+                    active--;
+                }
+                port_writeback( p);
+                if (p->transport == LINK_SHM)
+                    ring_close( epfd, p);
+                epoll_ctl( epfd, EPOLL_CTL_DEL, p->link, NULL);
+                close( p->link);
+                p->link = -1;
+                list_free( p);
+                continue;
+            }
+
+            port_watch( epfd, p);
         }
-        if (verbose)
-            printf( "---> %s\n", entry->d_name);
-        fputs( entry->d_name, serial);
-        fputc( CR, serial);
-        fputc( LF, serial);
     }
-    if (endlist)
-        if ((reply = fgetc( serial)) != ' ')
-            if (verbose)
-                printf( "Unexpected command (0x%02X) while reading directory\n", reply);
-    closedir( dirp);
-    fputc( ACK, serial);
+    if (stop_requested && daemon_mode)
+        log_message( LOG_INFO, "Received signal %d, shutting down", stop_requested);
+    for (int i = 0; i < num_ports; i++)
+        if (ports[i].link >= 0)
+            close( ports[i].link);
+    close( epfd);
     return 0;
 }
 
@@ -1015,20 +4709,30 @@ int lstdir()
  * Main program - NetPC server for Flex systems
  * 
  * COMMAND LINE OPTIONS:
- * -d <device>  : Serial device path (required)
- * -s <speed>   : Baud rate (required)
+ * -c <config>  : YAML configuration file (multi-port mode)
+ * -d <device>  : Serial device path, tcp://host:port, unix:/path or shm:/path
+ *                (single port mode)
+ * -s <speed>   : Baud rate (single port mode)
+ * -t <timeout> : Command timeout in seconds (single port mode)
+ * -i <io>      : Disk image access (mmap or pread)
+ * -w <durability> : When sector writes reach the disk (none, async, sync,
+ *                interval or on-idle)
+ * -p <n>       : Sectors read ahead along FLEX file chains
+ * -f <flow>    : Serial line flow control (none or rtscts)
+ * -a           : Adaptive pacing of the output
  * -v           : Verbose debug output
+ * -D           : Run as daemon
  * -h           : Show help and exit
  * 
  * PROGRAM FLOW:
  * 1. Parse command line arguments
- * 2. Open and configure serial port
- * 3. Load initial disk image
- * 4. Enter main command processing loop
+ * 2. Build the port table (from the YAML file, or a single port from -d/-s)
+ * 3. Load the disk images of every port
+ * 4. Serve all ports from one event loop (serve_ports)
  * 
- * COMMAND PROCESSING LOOP:
- * The server runs in an infinite loop, reading commands from the serial
- * port and dispatching them to appropriate handler functions:
+ * COMMAND PROCESSING:
+ * Each complete command received on a port is dispatched by port_command()
+ * to the appropriate handler function:
  * 
  * - 0x55/0xAA: Synchronization (echo back)
  * - S/s: Send sector (sndblk)
@@ -1040,9 +4744,11 @@ int lstdir()
  * - I: List directories (lstdir)
  * - C: Create disk (not implemented, NAK)
  * - D: Delete disk (not implemented, NAK)
- * - E: Exit server
+ * - E: Exit server (single port mode only)
  * - P: Change directory (chngd -> ACK/NAK)
  * - M: Mount disk (rmount -> ACK+mode or NAK)
+ * - m: Mount disk on a drive (rmount -> ACK+mode or NAK)
+ * - d: Query the image of a drive
  * 
  * @param argc Command line argument count
  * @param argv Command line argument array
@@ -1052,12 +4758,10 @@ int main(int argc, char **argv)
 {
     int opt;
     char *name;
-    int command;
-    struct termios linespec;
-    int idlnk;
+    char cwd[256];
 
     // Read parameters
-    while ((opt = getopt( argc, argv, "d:s:c:vDVh")) != -1) {
+    while ((opt = getopt( argc, argv, "d:s:t:i:w:p:c:f:azvDVh")) != -1) {
         switch (opt) {
         case 'h':
             usage( *argv);
@@ -1077,17 +4781,65 @@ int main(int argc, char **argv)
             strncpy(config_file, optarg, sizeof(config_file) - 1);
             break;
         case 'd':
-            strncpy( line, optarg, 31) ;
+            strncpy( line, optarg, sizeof(line) - 1) ;
             break;
         case 's':
             sscanf( optarg, "%d", &speed);
             break;
+        case 't':
+            timeout = atof( optarg) * 1000;
+            break;
+        case 'i':
+            if ((io_backend = option_index( io_names, optarg)) < 0) {
+                fprintf( stderr, "Unknown I/O backend: %s\n", optarg);
+                exit( 1);
+            }
+            break;
+        case 'p':
+            prefetch_depth = atoi( optarg);
+            if (prefetch_depth < 0 || prefetch_depth > PREFETCH_MAX) {
+                fprintf( stderr, "Prefetch must be 0 to %d\n", PREFETCH_MAX);
+                exit( 1);
+            }
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'f':
+            if ((flow = option_index( flow_names, optarg)) < 0) {
+                fprintf( stderr, "Unknown flow control: %s\n", optarg);
+                exit( 1);
+            }
+            if (flow == FLOW_XONXOFF) {
+                fprintf( stderr, "Flow xonxoff cannot be used: the link is 8-bit binary\n");
+                exit( 1);
+            }
+            break;
+        case 'a':
+            pacing = 1;
+            break;
+        case 'w':
+            if ((durability = option_index( durability_names, optarg)) < 0) {
+                fprintf( stderr, "Unknown durability: %s\n", optarg);
+                exit( 1);
+            }
+            break;
         default: /* unknown commands */
             usage( *argv);
             exit( 1);
         }
     }
 
+    // Relative paths are resolved from where we were started
+    getcwd( cwd, sizeof(cwd));
+
+    // kill -USR1 logs the drive statistics, SIGTERM stops the event loop,
+    // which writes back first
+    signal( SIGUSR1, stats_handler);
+    signal( SIGTERM, signal_handler);
+    signal( SIGINT, signal_handler);
+    signal( SIGPIPE, SIG_IGN);          // A client closing its socket is not fatal
+
     // Initialize daemon mode if requested
     if (daemon_mode) {
         daemonize();
@@ -1099,175 +4851,92 @@ int main(int argc, char **argv)
             fprintf(stderr, "Failed to load configuration file\n");
             exit(1);
         }
-        printf("Multi-port mode not fully implemented yet - config loaded successfully\n");
-        printf("Use single-port mode with -d and -s options for now\n");
-        exit(0);
-    }
-
-    // Some sanitary checking on options (single-port mode)
-    if (strlen( line) == 0) {
-        fprintf( stderr, "No serial line ?\n");
-        usage( *argv);
-        exit( 1);
-    }
-
-    if (speed == 0) {
-        fprintf( stderr, "No baudrate ?\n");
-        usage( *argv);
-        exit( 1);
-    }
-
-    if((serial = fopen( line, "r+")) == NULL )
-        perror( line);
-
-    if ((idlnk = fileno( serial)) < 0)
-        perror( line);
-
-    if (tcgetattr (idlnk, &linespec) < 0) {
-        perror ("ERROR getting current terminal's attributes");
-        exit( 1);
-    }
-    cfmakeraw( &linespec);
-    cfsetspeed( &linespec, speed);
-		
-    if (tcsetattr (idlnk, TCSANOW, &linespec) < 0) {
-        perror ("ERROR setting current terminal's attributes");
-        exit( 1);
-    }
+    } else {
+        // Some sanitary checking on options (single-port mode)
+        if (strlen( line) == 0) {
+            fprintf( stderr, "No serial line ?\n");
+            usage( *argv);
+            exit( 1);
+        }
 
-    if (verbose)
-        printf( "Link on %s, speed is %d bauds\n", line, speed);
+        if (speed == 0 && port_transport( line) == LINK_SERIAL) {
+            fprintf( stderr, "No baudrate ?\n");
+            usage( *argv);
+            exit( 1);
+        }
 
-    if (optind < argc) {
-        name = argv[ optind++];
         if (optind < argc) {
-            fprintf( stderr, "Only one filename is allowed\n");
+            name = argv[ optind++];
+            if (optind < argc) {
+                fprintf( stderr, "Only one filename is allowed\n");
+                usage( *argv);
+                exit (1);
+            }
+        } else {
+            fprintf( stderr, "No file name ???\n");
             usage( *argv);
-            exit (1);
+            exit( 1);
         }
-    } else {
-        fprintf( stderr, "No file name ???\n");
-        usage( *argv);
-        exit( 1);
+
+        // Single port with one drive
+        num_ports = 1;
+        strcpy( ports[0].device, line);
+        ports[0].speed = speed;
+        ports[0].timeout = timeout;
+        ports[0].durability = durability;
+        ports[0].wb_delay = WB_DELAY;
+        ports[0].compress = compress;
+        ports[0].flow = flow;
+        ports[0].pacing = pacing;
+        ports[0].link = -1;
+        ports[0].num_drives = 1;
+        for (int d = 0; d < MAX_DRIVES_PER_PORT; d++) {
+            ports[0].drives[d].fd_disk = -1;
+            ports[0].drives[d].io = io_backend;
+            ports[0].drives[d].durability = durability;
+            ports[0].drives[d].prefetch = prefetch_depth;
+        }
+        strncpy( ports[0].drives[0].disk_image, name, sizeof(ports[0].drives[0].disk_image) - 1);
     }
 
-    // Load the file
+    cache_init( cache_kb);
 
+    // Load the disk images
+    for (int i = 0; i < num_ports; i++) {
+        port_config_t *p = &ports[i];
 
-    getcwd( curdir, 255);
+        strcpy( p->curdir, cwd);
+        if ((p->dirfd = open( cwd, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            perror( cwd);
+            exit( 1);
+        }
+        for (int d = 0; d < p->num_drives; d++) {
+            flex_drive_t *drv = &p->drives[d];
 
-    if (load_dsk( name) < 0)
-        exit( 1);
+            if (drv->disk_image[0] == 0)
+                continue;
+            p->routed |= 1 << d;
+            if (load_dsk( drv, p->dirfd, drv->disk_image) < 0) {
+                if (config_file[0] == 0)
+                    exit( 1);
+                log_message( LOG_WARNING, "%s: cannot load drive %d image %s",
+                             p->device, d, drv->disk_image);
+            }
+        }
+    }
 
-    if (readonly) {
+    if (config_file[0] == 0 && ports[0].drives[0].readonly) {
         fprintf( stderr, "Flexnet can't start with a read-only file\n");
         exit( 1);
     }
 
-    /* Main Command Processing Loop */
-    /* 
-     * The server continuously reads commands from the Flex client and
-     * responds according to the NetPC protocol specification.
-     */
-    while (1) {
-        command = fgetc( serial);   // Read next command byte
-        *param = 0;                 // Clear parameter buffer
-        
-        switch (command) {
-        /* Synchronization Commands */
-        case 0x55:  // Sync pattern 1
-        case 0xAA:  // Sync pattern 2 (or RESYNC)
-            fputc( command, serial);    // Echo back for synchronization
-            if (verbose)
-                printf( "Initial sync or RESYNC command ($%02x)\n", command);
-            break;
-            
-        /* Sector I/O Commands */
-        case 'S':   // Send sector to client (read from disk)
-        case 's':   // FLEXNET uses lowercase variant
-            sndblk();
-            break;
-        case 'R':   // Receive sector from client (write to disk)
-        case 'r':   // FLEXNET uses lowercase variant
-            fputc(rcvblk()?ACK:NAK, serial);    // Send ACK on success, NAK on error
-            break;
-        /* Drive Management Commands */
-        case 'V':   // Query/change MS-DOS drive letter (ignored on Unix)
-            getparam();             // Read parameter but ignore it
-            fputc( ACK, serial);    // Always acknowledge
-            if (verbose)
-                printf( "Query (change) drive command\n");
-            break;
-            
-        case '?':   // Query current directory
-            fputs( curdir, serial); // Send current directory path
-            fputc( CR, serial);     // Terminate with CR
-            fputc( ACK, serial);
-            if (verbose)
-                printf( "Query current directory (%s) command\n", curdir);
-            break;
-            
-        case 'Q':   // Quick drive ready check
-            fputc( ACK, serial);    // Unix files are always "ready"
-            if (verbose)
-                printf( "Quick check: is drive ready ? (unix: always yes)\n");
-            break;
-            
-        /* Directory Listing Commands */
-        case 'A':   // List .DSK files (RDIR command)
-            lstdsk();
-            break;
-            
-        case 'I':   // List subdirectories (RLIST command)
-            lstdir();
-            break;
-        /* File Management Commands (Not Implemented) */
-        case 'C':   // Create .DSK file (RCREATE command)
-            getparam(); // Read disk name
-            getparam(); // Read track count
-            getparam(); // Read sector count
-            getparam(); // Read additional parameters
-            // Fall through to 'D' case
-        case 'D':   // Delete .DSK file (RDELETE command)
-            getparam(); // Read filename parameter
-            fputc( NAK, serial);    // Not implemented - return error
-            if (verbose)
-                printf( "%s(%s) command (not implemented, reply NAK)\n",
-                        command=='C'?"RCREATE":"RDELETE", param);
-            break;
-            
-        /* Session Management Commands */
-        case 'E':   // Exit/disconnect (REXIT command)
-            fputc (ACK, serial);    // Acknowledge shutdown
-            if (verbose)
-                printf( "Flexnet exit\n");
-            exit( 0);   // Terminate server
-            
-        case 'P':   // Change directory (RCD command)
-            getparam(); // Read new directory path
-            fputc (chngd()?ACK:NAK, serial);    // ACK on success, NAK on error
-            break;
-            
-        case 'M':   // Mount disk image (RMOUNT command)
-            getparam(); // Read disk image filename
-            if (rmount()) {
-                fputc( ACK, serial);                        // Success
-                fputc( readonly?'R':'W', serial);          // Send read/write status
-            } else {
-                fputc( NAK, serial);                        // Mount failed
-            }
-            break;
-            
-        /* Error Conditions */
-        case -1:    // EOF on serial port (connection lost)
-            fprintf( stderr, "Serial line disappeared - Panic exit\n");
-            exit( 1);
-            
-        default:    // Unknown command - ignore and continue
-            if (verbose)
-                printf( "Unknown command 0x%02x (%c)\n", command, 
-                       isprint( command) ? command : '?');
-            break;
-        }
+    int status = serve_ports();
+    close_all();
+    if (daemon_mode) {
+        remove_pid_file();
+        closelog();
     }
+    return status;
 }
+
+#endif
@@ -0,0 +1,257 @@
+/* flexring.h -- shared memory link to a FlexNet server, for emulators
+ *
+ * A port whose device is "shm:/path" listens on the Unix socket /path. An
+ * emulator connecting there is handed, in one message (SCM_RIGHTS), a
+ * memory file holding two rings of bytes and two eventfd doorbells:
+ *
+ *   to_client   server -> emulator (what the emulated ACIA receives)
+ *   to_server   emulator -> server (what it transmits)
+ *
+ * Each ring has one writer and one reader, which move their own index and
+ * never take a lock. The bytes are those of the serial protocol, sync
+ * included; frames are put in the ring by the server straight from the
+ * disk image. A side only rings the other's doorbell (one eventfd write)
+ * when the other has asked for it, because it found its ring empty
+ * (flexring_wait()) or full: an emulator polling to_client from its ACIA
+ * status register reads the server's replies without a system call, and
+ * only wakes the server when the server has gone to sleep.
+ *
+ * The emulated CPU transmits a command a byte at a time. Ringing on the
+ * first byte would wake the server for that byte alone, so the emulator
+ * puts bytes without a doorbell (bell -1) and rings once it starts
+ * waiting for the reply (flexring_kick() on a status read that finds
+ * to_client empty), or from a periodic timer for programs that only
+ * transmit.
+ *
+ * The emulator keeps the socket open while attached; closing it (or
+ * exiting) is the disconnection. Everything here is static inline, for C
+ * and C++ with GCC or Clang (atomic builtins).
+ *
+ *   struct flexring_link l;
+ *
+ *   if (flexring_attach( "/run/flexnet/emu.sock", &l) < 0)
+ *       ...
+ *   // ACIA status: receive register full?
+ *   rdrf = flexring_avail( &l.shm->to_client) != 0;
+ *   if (!rdrf)
+ *       flexring_kick( &l.shm->to_server, l.bell_server);
+ *   // ACIA data register read / write
+ *   flexring_get( &l.shm->to_client, &c, 1, l.bell_server);
+ *   flexring_put( &l.shm->to_server, &c, 1, -1);
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ */
+
+#ifndef FLEXRING_H
+#define FLEXRING_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#define FLEXRING_MAGIC  "FLXRING1"
+#define FLEXRING_SIZE   65536           // Bytes per ring, a power of two
+
+/* One direction: the reader owns head, the writer tail (free running) */
+struct flexring {
+    uint32_t head;                      // Next byte to read
+    uint32_t reader_waits;              // Reader wants the doorbell on new bytes
+    uint8_t pad1[56];
+    uint32_t tail;                      // Next byte to write
+    uint32_t writer_waits;              // Writer wants the doorbell on free room
+    uint8_t pad2[56];
+    uint8_t data[FLEXRING_SIZE];
+};
+
+/* The shared memory file */
+struct flexring_shm {
+    char magic[8];                      // FLEXRING_MAGIC
+    uint32_t size;                      // FLEXRING_SIZE
+    uint8_t pad[52];
+    struct flexring to_client;
+    struct flexring to_server;
+};
+
+/* An emulator's end of the link */
+struct flexring_link {
+    struct flexring_shm *shm;
+    int sock;                           // Connection, closed to detach
+    int bell_server;                    // Rung to wake the server
+    int bell_client;                    // Rung by the server, when asked
+};
+
+static inline void flexring_ring( int bell)
+{
+    uint64_t one = 1;
+
+    if (write( bell, &one, sizeof(one)) < 0) {
+        /* Counter full: the peer has a wakeup pending anyway */
+    }
+}
+
+/**
+ * Bytes waiting in a ring, for its reader
+ */
+static inline uint32_t flexring_avail( struct flexring *r)
+{
+    return __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE) - r->head;
+}
+
+/**
+ * Copy bytes into a ring, as many as fit
+ *
+ * The reader's doorbell is rung if it asked for it, unless bell is -1
+ * (see flexring_kick()). When not all fit, the writer asks for its own
+ * doorbell: it is rung once the reader has made room.
+ *
+ * @param bell Reader's doorbell, -1 to ring it later
+ * @return Bytes copied
+ */
+static inline size_t flexring_put( struct flexring *r, const void *buf, size_t len, int bell)
+{
+    const uint8_t *src = (const uint8_t *)buf;
+    size_t done = 0;
+
+    for (;;) {
+        uint32_t tail = r->tail;
+        uint32_t room = FLEXRING_SIZE - (tail - __atomic_load_n( &r->head, __ATOMIC_ACQUIRE));
+        uint32_t pos = tail % FLEXRING_SIZE, n = len - done < room ? len - done : room;
+        uint32_t first = n < FLEXRING_SIZE - pos ? n : FLEXRING_SIZE - pos;
+
+        memcpy( r->data + pos, src + done, first);
+        memcpy( r->data, src + done + first, n - first);
+        __atomic_store_n( &r->tail, tail + n, __ATOMIC_RELEASE);
+        done += n;
+
+        // Seen by the reader after its own flag store, or it sees the bytes
+        __atomic_thread_fence( __ATOMIC_SEQ_CST);
+        if (n && bell >= 0 && __atomic_exchange_n( &r->reader_waits, 0, __ATOMIC_ACQ_REL))
+            flexring_ring( bell);
+        if (done == len)
+            return done;
+
+        __atomic_store_n( &r->writer_waits, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence( __ATOMIC_SEQ_CST);
+        if (__atomic_load_n( &r->head, __ATOMIC_ACQUIRE) == tail + n - FLEXRING_SIZE)
+            return done;                // Still full, the doorbell will tell
+    }
+}
+
+/**
+ * Ring the reader's doorbell for bytes put without it, if it is waiting
+ */
+static inline void flexring_kick( struct flexring *r, int bell)
+{
+    __atomic_thread_fence( __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n( &r->reader_waits, 0, __ATOMIC_ACQ_REL))
+        flexring_ring( bell);
+}
+
+/**
+ * Copy bytes out of a ring, as many as are waiting
+ *
+ * The writer's doorbell is rung if it was waiting for room.
+ *
+ * @param bell Writer's doorbell
+ * @return Bytes copied
+ */
+static inline size_t flexring_get( struct flexring *r, void *buf, size_t len, int bell)
+{
+    uint8_t *dst = (uint8_t *)buf;
+    uint32_t head = r->head, avail = flexring_avail( r);
+    uint32_t pos = head % FLEXRING_SIZE, n = len < avail ? len : avail;
+    uint32_t first = n < FLEXRING_SIZE - pos ? n : FLEXRING_SIZE - pos;
+
+    if (n == 0)
+        return 0;
+    memcpy( dst, r->data + pos, first);
+    memcpy( dst + first, r->data, n - first);
+    __atomic_store_n( &r->head, head + n, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence( __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n( &r->writer_waits, 0, __ATOMIC_ACQ_REL))
+        flexring_ring( bell);
+    return n;
+}
+
+/**
+ * Ask for the reader's doorbell before sleeping on it
+ *
+ * @return 0 if the ring is still empty (sleep), or bytes now waiting
+ */
+static inline uint32_t flexring_wait( struct flexring *r)
+{
+    __atomic_store_n( &r->reader_waits, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence( __ATOMIC_SEQ_CST);
+    return flexring_avail( r);
+}
+
+/**
+ * Attach to a server port listening on a Unix socket ("shm:" device)
+ *
+ * @return 0 on success, -1 on error (errno set)
+ */
+static inline int flexring_attach( const char *path, struct flexring_link *l)
+{
+    struct sockaddr_un sun;
+    char byte, ctl[CMSG_SPACE( 3 * sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[3];
+    void *shm;
+
+    memset( &sun, 0, sizeof(sun));
+    memset( &msg, 0, sizeof(msg));
+    sun.sun_family = AF_UNIX;
+    strncpy( sun.sun_path, path, sizeof(sun.sun_path) - 1);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+
+    if ((l->sock = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (connect( l->sock, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+        recvmsg( l->sock, &msg, MSG_CMSG_CLOEXEC) != 1 ||
+        (cmsg = CMSG_FIRSTHDR( &msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN( sizeof(fds))) {
+        close( l->sock);
+        return -1;                      // A busy port closes the connection
+    }
+    memcpy( fds, CMSG_DATA( cmsg), sizeof(fds));
+    shm = mmap( NULL, sizeof(struct flexring_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close( fds[0]);
+    if (shm == MAP_FAILED || memcmp( shm, FLEXRING_MAGIC, 8) != 0) {
+        if (shm != MAP_FAILED)
+            munmap( shm, sizeof(struct flexring_shm));
+        close( fds[1]);
+        close( fds[2]);
+        close( l->sock);
+        return -1;
+    }
+    l->shm = (struct flexring_shm *)shm;
+    l->bell_server = fds[1];
+    l->bell_client = fds[2];
+    return 0;
+}
+
+/**
+ * Detach from the server
+ */
+static inline void flexring_detach( struct flexring_link *l)
+{
+    munmap( l->shm, sizeof(struct flexring_shm));
+    close( l->bell_server);
+    close( l->bell_client);
+    close( l->sock);
+}
+
+#endif
@@ -0,0 +1,115 @@
+/* libflexnet.h -- the FlexNet protocol engine, for emulators
+ *
+ * A session is one NetPC client: the bytes its ACIA sends are given to
+ * flexnet_input(), and the bytes to send back are taken with
+ * flexnet_output(), with no line and no system call in between. The
+ * engine is the server's own (flexnet_final.c built with
+ * -DFLEXNET_LIBRARY, as libflexnet.a / libflexnet.so): sector frames,
+ * checksums, RMOUNT and the directory listings, T/L streams and the other
+ * extensions behave as they do on a serial port.
+ *
+ * A drive holds either a disk image file, mounted by name as the server
+ * does (flexnet_mount(), RMOUNT, FMOUNT), or sectors the emulator serves
+ * itself through a flexnet_disk_t (flexnet_attach()): its geometry is
+ * read from the SIR (sector 2) like an image file's.
+ *
+ *   flexnet_session_t *s = flexnet_open( "/home/flex/disks");
+ *
+ *   flexnet_mount( s, 0, "FLEX9.DSK");
+ *   // ACIA transmit register written
+ *   flexnet_input( s, &c, 1);
+ *   // ACIA status register read
+ *   rdrf = flexnet_output( s, &c, 1) == 1;
+ *
+ * Sessions are served by the calling thread only; use one thread for all
+ * of them. Call flexnet_tick() now and then (every 100 ms or so): it
+ * writes back sectors held by the durability policy and ends a command
+ * the client left half sent.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ */
+
+#ifndef LIBFLEXNET_H
+#define LIBFLEXNET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FLEXNET_API __attribute__((visibility("default")))
+
+typedef struct flexnet_session flexnet_session_t;
+
+/* Sectors of a drive served by the emulator; blk counts 256-byte sectors
+ * from 0 (track 0 sector 1), in image file order */
+typedef struct {
+    long (*sectors)( void *ctx, int drive);                             // Size, 0 if no disk
+    int (*read)( void *ctx, int drive, long blk, uint8_t *buf);         // 0, -1 on error
+    int (*write)( void *ctx, int drive, long blk, const uint8_t *data); // NULL: read-only
+} flexnet_disk_t;
+
+/**
+ * Open a session
+ *
+ * @param dir Directory RMOUNT, RDIR and RCD start from, NULL for the
+ *            current directory
+ * @return The session, NULL on error (errno set)
+ */
+FLEXNET_API flexnet_session_t *flexnet_open( const char *dir);
+
+/**
+ * Mount a disk image file on a drive (0-3), relative to the session's
+ * directory
+ *
+ * @return 0 on success, -1 on error
+ */
+FLEXNET_API int flexnet_mount( flexnet_session_t *s, int drive, const char *image);
+
+/**
+ * Serve a drive (0-3) from the emulator's own sectors
+ *
+ * @param name What the client is told is mounted there (FMOUNT)
+ * @param ctx Handed back to the backend's functions
+ * @return 0 on success, -1 if the disk has no FLEX geometry
+ */
+FLEXNET_API int flexnet_attach( flexnet_session_t *s, int drive, const char *name,
+                                const flexnet_disk_t *disk, void *ctx);
+
+/**
+ * Give the session bytes sent by the client
+ *
+ * Fewer are taken when the output waiting is not read: take it, then
+ * give the rest again.
+ *
+ * @return Bytes taken, -1 once the client has ended the session (REXIT)
+ */
+FLEXNET_API int flexnet_input( flexnet_session_t *s, const uint8_t *buf, size_t len);
+
+/**
+ * Take bytes to send to the client
+ *
+ * @return Bytes copied to buf, 0 if none are waiting
+ */
+FLEXNET_API size_t flexnet_output( flexnet_session_t *s, uint8_t *buf, size_t len);
+
+/**
+ * Run the session's timers (write-back, command time-out)
+ */
+FLEXNET_API void flexnet_tick( flexnet_session_t *s);
+
+/**
+ * Close a session, writing back its drives
+ */
+FLEXNET_API void flexnet_close( flexnet_session_t *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
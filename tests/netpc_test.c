@@ -0,0 +1,1697 @@
+/* netpc_test.c -- protocol regression tests, played from the client side
+ *
+ * Builds small FLEX disk images in a scratch directory, runs the server
+ * against them and plays a NetPC client: the same exchanges FNETDRV and
+ * the utilities make, byte for byte, each answer checked against the
+ * images. A server is started per test, on a pseudo terminal unless the
+ * test is about another transport; the libflexnet test runs the engine
+ * in process instead, linked from libflexnet.a.
+ *
+ * Usage: netpc_test [-v] <server binary>
+ *
+ * Each test prints its name and "ok", or what it got wrong. The exit
+ * status is 1 if any failed. -v keeps the scratch directory and the
+ * server output.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include "../flexring.h"
+#include "../libflexnet.h"
+
+#define ACK 0x06
+#define NAK 0x15
+#define LF 0x0A
+#define CR 0x0D
+#define SECSIZE 256
+#define FRAMESIZE (SECSIZE + 2)
+#define DIR_ENTSIZE 24
+#define TIMEOUT 2000                    // ms an answer may take
+
+// Capability bits of the 'X' request (see PROTOCOL.md)
+#define CAP_BULK   0x01
+#define CAP_NOQ    0x02
+#define CAP_RLE    0x04
+#define CAP_CHAIN  0x08
+#define CAP_COPY   0x10
+#define CAP_LOOKUP 0x01                 // Second byte
+
+#define CHECK(cond, ...) do {                                   \
+        if (!(cond)) {                                          \
+            snprintf( why, sizeof(why), __VA_ARGS__);           \
+            return -1;                                          \
+        }                                                       \
+    } while (0)
+
+/* A FLEX disk image, as built here and as the server should show it */
+typedef struct {
+    char name[16];                      // File in the scratch directory
+    int ntrk, nsec;                     // Tracks, sectors per track (track 0 too)
+    uint8_t *data;
+} image_t;
+
+/* Client side of the link to the server under test */
+typedef struct {
+    int fd;                             // pty master or socket, -1 if none
+    int shm;                            // Rings instead (ring)
+    struct flexring_link ring;
+    flexnet_session_t *session;         // Or a libflexnet session, in process
+    uint8_t out[4096];                  // Its output taken while giving it input
+    int nout;
+} link_t;
+
+static char server[PATH_MAX];           // Binary under test
+static char scratch[] = "/tmp/netpc_test.XXXXXX";
+static char why[256];                   // What the failing test got wrong
+static int verbose = 0;
+static pid_t srv = -1;                  // Server of the current test
+static link_t lnk = { .fd = -1 };
+static link_t peer = { .fd = -1 };      // Second port of a two port test
+static image_t sys_img, data_img;       // SYS.DSK, DATA.DSK
+
+static uint8_t *sector( image_t *img, int trk, int sec)
+{
+    return img->data + ((long)trk * img->nsec + sec - 1) * SECSIZE;
+}
+
+static int checksum( const uint8_t *data, int len)
+{
+    int chks = 0;
+
+    for (int i = 0; i < len; i++)
+        chks += data[i];
+    return chks & 0xFFFF;
+}
+
+/**
+ * Build an empty FLEX disk: SIR, directory on track 0 from sector 5, and
+ * every other track on the free chain
+ *
+ * Free sectors hold a pattern followed by zeros over a part that depends
+ * on the sector, so compressed frames have something to shrink.
+ */
+static void new_image( image_t *img, const char *name, int ntrk, int nsec)
+{
+    uint8_t *sir;
+    int free = (ntrk - 1) * nsec;
+
+    snprintf( img->name, sizeof(img->name), "%s", name);
+    img->ntrk = ntrk;
+    img->nsec = nsec;
+    img->data = calloc( (long)ntrk * nsec, SECSIZE);
+
+    sir = sector( img, 0, 3);
+    memcpy( sir + 0x10, name, strcspn( name, ".") < 8 ? strcspn( name, ".") : 8);
+    sir[0x1C] = 1;                      // Volume number
+    sir[0x1D] = 1;                      // First free sector
+    sir[0x1E] = 1;
+    sir[0x1F] = ntrk - 1;               // Last free sector
+    sir[0x20] = nsec;
+    sir[0x21] = free >> 8;
+    sir[0x22] = free & 0xFF;
+    sir[0x26] = ntrk - 1;               // Highest track and sector
+    sir[0x27] = nsec;
+
+    for (int s = 5; s < nsec; s++)
+        sector( img, 0, s)[1] = s + 1;
+    for (int t = 1; t < ntrk; t++) {
+        for (int s = 1; s <= nsec; s++) {
+            uint8_t *sec = sector( img, t, s);
+
+            sec[0] = s < nsec ? t : t + 1 < ntrk ? t + 1 : 0;
+            sec[1] = s < nsec ? s + 1 : t + 1 < ntrk ? 1 : 0;
+            for (int i = 4; i < 4 + (s % 4) * 84; i++)
+                sec[i] = t * 7 + s * 3 + i;
+        }
+    }
+}
+
+/**
+ * Add a sequential file of count sectors, taken from the head of the free
+ * chain, in the first free directory entry
+ *
+ * @return Entry in the image, NULL if the directory is full
+ */
+static uint8_t *add_file( image_t *img, const char *name, const char *ext, int count)
+{
+    uint8_t *sir = sector( img, 0, 3), *entry = NULL;
+    int t = sir[0x1D], s = sir[0x1E], free = sir[0x21] << 8 | sir[0x22];
+
+    for (int ds = 5; ds <= img->nsec && entry == NULL; ds++)
+        for (int k = 0; k < 10 && entry == NULL; k++)
+            if (sector( img, 0, ds)[16 + k * DIR_ENTSIZE] == 0)
+                entry = sector( img, 0, ds) + 16 + k * DIR_ENTSIZE;
+    if (entry == NULL)
+        return NULL;
+
+    memset( entry, 0, DIR_ENTSIZE);
+    memcpy( entry, name, strlen( name));
+    memcpy( entry + 8, ext, strlen( ext));
+    entry[13] = t;
+    entry[14] = s;
+    entry[17] = count >> 8;
+    entry[18] = count & 0xFF;
+    for (int n = 1; n <= count; n++) {
+        uint8_t *sec = sector( img, t, s);
+
+        sec[2] = n >> 8;                // Record number
+        sec[3] = n & 0xFF;
+        entry[15] = t;
+        entry[16] = s;
+        t = sec[0];
+        s = sec[1];
+        if (n == count)
+            sec[0] = sec[1] = 0;
+    }
+    sir[0x1D] = t;
+    sir[0x1E] = s;
+    free -= count;
+    sir[0x21] = free >> 8;
+    sir[0x22] = free & 0xFF;
+    return entry;
+}
+
+static int write_image( image_t *img)
+{
+    int fd = open( img->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    long size = (long)img->ntrk * img->nsec * SECSIZE;
+
+    if (fd < 0 || write( fd, img->data, size) != size) {
+        perror( img->name);
+        return -1;
+    }
+    close( fd);
+    return 0;
+}
+
+/**
+ * Read back an image file the server wrote to
+ */
+static int read_image( const char *name, image_t *img)
+{
+    int fd = open( name, O_RDONLY);
+    long size = (long)img->ntrk * img->nsec * SECSIZE;
+    int n = fd < 0 ? -1 : read( fd, img->data, size);
+
+    if (fd >= 0)
+        close( fd);
+    return n == size ? 0 : -1;
+}
+
+/**
+ * Start the server on the given arguments, in the scratch directory; its
+ * output goes to server.log there, or to the terminal with -v
+ */
+static void start( char *const args[])
+{
+    char *argv[16] = { server };
+
+    for (int i = 0; args[i] && i < 14; i++)
+        argv[i + 1] = args[i];
+    if ((srv = fork()) == 0) {
+        if (!verbose) {
+            int log = open( "server.log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+            dup2( log, STDOUT_FILENO);
+            dup2( log, STDERR_FILENO);
+        }
+        execv( server, argv);
+        perror( server);
+        _exit( 127);
+    }
+}
+
+/**
+ * Stop the server of the test, if still running, and drop the link
+ */
+static void stop( void)
+{
+    int status;
+
+    if (lnk.session)
+        flexnet_close( lnk.session);
+    else if (lnk.shm)
+        flexring_detach( &lnk.ring);
+    else if (lnk.fd >= 0)
+        close( lnk.fd);
+    lnk.fd = -1;
+    lnk.shm = 0;
+    lnk.session = NULL;
+    lnk.nout = 0;
+    if (peer.fd >= 0)
+        close( peer.fd);
+    peer.fd = -1;
+    if (srv > 0) {
+        kill( srv, SIGTERM);
+        waitpid( srv, &status, 0);
+    }
+    srv = -1;
+}
+
+/**
+ * Open a pseudo terminal for the server to use as its serial line
+ *
+ * @param device Out: the slave name, for -d
+ */
+static int open_pty( char *device, size_t size)
+{
+    struct termios tio;
+
+    if ((lnk.fd = posix_openpt( O_RDWR | O_NOCTTY)) < 0 ||
+        grantpt( lnk.fd) < 0 || unlockpt( lnk.fd) < 0)
+        return -1;
+    snprintf( device, size, "%s", ptsname( lnk.fd));
+    tcgetattr( lnk.fd, &tio);
+    cfmakeraw( &tio);
+    tcsetattr( lnk.fd, TCSANOW, &tio);
+    return 0;
+}
+
+/**
+ * Connect to a server port listening on a socket, once it is up
+ *
+ * @param device tcp://host:port, unix:/path or shm:/path
+ */
+static int connect_to( const char *device)
+{
+    for (int tries = 0; tries < 100; tries++) {
+        if (strncmp( device, "shm:", 4) == 0) {
+            if (flexring_attach( device + 4, &lnk.ring) == 0) {
+                lnk.shm = 1;
+                return 0;
+            }
+        } else if (strncmp( device, "unix:", 5) == 0) {
+            struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+            snprintf( sun.sun_path, sizeof(sun.sun_path), "%s", device + 5);
+            lnk.fd = socket( AF_UNIX, SOCK_STREAM, 0);
+            if (connect( lnk.fd, (struct sockaddr *)&sun, sizeof(sun)) == 0)
+                return 0;
+            close( lnk.fd);
+        } else {
+            struct sockaddr_in sin = { .sin_family = AF_INET };
+            int one = 1;
+
+            sin.sin_port = htons( atoi( strrchr( device, ':') + 1));
+            sin.sin_addr.s_addr = htonl( INADDR_LOOPBACK);
+            lnk.fd = socket( AF_INET, SOCK_STREAM, 0);
+            setsockopt( lnk.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (connect( lnk.fd, (struct sockaddr *)&sin, sizeof(sin)) == 0)
+                return 0;
+            close( lnk.fd);
+        }
+        lnk.fd = -1;
+        usleep( 20000);
+    }
+    return -1;
+}
+
+static void put( const void *buf, int len)
+{
+    const uint8_t *p = buf;
+
+    // A session holds input back while its output is not taken
+    while (lnk.session && len > 0) {
+        int n = flexnet_input( lnk.session, p, len);
+
+        if (n < 0)
+            return;
+        p += n;
+        len -= n;
+        lnk.nout += flexnet_output( lnk.session, lnk.out + lnk.nout, sizeof(lnk.out) - lnk.nout);
+    }
+    if (lnk.session)
+        return;
+    if (!lnk.shm) {
+        if (write( lnk.fd, buf, len) != len)
+            perror( "write");
+        return;
+    }
+    for (int i = 0; i < len; i++)
+        while (flexring_put( &lnk.ring.shm->to_server, p + i, 1, -1) == 0)
+            flexring_kick( &lnk.ring.shm->to_server, lnk.ring.bell_server);
+}
+
+static void put1( int c)
+{
+    uint8_t byte = c;
+
+    put( &byte, 1);
+}
+
+/**
+ * Read exactly len bytes from the server
+ *
+ * @return 0 on success, -1 on time-out or end of the link
+ */
+static int get( void *buf, int len)
+{
+    struct pollfd pfd = { lnk.shm ? lnk.ring.bell_client : lnk.fd, POLLIN, 0 };
+    uint8_t *p = buf;
+    int n;
+
+    if (lnk.session) {                  // Answered as soon as asked, or never
+        lnk.nout += flexnet_output( lnk.session, lnk.out + lnk.nout, sizeof(lnk.out) - lnk.nout);
+        if (lnk.nout < len)
+            return -1;
+        memcpy( p, lnk.out, len);
+        memmove( lnk.out, lnk.out + len, lnk.nout -= len);
+        return 0;
+    }
+    while (len > 0) {
+        if (lnk.shm) {
+            uint64_t rung;
+
+            if ((n = flexring_get( &lnk.ring.shm->to_client, p, len, lnk.ring.bell_server)) > 0) {
+                p += n;
+                len -= n;
+                continue;
+            }
+            flexring_kick( &lnk.ring.shm->to_server, lnk.ring.bell_server);
+            if (flexring_wait( &lnk.ring.shm->to_client))
+                continue;
+            if (poll( &pfd, 1, TIMEOUT) <= 0)
+                return -1;
+            if (read( lnk.ring.bell_client, &rung, sizeof(rung)) < 0)
+                return -1;
+            continue;
+        }
+        if (poll( &pfd, 1, TIMEOUT) <= 0 || (n = read( lnk.fd, p, len)) <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int get1( void)
+{
+    uint8_t byte;
+
+    return get( &byte, 1) < 0 ? -1 : byte;
+}
+
+/**
+ * Sync with the server, as the client does at start up
+ */
+static int sync_link( void)
+{
+    // A pty line may not be watched yet when the server starts: retry
+    for (int tries = 0; tries < 50; tries++) {
+        struct pollfd pfd = { lnk.fd, POLLIN, 0 };
+
+        put1( 0x55);
+        if (lnk.fd < 0 ? get1() == 0x55 :
+            poll( &pfd, 1, 100) > 0 && get1() == 0x55)
+            break;
+        if (tries == 49)
+            return -1;
+    }
+    put1( 0xAA);
+    return get1() == 0xAA ? 0 : -1;
+}
+
+/**
+ * Start a single port server on a pty, serving SYS.DSK, and sync
+ *
+ * @param option Extra option, NULL for none
+ */
+static int start_single( char *option)
+{
+    char device[64];
+
+    if (open_pty( device, sizeof(device)) < 0)
+        return -1;
+    start( (char *[]){ "-d", device, "-s", "19200", option ? option : "SYS.DSK",
+                       option ? "SYS.DSK" : NULL, NULL });
+    return sync_link();
+}
+
+/**
+ * Start a server on a YAML configuration holding one pty port, and sync
+ *
+ * @param drives The port's lines of the file after "drives:": its drives,
+ *               then any other key of the port
+ */
+static int start_config( const char *drives)
+{
+    char device[64];
+    FILE *f;
+
+    if (open_pty( device, sizeof(device)) < 0 || (f = fopen( "test.yaml", "w")) == NULL)
+        return -1;
+    fprintf( f, "ports:\n  - device: %s\n    speed: 19200\n    drives:\n%s", device, drives);
+    fclose( f);
+    start( (char *[]){ "-c", "test.yaml", NULL });
+    return sync_link();
+}
+
+/**
+ * Talk to the other port of a two port test
+ */
+static void swap_link( void)
+{
+    link_t other = lnk;
+
+    lnk = peer;
+    peer = other;
+}
+
+/**
+ * Start a server on a YAML configuration holding two pty ports, and sync
+ * both; the first one is lnk, the second one peer (see swap_link())
+ *
+ * @param drives, drives2 Lines after "drives:" of each port, as for
+ *                        start_config()
+ */
+static int start_ports( const char *drives, const char *drives2)
+{
+    char device[64], device2[64];
+    FILE *f;
+
+    if (open_pty( device2, sizeof(device2)) < 0)
+        return -1;
+    swap_link();
+    if (open_pty( device, sizeof(device)) < 0 || (f = fopen( "test.yaml", "w")) == NULL)
+        return -1;
+    fprintf( f, "ports:\n  - device: %s\n    speed: 19200\n    drives:\n%s"
+             "  - device: %s\n    speed: 19200\n    drives:\n%s", device, drives, device2, drives2);
+    fclose( f);
+    start( (char *[]){ "-c", "test.yaml", NULL });
+    if (sync_link() < 0)
+        return -1;
+    swap_link();
+    if (sync_link() < 0)
+        return -1;
+    swap_link();
+    return 0;
+}
+
+/**
+ * Ask for extensions
+ *
+ * @return Extensions granted (second byte in bits 8-15), -1 on error
+ */
+static int extensions( int wanted, int wanted2)
+{
+    uint8_t req[4] = { 'X', wanted2 >= 0 ? 2 : 1, wanted, wanted2 }, reply[5];
+    int len = wanted2 >= 0 ? 5 : 3;
+
+    put( req, wanted2 >= 0 ? 4 : 3);
+    if (get( reply, len) < 0 || reply[0] < 2)
+        return -1;
+    return reply[2] | (len == 5 ? reply[4] << 8 : 0);
+}
+
+/**
+ * Receive a sector frame, compressed or not
+ *
+ * @param wire Out: bytes it took on the line, NULL if not wanted
+ * @return 0 on success, -1 on time-out or a bad token, -2 on a bad checksum
+ */
+static int get_frame( uint8_t *data, int rle, int *wire)
+{
+    uint8_t trailer[2];
+    int n = 0, bytes = 2;
+
+    if (!rle) {
+        if (get( data, SECSIZE) < 0)
+            return -1;
+        n = bytes = SECSIZE;
+        bytes += 2;
+    }
+    while (n < SECSIZE) {
+        int c = get1(), len;
+
+        if (c < 0)
+            return -1;
+        len = c < 0x80 ? c + 1 : c - 0x7D;
+        if (n + len > SECSIZE)
+            return -1;
+        if (c < 0x80) {
+            if (get( data + n, len) < 0)
+                return -1;
+            bytes += 1 + len;
+        } else {
+            int b = get1();
+
+            if (b < 0)
+                return -1;
+            memset( data + n, b, len);
+            bytes += 2;
+        }
+        n += len;
+    }
+    if (get( trailer, 2) < 0)
+        return -1;
+    if (wire)
+        *wire = bytes;
+    return checksum( data, SECSIZE) == (trailer[0] << 8 | trailer[1]) ? 0 : -2;
+}
+
+/**
+ * Read a sector with 's' and ACK it
+ *
+ * @return 0 on success, -1 on time-out, -2 on a bad checksum
+ */
+static int read_sector( int drv, int trk, int sec, uint8_t *data, int rle)
+{
+    uint8_t cmd[4] = { 's', drv, trk, sec };
+    int err;
+
+    put( cmd, 4);
+    err = get_frame( data, rle, NULL);
+    put1( err ? NAK : ACK);
+    return err;
+}
+
+/**
+ * Write a sector with 'r'
+ *
+ * @return The server's answer, -1 on time-out
+ */
+static int write_sector( int drv, int trk, int sec, const uint8_t *data, int bad)
+{
+    uint8_t frame[4 + FRAMESIZE] = { 'r', drv, trk, sec };
+    int chks = checksum( data, SECSIZE) ^ bad;
+
+    memcpy( frame + 4, data, SECSIZE);
+    frame[4 + SECSIZE] = chks >> 8;
+    frame[5 + SECSIZE] = chks & 0xFF;
+    put( frame, sizeof(frame));
+    return get1();
+}
+
+/**
+ * Send a command with a CR-terminated parameter
+ */
+static void put_param( const uint8_t *cmd, int len, const char *param)
+{
+    put( cmd, len);
+    put( param, strlen( param));
+    put1( '\r');
+}
+
+/* Sector read and write, the plain protocol of the 6809 driver */
+static int test_sector( void)
+{
+    uint8_t buf[SECSIZE], data[SECSIZE];
+
+    CHECK( start_single( NULL) == 0, "no sync");
+    CHECK( read_sector( 0, 0, 3, buf, 0) == 0, "SIR read failed");
+    CHECK( memcmp( buf, sector( &sys_img, 0, 3), SECSIZE) == 0, "SIR differs");
+    CHECK( read_sector( 0, 2, 7, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 2, 7), SECSIZE) == 0,
+           "sector 2/7 differs");
+
+    for (int i = 0; i < SECSIZE; i++)
+        data[i] = i * 5;
+    CHECK( write_sector( 0, 3, 3, data, 0) == ACK, "write not ACKed");
+    CHECK( read_sector( 0, 3, 3, buf, 0) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "sector written reads back different");
+    CHECK( write_sector( 0, 3, 4, data, 1) == NAK, "bad checksum not NAKed");
+    CHECK( read_sector( 0, 3, 4, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 3, 4), SECSIZE) == 0,
+           "sector with a bad checksum was written");
+
+    // Off the disk: zeros, with their (good) checksum
+    CHECK( read_sector( 0, 200, 1, buf, 0) == 0 && buf[0] == 0 && !memcmp( buf, buf + 1, SECSIZE - 1),
+           "sector off the disk is not zeros");
+    put1( 'Q');
+    CHECK( get1() == ACK, "Q not ACKed");
+    return 0;
+}
+
+/* Commands arriving a byte at a time are put together; one left
+ * unfinished past the port timeout is dropped */
+static int test_parser( void)
+{
+    uint8_t buf[SECSIZE], frame[4 + FRAMESIZE] = { 'r', 0, 5, 9 };
+    int chks;
+
+    CHECK( start_config( "      - disk: SYS.DSK\n    timeout: 0.3\n") == 0, "no sync");
+    for (int i = 0; i < SECSIZE; i++)
+        frame[4 + i] = i ^ 0xA5;
+    chks = checksum( frame + 4, SECSIZE);
+    frame[4 + SECSIZE] = chks >> 8;
+    frame[5 + SECSIZE] = chks & 0xFF;
+    for (size_t i = 0; i < sizeof(frame); i++) {
+        put1( frame[i]);
+        usleep( 500);
+    }
+    CHECK( get1() == ACK, "write sent a byte at a time not ACKed");
+    CHECK( read_sector( 0, 5, 9, buf, 0) == 0 && memcmp( buf, frame + 4, SECSIZE) == 0,
+           "write sent a byte at a time reads back different");
+
+    // Stalled after the drive byte: the next 's' is a new command
+    put( (uint8_t []){ 's', 0 }, 2);
+    usleep( 600000);
+    CHECK( read_sector( 0, 2, 7, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 2, 7), SECSIZE) == 0,
+           "stalled command not dropped");
+    return 0;
+}
+
+/* 'T' reads: cut at the end of the track, nothing off the disk */
+static int test_track( void)
+{
+    uint8_t cmd[5] = { 'T', 0, 1, 16, 5 }, buf[SECSIZE];
+
+    CHECK( start_single( NULL) == 0, "no sync");
+
+    // 5 asked from sector 16 of 18: 3 come
+    put( cmd, 5);
+    CHECK( get1() == 3, "T not cut at the end of the track");
+    for (int s = 16; s <= 18; s++)
+        CHECK( get_frame( buf, 0, NULL) == 0 && memcmp( buf, sector( &sys_img, 1, s), SECSIZE) == 0,
+               "T frame of sector 1/%d differs", s);
+    put1( ACK);
+    cmd[2] = 200;
+    put( cmd, 5);
+    CHECK( get1() == 0, "T off the disk sends sectors");
+
+    // Still in step after the stream
+    CHECK( read_sector( 0, 0, 3, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 0, 3), SECSIZE) == 0,
+           "S after T differs");
+    return 0;
+}
+
+/* 'X' negotiation, both versions */
+static int test_extensions( void)
+{
+    uint8_t buf[SECSIZE], reply[5];
+
+    CHECK( start_single( NULL) == 0, "no sync");
+    put( (uint8_t []){ 'X', 1, 0x1F }, 3);
+    CHECK( get( reply, 3) == 0, "no answer to a version 1 X");
+    CHECK( reply[0] == 2 && reply[1] == (CAP_BULK | CAP_NOQ | CAP_CHAIN | CAP_COPY) &&
+           reply[2] == reply[1], "version 1 X answered %d %02X %02X", reply[0], reply[1], reply[2]);
+    put( (uint8_t []){ 'X', 2, CAP_RLE, CAP_LOOKUP }, 4);
+    CHECK( get( reply, 5) == 0, "no answer to a version 2 X");
+    CHECK( reply[2] == 0 && reply[3] == CAP_LOOKUP && reply[4] == CAP_LOOKUP,
+           "version 2 X answered %02X %02X %02X (compression not enabled)",
+           reply[2], reply[3], reply[4]);
+
+    CHECK( read_sector( 0, 0, 3, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 0, 3), SECSIZE) == 0,
+           "S after X differs");
+    return 0;
+}
+
+/* Compressed frames: every sector decodes to the image, none grows */
+static int test_rle( void)
+{
+    uint8_t buf[SECSIZE];
+    int wire, total = 0;
+
+    CHECK( start_single( "-z") == 0, "no sync");
+    CHECK( extensions( CAP_RLE, -1) == CAP_RLE, "compression not granted");
+    for (int s = 1; s <= 18; s++) {
+        put( (uint8_t []){ 's', 0, 4, s }, 4);
+        CHECK( get_frame( buf, 1, &wire) == 0, "compressed frame of 4/%d does not decode", s);
+        put1( ACK);
+        CHECK( memcmp( buf, sector( &sys_img, 4, s), SECSIZE) == 0, "4/%d decodes different", s);
+        CHECK( wire <= FRAMESIZE + 2, "4/%d took %d bytes", s, wire);
+        total += wire;
+    }
+    CHECK( total < 18 * FRAMESIZE * 3 / 4, "18 sectors took %d bytes", total);
+
+    put( (uint8_t []){ 'T', 0, 5, 1, 4 }, 5);
+    CHECK( get1() == 4, "T sector count");
+    for (int s = 1; s <= 4; s++)
+        CHECK( get_frame( buf, 1, NULL) == 0 && memcmp( buf, sector( &sys_img, 5, s), SECSIZE) == 0,
+               "compressed T frame of 5/%d differs", s);
+    put1( ACK);
+
+    // A sync drops the extensions: plain frames again
+    CHECK( sync_link() == 0, "no sync");
+    CHECK( read_sector( 0, 4, 4, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 4, 4), SECSIZE) == 0,
+           "plain frame after sync differs");
+    return 0;
+}
+
+/* 'L' streams: a whole file, and a NAK that stops the stream */
+static int test_chain( void)
+{
+    uint8_t *entry = sector( &sys_img, 0, 5) + 16, hdr[2], buf[SECSIZE];
+    int t = entry[13], s = entry[14], n = 0, sent = 0;
+
+    CHECK( start_single( NULL) == 0, "no sync");
+    CHECK( extensions( CAP_CHAIN, -1) == CAP_CHAIN, "chains not granted");
+
+    // The third frame is NAKed, and those already on their way
+    put( (uint8_t []){ 'L', 0, t, s, 4 }, 5);
+    for (;;) {
+        CHECK( get( hdr, 2) == 0, "stream stalled after %d frames", sent);
+        if (hdr[0] == 0 && hdr[1] == 0)
+            break;
+        CHECK( get_frame( buf, 0, NULL) == 0, "frame %d has a bad checksum", sent);
+        if (++sent >= 3) {
+            put1( NAK);
+            continue;
+        }
+        CHECK( hdr[0] == t && hdr[1] == s && memcmp( buf, sector( &sys_img, t, s), SECSIZE) == 0,
+               "frame %d is not sector %d/%d", sent, t, s);
+        t = buf[0];
+        s = buf[1];
+        n++;
+        put1( ACK);
+    }
+    CHECK( sent >= 3 && sent <= 6, "%d frames sent for a window of 4", sent);
+
+    // Again from the bad sector, to the end of the file
+    put( (uint8_t []){ 'L', 0, t, s, 8 }, 5);
+    for (;;) {
+        CHECK( get( hdr, 2) == 0, "second stream stalled after %d frames", n);
+        if (hdr[0] == 0 && hdr[1] == 0)
+            break;
+        CHECK( get_frame( buf, 0, NULL) == 0 && hdr[0] == t && hdr[1] == s &&
+               memcmp( buf, sector( &sys_img, t, s), SECSIZE) == 0,
+               "frame %d is not sector %d/%d", n, t, s);
+        t = buf[0];
+        s = buf[1];
+        n++;
+        put1( ACK);
+    }
+    CHECK( n == 12 && t == 0 && s == 0, "%d sectors of 12 streamed", n);
+    put1( 'Q');
+    CHECK( get1() == ACK, "out of step after the streams");
+    return 0;
+}
+
+/**
+ * Copy a file between drives with 'F'
+ *
+ * @return 0 on success, the FLEX error number, -1 on time-out
+ */
+static int copy( int src, int dst, const char *name)
+{
+    int reply;
+
+    put_param( (uint8_t []){ 'F', src, dst }, 3, name);
+    reply = get1();
+    return reply == ACK ? 0 : reply == NAK ? get1() : -1;
+}
+
+/* 'F' copies: the file lands in the free chain of the other drive */
+static int test_copy( void)
+{
+    uint8_t *src = sector( &sys_img, 0, 5) + 16, *dst, *sir;
+    int st, ss, dt, ds, n;
+
+    CHECK( start_config( "      - disk: SYS.DSK\n      - disk: DATA.DSK\n") == 0, "no sync");
+    CHECK( extensions( CAP_COPY, -1) == CAP_COPY, "copies not granted");
+    CHECK( (n = copy( 0, 1, "test.txt")) == 0, "copy failed (%d)", n);
+    CHECK( (n = copy( 0, 1, "TEST.TXT")) == 3, "copy over a file: %d", n);
+    CHECK( (n = copy( 0, 1, "NONE.TXT")) == 4, "copy of no file: %d", n);
+    CHECK( (n = copy( 1, 1, "TEST.TXT")) == 15, "copy on itself: %d", n);
+    CHECK( (n = copy( 0, 4, "TEST.TXT")) == 15, "copy to drive 4: %d", n);
+    CHECK( (n = copy( 0, 1, "1BAD")) == 21, "copy of a bad name: %d", n);
+    // Drives 2 and 3 are not configured: both reach drive 0
+    CHECK( (n = copy( 2, 3, "TEST.TXT")) == 15, "copy between unrouted drives: %d", n);
+    stop();
+
+    CHECK( read_image( "DATA.DSK", &data_img) == 0, "DATA.DSK unreadable");
+    dst = sector( &data_img, 0, 5) + 16;
+    sir = sector( &data_img, 0, 3);
+    CHECK( memcmp( dst, "TEST\0\0\0\0TXT", 11) == 0, "no TEST.TXT entry on the destination");
+    CHECK( dst[17] == 0 && dst[18] == 12, "entry counts %d sectors", dst[17] << 8 | dst[18]);
+    CHECK( (sir[0x21] << 8 | sir[0x22]) == 39 * 10 - 12, "free count not updated");
+    st = src[13], ss = src[14], dt = dst[13], ds = dst[14];
+    for (n = 0; dt && n < 12; n++) {
+        uint8_t *a = sector( &sys_img, st, ss), *b = sector( &data_img, dt, ds);
+
+        CHECK( memcmp( a + 2, b + 2, SECSIZE - 2) == 0, "sector %d of the copy differs", n);
+        st = a[0], ss = a[1], dt = b[0], ds = b[1];
+    }
+    CHECK( n == 12 && dt == 0 && ds == 0, "copy chain is %d sectors", n);
+    return 0;
+}
+
+/**
+ * Look a file up with 'N'
+ *
+ * @param name The 11 bytes of a directory entry
+ * @param reply Out: position and entry, 27 bytes
+ * @return 0 if found, the FLEX error number, -1 on time-out or a bad checksum
+ */
+static int lookup( const char *name, uint8_t *reply)
+{
+    uint8_t trailer[2];
+    int c;
+
+    put( (uint8_t []){ 'N', 0 }, 2);
+    put( name, 11);
+    if ((c = get1()) == NAK)
+        return get1();
+    if (c != ACK || get( reply, 3 + DIR_ENTSIZE) < 0 || get( trailer, 2) < 0)
+        return -1;
+    return checksum( reply, 3 + DIR_ENTSIZE) == (trailer[0] << 8 | trailer[1]) ? 0 : -1;
+}
+
+/* 'N' lookups: found, not found, and found after a directory write */
+static int test_lookup( void)
+{
+    uint8_t reply[3 + DIR_ENTSIZE], dir[SECSIZE];
+    int n;
+
+    CHECK( start_single( NULL) == 0, "no sync");
+    CHECK( extensions( 0, CAP_LOOKUP) == CAP_LOOKUP << 8, "lookups not granted");
+    CHECK( (n = lookup( "SHORT\0\0\0CMD", reply)) == 0, "SHORT.CMD not found (%d)", n);
+    CHECK( reply[0] == 0 && reply[1] == 5 && reply[2] == 16 + DIR_ENTSIZE,
+           "SHORT.CMD at %d/%d+%d", reply[0], reply[1], reply[2]);
+    CHECK( memcmp( reply + 3, sector( &sys_img, 0, 5) + 16 + DIR_ENTSIZE, DIR_ENTSIZE) == 0,
+           "SHORT.CMD entry differs");
+    CHECK( (n = lookup( "NONE\0\0\0\0TXT", reply)) == 4, "NONE.TXT lookup: %d", n);
+    CHECK( (n = lookup( "SHORT\0\0\0TXT", reply)) == 4, "SHORT.TXT lookup: %d", n);
+
+    // A directory sector written drops the index
+    memcpy( dir, sector( &sys_img, 0, 5), SECSIZE);
+    memcpy( dir + 16 + 2 * DIR_ENTSIZE, "NEW\0\0\0\0\0DAT", 11);
+    CHECK( write_sector( 0, 0, 5, dir, 0) == ACK, "directory write not ACKed");
+    CHECK( (n = lookup( "NEW\0\0\0\0\0DAT", reply)) == 0 && reply[2] == 16 + 2 * DIR_ENTSIZE,
+           "entry written is not found (%d)", n);
+    return 0;
+}
+
+/**
+ * Read what the server of the test printed (without -v)
+ */
+static int server_log( char *log, int size)
+{
+    int fd = open( "server.log", O_RDONLY);
+    int n = fd < 0 ? -1 : read( fd, log, size - 1);
+
+    if (fd >= 0)
+        close( fd);
+    log[n > 0 ? n : 0] = 0;
+    return n < 0 ? -1 : 0;
+}
+
+/* Sectors read ahead along a file: served from there, but never over a
+ * sector written since */
+static int test_prefetch( void)
+{
+    uint8_t *entry = sector( &sys_img, 0, 5) + 16, buf[SECSIZE], data[SECSIZE];
+    int trk[12], sec[12], t = entry[13], s = entry[14];
+    char log[4096], *hits;
+
+    for (int n = 0; n < 12; n++) {
+        trk[n] = t;
+        sec[n] = s;
+        t = sector( &sys_img, trk[n], sec[n])[0];
+        s = sector( &sys_img, trk[n], sec[n])[1];
+    }
+    memcpy( data, sector( &sys_img, trk[3], sec[3]), SECSIZE);
+    memset( data + 4, 0x4D, SECSIZE - 4);
+
+    // Record 4 is read ahead with record 2, then written
+    CHECK( start_single( "-vp4") == 0, "no sync");
+    for (int n = 0; n < 12; n++) {
+        CHECK( read_sector( 0, trk[n], sec[n], buf, 0) == 0, "record %d: read failed", n + 1);
+        CHECK( memcmp( buf, n == 3 ? data : sector( &sys_img, trk[n], sec[n]), SECSIZE) == 0,
+               "record %d (%d/%d) differs", n + 1, trk[n], sec[n]);
+        if (n == 1)
+            CHECK( write_sector( 0, trk[3], sec[3], data, 0) == ACK, "write of record 4 not ACKed");
+    }
+
+    put1( 'E');
+    CHECK( get1() == ACK, "exit not ACKed");
+    stop();
+    if (verbose)
+        return 0;
+    CHECK( server_log( log, sizeof(log)) == 0, "no server.log");
+    CHECK( (hits = strstr( log, "prefetch ")) != NULL && atoi( hits + 9) > 0,
+           "nothing served from the sectors read ahead");
+    return 0;
+}
+
+/**
+ * Name of the image a drive reaches, with 'd'
+ *
+ * @return 0 on success, -1 on time-out
+ */
+static int drive_image( int drv, char *name, int size)
+{
+    int c, n = 0;
+
+    put( (uint8_t []){ 'd', drv }, 2);
+    while ((c = get1()) >= 0 && c != ACK)
+        if (n < size - 1)
+            name[n++] = c;
+    name[n] = 0;
+    return c == ACK ? 0 : -1;
+}
+
+/* 'm' mounts per drive: configured or mounted drives are apart, the
+ * others reach drive 0 */
+static int test_drives( void)
+{
+    uint8_t buf[SECSIZE], data[SECSIZE];
+    char name[64];
+
+    CHECK( start_single( NULL) == 0, "no sync");
+    put_param( (uint8_t []){ 'm', 1 }, 2, "DATA");
+    CHECK( get1() == ACK && get1() == 'W', "DATA not mounted on drive 1");
+    CHECK( read_sector( 1, 0, 3, buf, 0) == 0 && memcmp( buf, sector( &data_img, 0, 3), SECSIZE) == 0,
+           "drive 1 is not DATA.DSK");
+    CHECK( read_sector( 0, 0, 3, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 0, 3), SECSIZE) == 0,
+           "drive 0 is not SYS.DSK");
+    CHECK( read_sector( 2, 0, 3, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 0, 3), SECSIZE) == 0,
+           "unrouted drive 2 is not drive 0");
+    CHECK( drive_image( 1, name, sizeof(name)) == 0 && strcmp( name, "DATA.DSK") == 0,
+           "drive 1 shows '%s'", name);
+    CHECK( drive_image( 2, name, sizeof(name)) == 0 && strcmp( name, "SYS.DSK") == 0,
+           "drive 2 shows '%s'", name);
+
+    memset( data, 0xE5, SECSIZE);
+    CHECK( write_sector( 1, 2, 2, data, 0) == ACK, "write on drive 1 not ACKed");
+    CHECK( read_sector( 1, 2, 2, buf, 0) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "drive 1 sector does not read back");
+    CHECK( read_sector( 0, 2, 2, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 2, 2), SECSIZE) == 0,
+           "write on drive 1 reached drive 0");
+
+    // A failed mount leaves the drive routed, with no image: it reads
+    // zeros, not drive 0 (last test, the byte after that frame is left)
+    put_param( (uint8_t []){ 'm', 3 }, 2, "NOPE");
+    CHECK( get1() == NAK, "mount of no image ACKed");
+    memset( data, 0, SECSIZE);
+    put( (uint8_t []){ 's', 3, 0, 3 }, 4);
+    CHECK( get( buf, SECSIZE) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "drive 3 reads a sector without an image");
+    return 0;
+}
+
+/* Two ports served at once, each on its own images: a command left
+ * half sent on one port does not hold up the other */
+static int test_ports( void)
+{
+    uint8_t buf[SECSIZE], data[SECSIZE];
+
+    CHECK( start_ports( "      - disk: SYS.DSK\n", "      - disk: DATA.DSK\n") == 0, "no sync");
+    put( (uint8_t []){ 's', 0 }, 2);
+
+    swap_link();
+    CHECK( read_sector( 0, 0, 3, buf, 0) == 0 && memcmp( buf, sector( &data_img, 0, 3), SECSIZE) == 0,
+           "second port is not DATA.DSK");
+    memset( data, 0x5A, SECSIZE);
+    CHECK( write_sector( 0, 39, 10, data, 0) == ACK, "write on the second port not ACKed");
+    swap_link();
+
+    put( (uint8_t []){ 2, 7 }, 2);
+    CHECK( get_frame( buf, 0, NULL) == 0 && memcmp( buf, sector( &sys_img, 2, 7), SECSIZE) == 0,
+           "first port is not SYS.DSK");
+    put1( ACK);
+    CHECK( read_sector( 0, 34, 18, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 34, 18), SECSIZE) == 0,
+           "first port: 34/18 differs");
+
+    swap_link();
+    CHECK( read_sector( 0, 39, 10, buf, 0) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "second port: sector written reads back different");
+    swap_link();
+    return 0;
+}
+
+/* Sector cache, shared by the ports: a sector written on one port is
+ * what the other reads, and sectors read again come from the cache */
+static int test_cache( void)
+{
+    uint8_t buf[SECSIZE], data[SECSIZE];
+    char log[4096], *hits;
+
+    CHECK( start_ports( "      - disk: SYS.DSK\n    io: pread\n",
+                        "      - disk: SYS.DSK\n    io: pread\n") == 0, "no sync");
+    for (int pass = 0; pass < 2; pass++)
+        for (int s = 1; s <= 18; s++)
+            CHECK( read_sector( 0, 6, s, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 6, s), SECSIZE) == 0,
+                   "pass %d: 6/%d differs", pass, s);
+
+    swap_link();
+    CHECK( read_sector( 0, 6, 9, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 6, 9), SECSIZE) == 0,
+           "second port: 6/9 differs");
+    memset( data, 0x3C, SECSIZE);
+    CHECK( write_sector( 0, 6, 9, data, 0) == ACK, "write on the second port not ACKed");
+    swap_link();
+    CHECK( read_sector( 0, 6, 9, buf, 0) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "first port reads 6/9 as it was");
+
+    // Statistics on SIGUSR1, written out at exit
+    kill( srv, SIGUSR1);
+    put1( 'Q');
+    CHECK( get1() == ACK, "Q not ACKed");
+    stop();
+    if (verbose)
+        return 0;
+    CHECK( server_log( log, sizeof(log)) == 0, "no server.log");
+    CHECK( (hits = strstr( log, "Sector cache: ")) != NULL && atoi( hits + 14) >= 18,
+           "sectors read again not served from the cache");
+    return 0;
+}
+
+/* Each port has its own mounts: RMOUNT on one leaves the other's drive
+ * where it was */
+static int test_contexts( void)
+{
+    uint8_t buf[SECSIZE];
+    char name[64];
+
+    CHECK( start_ports( "      - disk: SYS.DSK\n", "      - disk: SYS.DSK\n") == 0, "no sync");
+    put_param( (uint8_t []){ 'M' }, 1, "DATA");
+    CHECK( get1() == ACK && get1() == 'W', "DATA not mounted on the first port");
+    CHECK( read_sector( 0, 39, 10, buf, 0) == 0 && memcmp( buf, sector( &data_img, 39, 10), SECSIZE) == 0,
+           "first port is not DATA.DSK");
+
+    swap_link();
+    CHECK( drive_image( 0, name, sizeof(name)) == 0 && strcmp( name, "SYS.DSK") == 0,
+           "second port shows '%s'", name);
+    CHECK( read_sector( 0, 34, 18, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 34, 18), SECSIZE) == 0,
+           "second port is not SYS.DSK any more");
+    swap_link();
+    CHECK( drive_image( 0, name, sizeof(name)) == 0 && strcmp( name, "DATA.DSK") == 0,
+           "first port shows '%s'", name);
+    return 0;
+}
+
+/**
+ * List the images (A) or directories (I) of the current directory
+ *
+ * @param names Out: the names, each followed by a space
+ * @return 0 on success, -1 on time-out or a broken listing
+ */
+static int listing( int cmd, const char *pattern, char *names, int size)
+{
+    int c, n = 0;
+
+    put_param( (uint8_t []){ cmd }, 1, pattern);
+    if (cmd == 'I')
+        put1( ' ');
+    if (get1() != CR || get1() != LF)
+        return -1;
+    for (;;) {
+        put1( ' ');
+        if ((c = get1()) == ACK)
+            break;
+        for (; c >= 0 && c != CR; c = get1())
+            if (n < size - 2)
+                names[n++] = c;
+        if (c < 0 || get1() != LF)
+            return -1;
+        names[n++] = ' ';
+    }
+    names[n] = 0;
+    return 0;
+}
+
+/* Listings come from a cache, which sees the directory change */
+static int test_listing( void)
+{
+    char names[1024];
+    FILE *f;
+
+    CHECK( start_single( NULL) == 0, "no sync");
+    CHECK( listing( 'A', "", names, sizeof(names)) == 0, "RDIR failed");
+    CHECK( strstr( names, "DATA.DSK ") && strstr( names, "SYS.DSK ") && !strstr( names, "NEW.DSK "),
+           "RDIR lists '%s'", names);
+    CHECK( listing( 'I', "", names, sizeof(names)) == 0 && !strstr( names, "NEWDIR "),
+           "RLIST lists '%s'", names);
+
+    CHECK( (f = fopen( "NEW.DSK", "w")) != NULL && fclose( f) == 0, "cannot create NEW.DSK");
+    CHECK( mkdir( "NEWDIR", 0755) == 0, "cannot create NEWDIR");
+    usleep( 100000);
+    CHECK( listing( 'A', "", names, sizeof(names)) == 0 && strstr( names, "NEW.DSK "),
+           "new image not listed: '%s'", names);
+    CHECK( listing( 'I', "", names, sizeof(names)) == 0 && strstr( names, "NEWDIR "),
+           "new directory not listed: '%s'", names);
+
+    unlink( "NEW.DSK");
+    rmdir( "NEWDIR");
+    usleep( 100000);
+    CHECK( listing( 'A', "", names, sizeof(names)) == 0 && !strstr( names, "NEW.DSK "),
+           "removed image still listed: '%s'", names);
+    CHECK( listing( 'I', "", names, sizeof(names)) == 0 && !strstr( names, "NEWDIR "),
+           "removed directory still listed: '%s'", names);
+    return 0;
+}
+
+/* RDIR patterns are name prefixes, case ignored, listed in order */
+static int test_prefix( void)
+{
+    static const char *const images[] = { "GO.DSK", "games.dsk", "GAMMA.DSK" };
+    char names[1024];
+    FILE *f;
+
+    for (int i = 0; i < 3; i++)
+        CHECK( (f = fopen( images[i], "w")) != NULL && fclose( f) == 0, "cannot create %s", images[i]);
+    CHECK( start_single( NULL) == 0, "no sync");
+    CHECK( listing( 'A', "ga", names, sizeof(names)) == 0 && strcmp( names, "games.dsk GAMMA.DSK ") == 0,
+           "'ga' lists '%s'", names);
+    CHECK( listing( 'A', "G", names, sizeof(names)) == 0 && strcmp( names, "games.dsk GAMMA.DSK GO.DSK ") == 0,
+           "'G' lists '%s'", names);
+    CHECK( listing( 'A', "GX", names, sizeof(names)) == 0 && names[0] == 0, "'GX' lists '%s'", names);
+
+    // ESC ends a listing early
+    put_param( (uint8_t []){ 'A' }, 1, "G");
+    CHECK( get1() == CR && get1() == LF, "no listing");
+    put1( ' ');
+    CHECK( get( names, 11) == 0 && memcmp( names, "games.dsk\r\n", 11) == 0, "first name wrong");
+    put1( 0x1B);
+    CHECK( get1() == ACK, "ESC did not end the listing");
+    for (int i = 0; i < 3; i++)
+        unlink( images[i]);
+    return 0;
+}
+
+/**
+ * Current directory of the port, with '?'
+ *
+ * @return 0 on success, -1 on time-out
+ */
+static int current_dir( char *path, int size)
+{
+    int c, n = 0;
+
+    put1( '?');
+    while ((c = get1()) >= 0 && c != CR)
+        if (n < size - 1)
+            path[n++] = c;
+    path[n] = 0;
+    return c == CR && get1() == ACK ? 0 : -1;
+}
+
+/* RCD moves one port only, and it stays in its directory when that is
+ * renamed */
+static int test_chdir( void)
+{
+    uint8_t buf[SECSIZE];
+    char path[PATH_MAX], names[1024];
+    image_t inner;
+
+    CHECK( mkdir( "sub", 0755) == 0, "cannot create sub");
+    new_image( &inner, "INNER.DSK", 20, 10);
+    snprintf( inner.name, sizeof(inner.name), "sub/INNER.DSK");
+    CHECK( write_image( &inner) == 0, "cannot write sub/INNER.DSK");
+    CHECK( start_ports( "      - disk: SYS.DSK\n", "      - disk: SYS.DSK\n") == 0, "no sync");
+    put_param( (uint8_t []){ 'P' }, 1, "nope");
+    CHECK( get1() == NAK, "RCD to no directory ACKed");
+    put_param( (uint8_t []){ 'P' }, 1, "sub");
+    CHECK( get1() == ACK, "RCD sub not ACKed");
+    CHECK( current_dir( path, sizeof(path)) == 0 && strcmp( path + strlen( path) - 4, "/sub") == 0,
+           "first port is in '%s'", path);
+    CHECK( listing( 'A', "", names, sizeof(names)) == 0 && strcmp( names, "INNER.DSK ") == 0,
+           "sub lists '%s'", names);
+
+    swap_link();
+    CHECK( current_dir( path, sizeof(path)) == 0 && strcmp( path, scratch) == 0,
+           "second port is in '%s'", path);
+    put_param( (uint8_t []){ 'M' }, 1, "INNER");
+    CHECK( get1() == NAK, "second port mounts an image of sub");
+    swap_link();
+
+    CHECK( rename( "sub", "sub2") == 0, "cannot rename sub");
+    put_param( (uint8_t []){ 'M' }, 1, "INNER");
+    CHECK( get1() == ACK && get1() == 'W', "INNER not mounted after the rename");
+    CHECK( read_sector( 0, 19, 10, buf, 0) == 0 && memcmp( buf, sector( &inner, 19, 10), SECSIZE) == 0,
+           "drive 0 is not INNER.DSK");
+    put_param( (uint8_t []){ 'P' }, 1, "..");
+    CHECK( get1() == ACK, "RCD .. not ACKed");
+    CHECK( listing( 'A', "SYS", names, sizeof(names)) == 0 && strcmp( names, "SYS.DSK ") == 0,
+           "back from sub2, lists '%s'", names);
+    free( inner.data);
+    unlink( "sub2/INNER.DSK");
+    rmdir( "sub2");
+    return 0;
+}
+
+/* Line speeds off the Bxxx table are set; a speed that is no number is
+ * refused */
+static int test_speed( void)
+{
+    uint8_t buf[SECSIZE];
+    char device[64], log[4096];
+    int status;
+
+    CHECK( start_single( "-vs250000") == 0, "no sync at 250000 bauds");
+    CHECK( read_sector( 0, 2, 7, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 2, 7), SECSIZE) == 0,
+           "sector 2/7 differs");
+    stop();
+    CHECK( verbose || (server_log( log, sizeof(log)) == 0 && strstr( log, "speed is 250000 bauds")),
+           "line not set to 250000 bauds");
+
+    CHECK( open_pty( device, sizeof(device)) == 0, "no pty");
+    start( (char *[]){ "-d", device, "-s", "fast", "SYS.DSK", NULL });
+    waitpid( srv, &status, 0);
+    srv = -1;
+    CHECK( WIFEXITED( status) && WEXITSTATUS( status) == 1, "speed 'fast' not refused");
+    return 0;
+}
+
+/* Flow control and pacing: XON/XOFF is refused, RTS/CTS serves, and NAKs
+ * slow the output down without changing it */
+static int test_pacing( void)
+{
+    uint8_t buf[SECSIZE];
+    char device[64], log[4096];
+    int status;
+    FILE *f;
+
+    CHECK( open_pty( device, sizeof(device)) == 0 && (f = fopen( "test.yaml", "w")) != NULL, "no pty");
+    fprintf( f, "ports:\n  - device: %s\n    speed: 19200\n    flow: xonxoff\n"
+             "    drives:\n      - disk: SYS.DSK\n", device);
+    fclose( f);
+    start( (char *[]){ "-c", "test.yaml", NULL });
+    waitpid( srv, &status, 0);
+    srv = -1;
+    CHECK( WIFEXITED( status) && WEXITSTATUS( status) != 0, "flow xonxoff not refused");
+    stop();
+
+    CHECK( start_config( "      - disk: SYS.DSK\n    flow: rtscts\n    pacing: adaptive\n") == 0, "no sync");
+    for (int s = 1; s <= 6; s++) {
+        put( (uint8_t []){ 's', 0, 1, s }, 4);
+        CHECK( get_frame( buf, 0, NULL) == 0, "1/%d: bad frame", s);
+        put1( NAK);
+    }
+    for (int s = 1; s <= 18; s++)
+        CHECK( read_sector( 0, 3, s, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 3, s), SECSIZE) == 0,
+               "paced 3/%d differs", s);
+    stop();
+    CHECK( verbose || (server_log( log, sizeof(log)) == 0 && strstr( log, "pacing level 3")),
+           "output not slowed down by the NAKs");
+    return 0;
+}
+
+/* Geometry cache: an image mounted again unchanged takes its geometry
+ * from the cache, a rewritten one is checked again */
+static int test_geometry( void)
+{
+    uint8_t buf[SECSIZE];
+    char log[4096];
+
+    CHECK( start_single( "-v") == 0, "no sync");
+    put_param( (uint8_t []){ 'm', 1 }, 2, "DATA");
+    CHECK( get1() == ACK && get1() == 'W', "DATA not mounted on drive 1");
+    put_param( (uint8_t []){ 'm', 1 }, 2, "SYS");
+    CHECK( get1() == ACK && get1() == 'W', "SYS not mounted on drive 1");
+    CHECK( read_sector( 1, 34, 18, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 34, 18), SECSIZE) == 0,
+           "cached geometry of SYS.DSK is wrong");
+
+    // Same name, another geometry
+    new_image( &data_img, "DATA.DSK", 30, 16);
+    CHECK( write_image( &data_img) == 0, "cannot rewrite DATA.DSK");
+    put_param( (uint8_t []){ 'm', 1 }, 2, "DATA");
+    CHECK( get1() == ACK && get1() == 'W', "DATA not mounted again on drive 1");
+    CHECK( read_sector( 1, 29, 16, buf, 0) == 0 && memcmp( buf, sector( &data_img, 29, 16), SECSIZE) == 0,
+           "stale geometry for the rewritten DATA.DSK");
+
+    // With -v, the exit reports the statistics (to the terminal with -v)
+    put1( 'E');
+    CHECK( get1() == ACK, "exit not ACKed");
+    stop();
+    if (verbose)
+        return 0;
+    CHECK( server_log( log, sizeof(log)) == 0, "no server.log");
+    CHECK( strstr( log, "Geometry cache: 1 hits, 3 images checked") != NULL, "log: %.200s",
+           strstr( log, "Geometry") ? strstr( log, "Geometry") : "no geometry cache line");
+    return 0;
+}
+
+/* Overlay drives: writes go to the delta, the image stays as it was */
+static int test_overlay( void)
+{
+    uint8_t buf[SECSIZE], data[SECSIZE];
+    image_t base = sys_img;
+    int n;
+    struct stat st;
+
+    CHECK( start_config( "      - disk: SYS.DSK\n        overlay: sys.delta\n") == 0, "no sync");
+    memset( data, 0x5A, SECSIZE);
+    CHECK( write_sector( 0, 3, 3, data, 0) == ACK, "write not ACKed");
+    CHECK( read_sector( 0, 3, 3, buf, 0) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "sector written reads back different");
+    CHECK( read_sector( 0, 3, 4, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 3, 4), SECSIZE) == 0,
+           "sector not written differs");
+    stop();
+
+    base.data = malloc( (long)base.ntrk * base.nsec * SECSIZE);
+    CHECK( read_image( "SYS.DSK", &base) == 0, "SYS.DSK unreadable");
+    n = memcmp( base.data, sys_img.data, (long)base.ntrk * base.nsec * SECSIZE);
+    free( base.data);
+    CHECK( n == 0, "base image was written");
+    CHECK( stat( "sys.delta", &st) == 0 && st.st_size > 0, "no delta file");
+    return 0;
+}
+
+/**
+ * Serve SYS.DSK on a socket or the rings, and read it back
+ *
+ * @param device As for -d
+ * @param busy Check a second client is turned away
+ */
+static int socket_test( const char *device, int busy)
+{
+    uint8_t buf[SECSIZE];
+
+    start( (char *[]){ "-d", (char *)device, "SYS.DSK", NULL });
+    CHECK( connect_to( device) == 0, "no connection to %s", device);
+    CHECK( sync_link() == 0, "no sync");
+    for (int s = 1; s <= 18; s++)
+        CHECK( read_sector( 0, 1, s, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 1, s), SECSIZE) == 0,
+               "1/%d differs", s);
+    memset( buf, 0xC3, SECSIZE);
+    CHECK( write_sector( 0, 2, 1, buf, 0) == ACK, "write not ACKed");
+    CHECK( write_sector( 0, 2, 1, buf, 1) == NAK, "bad checksum ACKed");
+    CHECK( read_sector( 0, 2, 1, buf, 0) == 0 && buf[0] == 0xC3 && buf[SECSIZE - 1] == 0xC3,
+           "sector written reads back different");
+
+    if (busy) {
+        link_t first = lnk;
+        struct pollfd pfd = { -1, POLLIN, 0 };
+        char c;
+        int closed;
+
+        CHECK( connect_to( device) == 0, "second connection not accepted at all");
+        pfd.fd = lnk.fd;
+        closed = poll( &pfd, 1, TIMEOUT) == 1 && read( lnk.fd, &c, 1) == 0;
+        close( lnk.fd);
+        lnk = first;
+        CHECK( closed, "second client not closed");
+        CHECK( read_sector( 0, 1, 1, buf, 0) == 0, "first client dropped");
+    }
+    return 0;
+}
+
+/* TCP and Unix domain sockets: one client at a time */
+static int test_tcp( void)
+{
+    char device[64];
+
+    snprintf( device, sizeof(device), "tcp://127.0.0.1:%d", 20000 + getpid() % 20000);
+    return socket_test( device, 1);
+}
+
+static int test_unix( void)
+{
+    char device[PATH_MAX];
+
+    snprintf( device, sizeof(device), "unix:%s/test.sock", scratch);
+    return socket_test( device, 1);
+}
+
+/* Shared memory rings */
+static int test_shm( void)
+{
+    char device[PATH_MAX];
+
+    snprintf( device, sizeof(device), "shm:%s/ring.sock", scratch);
+    return socket_test( device, 0);
+}
+
+/* An overlay on an image ending in a partial track: the rest of that
+ * track is outside the delta */
+static int test_overlay_tail( void)
+{
+    uint8_t buf[SECSIZE], data[SECSIZE];
+    int fd;
+
+    memset( buf, 0, SECSIZE);
+    CHECK( (fd = open( "SYS.DSK", O_WRONLY | O_APPEND)) >= 0, "SYS.DSK: %s", strerror( errno));
+    for (int s = 0; s < 5; s++)
+        CHECK( write( fd, buf, SECSIZE) == SECSIZE, "SYS.DSK: %s", strerror( errno));
+    close( fd);
+
+    CHECK( start_config( "      - disk: SYS.DSK\n        overlay: tail.delta\n") == 0, "no sync");
+    memset( data, 0x3C, SECSIZE);
+    CHECK( write_sector( 0, 35, 5, data, 0) == ACK, "write on the partial track not ACKed");
+    CHECK( write_sector( 0, 35, 6, data, 0) == NAK, "write past the image ACKed");
+    CHECK( write_sector( 0, 35, 18, data, 0) == NAK, "write past the image ACKed");
+    CHECK( read_sector( 0, 35, 5, buf, 0) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "sector written on the partial track differs");
+    CHECK( read_sector( 0, 1, 1, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 1, 1), SECSIZE) == 0,
+           "image sector differs after writes past the image");
+    return 0;
+}
+
+/* Sectors of an emulated drive, an image in memory */
+static long emu_sectors( void *ctx, int drive)
+{
+    image_t *img = ctx;
+
+    (void)drive;
+    return (long)img->ntrk * img->nsec;
+}
+
+static int emu_read( void *ctx, int drive, long blk, uint8_t *buf)
+{
+    image_t *img = ctx;
+
+    (void)drive;
+    memcpy( buf, img->data + blk * SECSIZE, SECSIZE);
+    return 0;
+}
+
+static int emu_write( void *ctx, int drive, long blk, const uint8_t *data)
+{
+    image_t *img = ctx;
+
+    (void)drive;
+    memcpy( img->data + blk * SECSIZE, data, SECSIZE);
+    return 0;
+}
+
+/* libflexnet sessions, in process: a drive attached, an image mounted */
+static int test_session( void)
+{
+    static const flexnet_disk_t disk = { emu_sectors, emu_read, emu_write };
+    uint8_t frame[4 + FRAMESIZE] = { 'R', 0, 3, 3 }, buf[SECSIZE];
+    long size = (long)sys_img.ntrk * sys_img.nsec * SECSIZE;
+    image_t emu = sys_img;
+    char name[64];
+    int chks;
+
+    emu.data = malloc( size);
+    memcpy( emu.data, sys_img.data, size);
+    CHECK( (lnk.session = flexnet_open( NULL)) != NULL, "no session: %s", strerror( errno));
+    CHECK( flexnet_attach( lnk.session, 0, "EMU.DSK", &disk, &emu) == 0, "attach failed");
+    CHECK( flexnet_mount( lnk.session, 1, "DATA.DSK") == 0, "DATA.DSK not mounted");
+    CHECK( sync_link() == 0, "no sync");
+
+    CHECK( read_sector( 0, 0, 3, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 0, 3), SECSIZE) == 0,
+           "SIR of the attached drive differs");
+    CHECK( read_sector( 1, 0, 3, buf, 0) == 0 && memcmp( buf, sector( &data_img, 0, 3), SECSIZE) == 0,
+           "SIR of the mounted drive differs");
+    for (int i = 0; i < SECSIZE; i++)
+        frame[4 + i] = i ^ 0xA5;
+    chks = checksum( frame + 4, SECSIZE);
+    frame[4 + SECSIZE] = chks >> 8;
+    frame[5 + SECSIZE] = chks & 0xFF;
+    put( frame, sizeof(frame));
+    CHECK( get1() == ACK, "R not ACKed");
+    CHECK( memcmp( sector( &emu, 3, 3), frame + 4, SECSIZE) == 0, "R did not reach the emulator's sectors");
+    CHECK( read_sector( 0, 3, 3, buf, 0) == 0 && memcmp( buf, frame + 4, SECSIZE) == 0,
+           "sector written reads back different");
+    CHECK( drive_image( 0, name, sizeof(name)) == 0 && strcmp( name, "EMU.DSK") == 0,
+           "drive 0 shows '%s'", name);
+
+    // Input and output a byte at a time, as an emulated ACIA moves them
+    for (int i = 0; i < 4; i++)
+        CHECK( flexnet_input( lnk.session, (uint8_t []){ 's', 0, 0, 3 } + i, 1) == 1,
+               "command byte %d not taken", i);
+    for (int i = 0; i < FRAMESIZE; i++)
+        CHECK( flexnet_output( lnk.session, buf, 1) == 1, "frame byte %d missing", i);
+    CHECK( flexnet_output( lnk.session, buf, 1) == 0, "bytes past the frame");
+    put1( ACK);
+    stop();
+    free( emu.data);
+    return 0;
+}
+
+/**
+ * Read a sector from an image file, as the server left it
+ */
+static int file_sector( image_t *img, int trk, int sec, uint8_t *buf)
+{
+    int fd = open( img->name, O_RDONLY);
+    int n = fd < 0 ? -1 : pread( fd, buf, SECSIZE, sector( img, trk, sec) - img->data);
+
+    if (fd >= 0)
+        close( fd);
+    return n == SECSIZE ? 0 : -1;
+}
+
+/* Images mapped in memory: sectors read from the mapping, writes on the
+ * file once the server is stopped */
+static int test_mmap( void)
+{
+    uint8_t buf[SECSIZE], data[SECSIZE];
+
+    CHECK( start_config( "      - disk: SYS.DSK\n    io: mmap\n") == 0, "no sync");
+    for (int s = 1; s <= 18; s++)
+        CHECK( read_sector( 0, 34, s, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 34, s), SECSIZE) == 0,
+               "34/%d differs", s);
+    for (int i = 0; i < SECSIZE; i++)
+        data[i] = 255 - i;
+    CHECK( write_sector( 0, 34, 18, data, 0) == ACK, "write not ACKed");
+    CHECK( read_sector( 0, 34, 18, buf, 0) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "sector written reads back different");
+    CHECK( read_sector( 0, 34, 17, buf, 0) == 0 && memcmp( buf, sector( &sys_img, 34, 17), SECSIZE) == 0,
+           "write reached 34/17");
+    stop();
+    CHECK( file_sector( &sys_img, 34, 18, buf) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "write not on the image");
+    return 0;
+}
+
+/**
+ * Held sectors: served from the write-back buffer at once, on the image
+ * after the delay (interval), or once the line is quiet (on-idle), and
+ * at shutdown
+ */
+static int durability_test( const char *mode)
+{
+    uint8_t buf[SECSIZE], data[SECSIZE];
+    char drives[160];
+    int idle = strcmp( mode, "on-idle") == 0;
+
+    snprintf( drives, sizeof(drives), "      - disk: SYS.DSK\n"
+              "    io: pread\n    durability: %s\n    interval: 0.3\n", mode);
+    CHECK( start_config( drives) == 0, "no sync");
+    memset( data, 0x77, SECSIZE);
+    CHECK( write_sector( 0, 4, 2, data, 0) == ACK, "write not ACKed");
+    CHECK( read_sector( 0, 4, 2, buf, 0) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "held sector not served");
+    CHECK( file_sector( &sys_img, 4, 2, buf) == 0 && memcmp( buf, sector( &sys_img, 4, 2), SECSIZE) == 0,
+           "sector on the image before its write back");
+
+    // A busy line for twice the delay
+    for (int i = 0; i < 12; i++) {
+        usleep( 50000);
+        CHECK( read_sector( 0, 1, 1, buf, 0) == 0, "read %d failed", i);
+    }
+    CHECK( file_sector( &sys_img, 4, 2, buf) == 0 &&
+           memcmp( buf, idle ? sector( &sys_img, 4, 2) : data, SECSIZE) == 0,
+           idle ? "written back while the line is busy" : "not written back after the delay");
+    usleep( 600000);
+    CHECK( file_sector( &sys_img, 4, 2, buf) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "not written back once quiet");
+
+    memset( data, 0x88, SECSIZE);
+    CHECK( write_sector( 0, 4, 3, data, 0) == ACK, "second write not ACKed");
+    stop();
+    CHECK( file_sector( &sys_img, 4, 3, buf) == 0 && memcmp( buf, data, SECSIZE) == 0,
+           "not written back at shutdown");
+    return 0;
+}
+
+static int test_interval( void)
+{
+    return durability_test( "interval");
+}
+
+static int test_idle( void)
+{
+    return durability_test( "on-idle");
+}
+
+static const struct {
+    const char *name;
+    int (*run)( void);
+} tests[] = {
+    { "sector read/write", test_sector },
+    { "split commands", test_parser },
+    { "mapped images", test_mmap },
+    { "durability interval", test_interval },
+    { "durability on-idle", test_idle },
+    { "T streams", test_track },
+    { "extensions", test_extensions },
+    { "compressed frames", test_rle },
+    { "chain streams, NAK", test_chain },
+    { "prefetch", test_prefetch },
+    { "file copies", test_copy },
+    { "directory lookups", test_lookup },
+    { "image listings", test_listing },
+    { "listing patterns", test_prefix },
+    { "directory per port", test_chdir },
+    { "line speeds", test_speed },
+    { "flow control, pacing", test_pacing },
+    { "drive routing", test_drives },
+    { "two ports", test_ports },
+    { "port contexts", test_contexts },
+    { "shared sector cache", test_cache },
+    { "geometry cache", test_geometry },
+    { "overlay drive", test_overlay },
+    { "overlay, partial track", test_overlay_tail },
+    { "tcp socket", test_tcp },
+    { "unix socket", test_unix },
+    { "shared memory rings", test_shm },
+    { "libflexnet session", test_session },
+};
+
+int main( int argc, char **argv)
+{
+    int failed = 0, opt;
+
+    while ((opt = getopt( argc, argv, "v")) != -1) {
+        if (opt != 'v') {
+            fprintf( stderr, "Usage: %s [-v] <server binary>\n", argv[0]);
+            exit( 1);
+        }
+        verbose = 1;
+    }
+    if (argc - optind != 1 || realpath( argv[optind], server) == NULL) {
+        fprintf( stderr, "Usage: %s [-v] <server binary>\n", argv[0]);
+        exit( 1);
+    }
+    signal( SIGPIPE, SIG_IGN);
+    if (mkdtemp( scratch) == NULL || chdir( scratch) < 0) {
+        perror( scratch);
+        exit( 1);
+    }
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        // Fresh images for each test
+        new_image( &sys_img, "SYS.DSK", 35, 18);
+        new_image( &data_img, "DATA.DSK", 40, 10);
+        add_file( &sys_img, "TEST", "TXT", 12);
+        add_file( &sys_img, "SHORT", "CMD", 1);
+        if (write_image( &sys_img) < 0 || write_image( &data_img) < 0)
+            exit( 1);
+
+        why[0] = 0;
+        printf( "%-24s ", tests[i].name);
+        fflush( stdout);
+        if (tests[i].run() < 0) {
+            printf( "FAILED: %s\n", why);
+            failed++;
+        } else {
+            printf( "ok\n");
+        }
+        stop();
+        free( sys_img.data);
+        free( data_img.data);
+    }
+
+    if (!verbose)
+        system( "rm -rf -- \"$PWD\"");
+    printf( "%d of %d tests failed\n", failed, (int)(sizeof(tests) / sizeof(tests[0])));
+    return failed ? 1 : 0;
+}